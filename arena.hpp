@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+
+#include <Windows.h>
+#include <Memoryapi.h>
+
+namespace jit {
+
+// Executable memory shared by all jitted code. Hot code is packed together at the front
+// and code that rarely runs is kept apart at the back, so it does not take up space in
+// the instruction cache or pages next to the hot loops.
+struct CodeArena {
+	static constexpr size_t HOT_SIZE = 4 * 1024 * 1024;
+	static constexpr size_t COLD_SIZE = 1024 * 1024;
+
+	uint8_t* _base = nullptr;
+	size_t _hot_size;
+	size_t _cold_size;
+	size_t _hot_used = 0;
+	size_t _cold_used = 0;
+
+	CodeArena(size_t hot_size = HOT_SIZE, size_t cold_size = COLD_SIZE)
+		: _hot_size(hot_size), _cold_size(cold_size) {
+		// One allocation so a rel32 jump can always reach from hot to cold code
+		_base = (uint8_t*)VirtualAlloc(nullptr, _hot_size + _cold_size,
+			MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+		if (!_base) {
+			_hot_size = 0;
+			_cold_size = 0;
+		}
+	}
+
+	~CodeArena() {
+		if (_base) {
+			if (VirtualFree((LPVOID)_base, 0, MEM_RELEASE) == 0) {
+				std::cout << "FAILED TO FREE CODE PAGE\n";
+			}
+		}
+	}
+
+	CodeArena(const CodeArena&) = delete;
+	CodeArena& operator=(const CodeArena&) = delete;
+
+	uint8_t* hot_cursor() { return _base + _hot_used; }
+	size_t hot_left() const { return _hot_size - _hot_used; }
+
+	uint8_t* cold_cursor() { return _base + _hot_size + _cold_used; }
+	size_t cold_left() const { return _cold_size - _cold_used; }
+
+	// Claim the bytes written at the cursors.
+	void commit(size_t hot, size_t cold) {
+		_hot_used += hot;
+		_cold_used += cold;
+	}
+};
+
+}
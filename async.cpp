@@ -0,0 +1,140 @@
+#include <chrono>
+#include <iostream>
+#include <mutex>
+
+#include "async.hpp"
+#include "interp.hpp"
+#include "output.hpp"
+
+namespace jit {
+
+void RunTask::FinalAwait::await_suspend(Handle handle) noexcept {
+	// The task may be destroyed as soon as the runner hears of it
+	auto& runner = handle.promise()._runner;
+	runner.finish();
+}
+
+AsyncRunner::AsyncRunner(ThreadPool& pool, bool direct) : _pool(pool), _direct(direct) {
+	for (uint32_t i = 0; i < pool.size(); i++) {
+		_sinks.push_back(std::make_unique<OutputSink>());
+		_sinks.back()->_hold = true;
+	}
+	_writer = std::thread([this] { write_loop(); });
+}
+
+AsyncRunner::~AsyncRunner() {
+	{
+		std::lock_guard lock(_lock);
+		_stop = true;
+	}
+	_wake.notify_all();
+	_writer.join();
+}
+
+void AsyncRunner::start(RunTask& task) {
+	{
+		std::lock_guard lock(_lock);
+		_live += 1;
+	}
+	resume_later(task._handle);
+}
+
+void AsyncRunner::wait() {
+	std::unique_lock lock(_lock);
+	_done.wait(lock, [&] { return _live == 0; });
+}
+
+// Resume `handle` on the next free worker, with the sink of that worker for its output
+void AsyncRunner::resume_later(RunTask::Handle handle) {
+	_pool.submit([this, handle](uint32_t worker) {
+		handle.promise()._ctx._out = _sinks[worker].get();
+		handle.resume();
+	});
+}
+
+void AsyncRunner::finish() {
+	std::lock_guard lock(_lock);
+	_live -= 1;
+	if (_live == 0) {
+		_done.notify_all();
+	}
+}
+
+void AsyncRunner::WriteAwait::await_suspend(RunTask::Handle handle) {
+	// Once the writer has the text the run may finish and take this awaiter with it, so
+	// nothing of either is touched after the unlock
+	auto& runner = _runner;
+	std::lock_guard lock(runner._lock);
+	runner._writes.emplace_back(std::move(_text), handle);
+	runner._wake.notify_one();
+}
+
+void AsyncRunner::write_loop() {
+	while (true) {
+		std::unique_lock lock(_lock);
+		_wake.wait(lock, [&] { return _stop || !_writes.empty(); });
+		if (_writes.empty()) {
+			return;
+		}
+		auto [text, handle] = std::move(_writes.front());
+		_writes.pop_front();
+		lock.unlock();
+
+		write_stdout(text.data(), text.size(), _direct);
+		resume_later(handle);
+	}
+}
+
+RunTask run_async(AsyncRunner& runner, ExecutionContext& ctx, int64_t slice) {
+	ctx._fuel = slice;
+	while (true) {
+		auto res = ctx.run();
+		// The sink belongs to the worker, what it holds has to go before a suspend
+		auto text = ctx._out->take_held();
+		if (!text.empty()) {
+			co_await runner.write(std::move(text));
+		}
+		if (!res) {
+			co_return tl::make_unexpected(res.error());
+		}
+		if (*res == RS_DONE) {
+			co_return tl::expected<void, Error>();
+		}
+		// With only the output in the way this run goes on as soon as it was written, on
+		// what is left of its slice. Only yielding earns a new one.
+		if (*res == RS_OUT_OF_FUEL) {
+			co_await runner.requeue();
+			ctx._fuel = slice;
+		}
+	}
+}
+
+BatchStats run_batch_async(
+	std::span<Program* const> jobs, ThreadPool& pool, int64_t slice, bool direct) {
+	auto runner = AsyncRunner(pool, direct);
+	std::vector<std::unique_ptr<ExecutionContext>> contexts;
+	std::vector<RunTask> tasks;
+	for (auto* prog : jobs) {
+		contexts.push_back(std::make_unique<ExecutionContext>(*prog));
+		tasks.push_back(
+			run_async(runner, *contexts.back(), slice == 0 ? DEFAULT_SLICE : slice));
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (auto& task : tasks) {
+		runner.start(task);
+	}
+	runner.wait();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	uint64_t failed = 0;
+	for (size_t i = 0; i < tasks.size(); i++) {
+		if (!tasks[i].result()) {
+			failed += 1;
+			std::cerr << "job " << i << ": " << tasks[i].result().error() << "\n";
+		}
+	}
+	return BatchStats{jobs.size(), failed, elapsed.count()};
+}
+
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "expected.hpp"
+#include "batch.hpp"
+#include "interp.hpp"
+#include "output.hpp"
+
+namespace jit {
+
+struct AsyncRunner;
+
+// A run of an `ExecutionContext` as a coroutine. It suspends every time the run stops to
+// get its output written or to let others have a turn, and `AsyncRunner` resumes it on
+// whichever worker is free once it can go on.
+struct RunTask {
+	struct promise_type;
+	using Handle = std::coroutine_handle<promise_type>;
+
+	// Tells the runner the task is done once it can no longer be resumed
+	struct FinalAwait {
+		bool await_ready() noexcept { return false; }
+		void await_suspend(Handle handle) noexcept;
+		void await_resume() noexcept {}
+	};
+
+	struct promise_type {
+		AsyncRunner& _runner;
+		ExecutionContext& _ctx;
+		tl::expected<void, Error> _result;
+
+		// Gets the arguments of `run_async`
+		promise_type(AsyncRunner& runner, ExecutionContext& ctx, int64_t)
+			: _runner(runner), _ctx(ctx) {}
+
+		RunTask get_return_object() { return RunTask(Handle::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		FinalAwait final_suspend() noexcept { return {}; }
+		void return_value(tl::expected<void, Error> res) { _result = std::move(res); }
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	Handle _handle;
+
+	explicit RunTask(Handle handle) : _handle(handle) {}
+	RunTask(RunTask&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+	RunTask(const RunTask&) = delete;
+	RunTask& operator=(const RunTask&) = delete;
+	~RunTask() {
+		if (_handle) {
+			_handle.destroy();
+		}
+	}
+
+	const tl::expected<void, Error>& result() const { return _handle.promise()._result; }
+};
+
+// Multiplexes any number of runs over the workers of a pool. Output is never written by
+// a worker: every worker has a sink that holds its text, a run that stops with text held
+// hands it to the writer thread and is only resumed once it went out. A worker meanwhile
+// carries on with some other run.
+struct AsyncRunner {
+	ThreadPool& _pool;
+	std::vector<std::unique_ptr<OutputSink>> _sinks;
+	bool _direct;
+
+	// Guards everything below, the writer sleeps on `_wake` and `wait` on `_done`
+	std::mutex _lock;
+	std::condition_variable _wake;
+	std::condition_variable _done;
+	// Text to write and the run to resume after
+	std::deque<std::pair<std::string, RunTask::Handle>> _writes;
+	// Runs started and not done yet
+	size_t _live = 0;
+	bool _stop = false;
+	std::thread _writer;
+
+	AsyncRunner(ThreadPool& pool, bool direct = false);
+	~AsyncRunner();
+
+	AsyncRunner(const AsyncRunner&) = delete;
+	AsyncRunner& operator=(const AsyncRunner&) = delete;
+
+	// Start `task` on some worker.
+	void start(RunTask& task);
+	// Block until every started run is done.
+	void wait();
+
+	// Suspend until `text` was written.
+	struct WriteAwait {
+		AsyncRunner& _runner;
+		std::string _text;
+
+		bool await_ready() noexcept { return false; }
+		void await_suspend(RunTask::Handle handle);
+		void await_resume() noexcept {}
+	};
+	WriteAwait write(std::string text) { return WriteAwait{*this, std::move(text)}; }
+
+	// Suspend behind the runs already waiting for a worker.
+	struct RequeueAwait {
+		AsyncRunner& _runner;
+
+		bool await_ready() noexcept { return false; }
+		void await_suspend(RunTask::Handle handle) { _runner.resume_later(handle); }
+		void await_resume() noexcept {}
+	};
+	RequeueAwait requeue() { return RequeueAwait{*this}; }
+
+	void resume_later(RunTask::Handle handle);
+	void finish();
+	void write_loop();
+};
+
+// Run `ctx` to the end in turns of `slice` fuel, suspending on `runner` between turns and
+// while its output is written.
+RunTask run_async(AsyncRunner& runner, ExecutionContext& ctx, int64_t slice);
+
+// `run_batch` with every job a coroutine on an `AsyncRunner`. Without a `slice` a run
+// gets `DEFAULT_SLICE` per turn, which also caps the text a worker holds for it.
+constexpr int64_t DEFAULT_SLICE = 64 * 1024;
+BatchStats run_batch_async(std::span<Program* const> jobs, ThreadPool& pool,
+	int64_t slice = 0, bool direct = false);
+
+}
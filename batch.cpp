@@ -0,0 +1,137 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+
+#include "batch.hpp"
+#include "interp.hpp"
+#include "output.hpp"
+
+namespace jit {
+
+ThreadPool::ThreadPool(uint32_t threads) {
+	threads = std::max(1u, threads);
+	for (uint32_t i = 0; i < threads; i++) {
+		_workers.push_back(std::make_unique<Worker>());
+	}
+	for (uint32_t i = 0; i < threads; i++) {
+		_threads.emplace_back([this, i] { work(i); });
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard lock(_lock);
+		_stop = true;
+	}
+	_wake.notify_all();
+	for (auto& t : _threads) {
+		t.join();
+	}
+}
+
+void ThreadPool::submit(Task task) {
+	size_t id;
+	{
+		std::lock_guard lock(_lock);
+		id = _next;
+		_next = (_next + 1) % _workers.size();
+		_queued += 1;
+		_pending += 1;
+	}
+	{
+		std::lock_guard lock(_workers[id]->_lock);
+		_workers[id]->_tasks.push_back(std::move(task));
+	}
+	_wake.notify_one();
+}
+
+void ThreadPool::wait() {
+	std::unique_lock lock(_lock);
+	_idle.wait(lock, [&] { return _pending == 0; });
+}
+
+// The newest task of worker `id` or else the oldest one of another worker.
+bool ThreadPool::take(uint32_t id, Task& task) {
+	for (size_t i = 0; i < _workers.size(); i++) {
+		auto& worker = *_workers[(id + i) % _workers.size()];
+		std::lock_guard lock(worker._lock);
+		if (worker._tasks.empty()) {
+			continue;
+		}
+		if (i == 0) {
+			task = std::move(worker._tasks.back());
+			worker._tasks.pop_back();
+		} else {
+			task = std::move(worker._tasks.front());
+			worker._tasks.pop_front();
+		}
+		return true;
+	}
+	return false;
+}
+
+void ThreadPool::work(uint32_t id) {
+	while (true) {
+		Task task;
+		if (take(id, task)) {
+			{
+				std::lock_guard lock(_lock);
+				_queued -= 1;
+			}
+			task(id);
+			std::lock_guard lock(_lock);
+			_pending -= 1;
+			if (_pending == 0) {
+				_idle.notify_all();
+			}
+			continue;
+		}
+
+		// A task counted in `_queued` may not be in its deque yet, then this goes around
+		// again until it is
+		std::unique_lock lock(_lock);
+		_wake.wait(lock, [&] { return _stop || _queued > 0; });
+		if (_stop && _queued == 0) {
+			return;
+		}
+	}
+}
+
+BatchStats run_batch(std::span<Program* const> jobs, ThreadPool& pool, int64_t slice) {
+	std::vector<std::unique_ptr<OutputSink>> sinks;
+	for (uint32_t i = 0; i < pool.size(); i++) {
+		sinks.push_back(std::make_unique<OutputSink>());
+	}
+	std::atomic<uint64_t> failed = 0;
+
+	// Run job `i` for one slice on `worker` and queue the rest of it behind the others
+	std::function<void(std::shared_ptr<ExecutionContext>, size_t, uint32_t)> step;
+	step = [&](std::shared_ptr<ExecutionContext> ctx, size_t i, uint32_t worker) {
+		ctx->_out = sinks[worker].get();
+		ctx->_fuel = slice == 0 ? INT64_MAX : slice;
+		auto res = ctx->run();
+		if (!res) {
+			failed += 1;
+			std::ostringstream msg;
+			msg << "job " << i << ": " << res.error() << "\n";
+			std::cerr << msg.str();
+		} else if (*res == RS_OUT_OF_FUEL) {
+			pool.submit([&, ctx, i](uint32_t worker) { step(ctx, i, worker); });
+		}
+	};
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < jobs.size(); i++) {
+		pool.submit([&, i](uint32_t worker) {
+			step(std::make_shared<ExecutionContext>(*jobs[i]), i, worker);
+		});
+	}
+	pool.wait();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	return BatchStats{jobs.size(), failed, elapsed.count()};
+}
+
+}
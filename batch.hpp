@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "interp.hpp"
+
+namespace jit {
+
+// Fixed worker threads, each with its own deque of tasks. A worker runs the newest task
+// of its own deque and steals the oldest task of another when it runs dry, so a worker
+// that got short jobs keeps busy with the work of a slower one.
+struct ThreadPool {
+	// Tasks get the index of the worker running them
+	using Task = std::function<void(uint32_t)>;
+
+	struct Worker {
+		std::mutex _lock;
+		std::deque<Task> _tasks;
+	};
+
+	std::vector<std::unique_ptr<Worker>> _workers;
+	std::vector<std::thread> _threads;
+
+	// Guards the counts below, idle workers and `wait` sleep on it
+	std::mutex _lock;
+	std::condition_variable _wake;
+	std::condition_variable _idle;
+	// Tasks sitting in a deque and tasks not finished yet
+	size_t _queued = 0;
+	size_t _pending = 0;
+	bool _stop = false;
+	// Worker the next submitted task goes to
+	size_t _next = 0;
+
+	ThreadPool(uint32_t threads);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	uint32_t size() const { return (uint32_t)_workers.size(); }
+
+	// Queue `task` on the workers in turn.
+	void submit(Task task);
+	// Block until every submitted task finished.
+	void wait();
+
+	bool take(uint32_t id, Task& task);
+	void work(uint32_t id);
+};
+
+struct BatchStats {
+	uint64_t _jobs = 0;
+	uint64_t _failed = 0;
+	double _seconds = 0;
+
+	double jobs_per_sec() const { return _seconds > 0 ? _jobs / _seconds : 0; }
+};
+
+// Run one fresh `ExecutionContext` per entry of `jobs` on `pool`. Jobs of the same
+// `Program` share its profile and compiled code, so the ones that start later find hot
+// blocks already compiled. Every worker has its own output sink, each job's output goes
+// out as a whole when it returns unless it is bigger than the sink.
+//
+// With a `slice` a job runs for at most that much fuel at a time before it goes to the
+// back of the queue, so a long job can not hold up a worker. Its output so far goes out
+// each time it stops.
+BatchStats run_batch(std::span<Program* const> jobs, ThreadPool& pool, int64_t slice = 0);
+
+}
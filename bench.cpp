@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <sstream>
+
+#include "bench.hpp"
+#include "bytecode.hpp"
+#include "generate.hpp"
+#include "loader.hpp"
+#include "output.hpp"
+#include "passes.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+
+namespace jit {
+
+static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+	std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+static uint64_t fnv1a(uint64_t hash, const std::string& data) {
+	for (unsigned char c : data) {
+		hash = (hash ^ c) * 0x100000001b3;
+	}
+	return hash;
+}
+
+uint64_t BenchResult::median(uint64_t BenchRun::* field) const {
+	if (_runs.empty()) {
+		return 0;
+	}
+	std::vector<uint64_t> values;
+	for (auto& run : _runs) {
+		values.push_back(run.*field);
+	}
+	std::sort(values.begin(), values.end());
+	return values[values.size() / 2];
+}
+
+// Run `prog` to the end, filling in the run time, compile time, instructions and output
+// hash of `run`
+static tl::expected<void, Error> run_hashed(Program& prog, BenchRun& run) {
+	// The output is only hashed, whatever the run holds is taken at every stop
+	auto sink = OutputSink();
+	sink._hold = true;
+	auto ctx = ExecutionContext(prog, &sink);
+	auto before = thread_stats();
+	run._output_hash = 0xcbf29ce484222325;
+	auto start = std::chrono::steady_clock::now();
+	while (true) {
+		auto res = ctx.run();
+		if (!res) {
+			return tl::make_unexpected(res.error());
+		}
+		run._output_hash = fnv1a(run._output_hash, sink.take_held());
+		if (*res == RS_DONE) {
+			break;
+		}
+	}
+	run._run_ns = elapsed_ns(start);
+	auto& after = thread_stats();
+	run._compile_ns = after.get(STAT_COMPILE_NS) - before.get(STAT_COMPILE_NS);
+	run._instrs = after.get(STAT_INTERP_INSTRS) + after.get(STAT_NATIVE_INSTRS) -
+				  before.get(STAT_INTERP_INSTRS) - before.get(STAT_NATIVE_INSTRS);
+	return tl::expected<void, Error>();
+}
+
+tl::expected<BenchRun, Error> bench_run(const std::string& path, const BenchMode& mode) {
+	auto run = BenchRun();
+	auto start = std::chrono::steady_clock::now();
+	auto parser = Parser();
+	auto loaded = path.ends_with(".ilb") ? load_ilb(path.c_str(), parser)
+										 : load_iloc(path.c_str(), parser, 1);
+	if (!loaded) {
+		return tl::make_unexpected(loaded.error());
+	}
+	run._load_ns = elapsed_ns(start);
+
+	start = std::chrono::steady_clock::now();
+	auto pm = PassManager();
+	auto level = pm.set_opt_level(mode._opt_level);
+	if (!level) {
+		return tl::make_unexpected(level.error());
+	}
+	pm.run(parser._funcs, parser._arena);
+	pack_instrs(parser._funcs, parser._arena);
+	auto prog = Program(std::move(parser._funcs), std::move(parser._globals),
+		std::move(parser._arena), mode._unroll);
+	prog._jit = mode._jit;
+	// A program the verifier rejects is still timed, on the checked loop
+	(void)prog.verify();
+	run._passes_ns = elapsed_ns(start);
+
+	auto res = run_hashed(prog, run);
+	if (!res) {
+		return tl::make_unexpected(res.error());
+	}
+	return run;
+}
+
+std::vector<BenchResult> run_bench(
+	const std::vector<std::string>& programs, uint32_t reps, std::ostream& log) {
+	std::vector<BenchResult> results;
+	for (auto& path : programs) {
+		auto first = results.size();
+		for (auto& mode : BENCH_MODES) {
+			auto& result = results.emplace_back();
+			result._program = path;
+			result._mode = &mode;
+			log << "bench " << path << " " << mode._name << std::flush;
+			for (uint32_t i = 0; i < reps; i++) {
+				auto run = bench_run(path, mode);
+				if (!run) {
+					std::ostringstream error;
+					error << run.error();
+					result._error = error.str();
+					break;
+				}
+				result._runs.push_back(*run);
+				log << "." << std::flush;
+			}
+			log << (result._error.empty() ? "\n" : " " + result._error + "\n");
+			if (!result._runs.empty() && !results[first]._runs.empty()) {
+				result._output_matches = result._runs[0]._output_hash ==
+										 results[first]._runs[0]._output_hash;
+			}
+		}
+	}
+	return results;
+}
+
+std::vector<std::string> bench_programs(const std::string& dir) {
+	if (!std::filesystem::is_directory(dir)) {
+		return {dir};
+	}
+	std::vector<std::string> programs;
+	for (auto& entry : std::filesystem::directory_iterator(dir)) {
+		auto ext = entry.path().extension();
+		if (entry.is_regular_file() && (ext == ".il" || ext == ".ilb")) {
+			programs.push_back(entry.path().generic_string());
+		}
+	}
+	std::sort(programs.begin(), programs.end());
+	return programs;
+}
+
+static double to_ms(uint64_t ns) {
+	return ns / 1e6;
+}
+
+static double instrs_per_sec(const BenchResult& result) {
+	auto run_ns = result.median(&BenchRun::_run_ns);
+	return run_ns ? result.median(&BenchRun::_instrs) * 1e9 / run_ns : 0;
+}
+
+void report_bench_json(std::ostream& os, const std::vector<BenchResult>& results) {
+	os << "{\"benchmarks\": [";
+	for (size_t i = 0; i < results.size(); i++) {
+		auto& result = results[i];
+		auto output = result._runs.empty() ? 0 : result._runs[0]._output_hash;
+		char hash[17];
+		snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)output);
+		os << (i ? ",\n" : "\n") << "  {\"program\": " << json_string(result._program)
+		   << ", \"mode\": \"" << result._mode->_name << "\", \"runs\": "
+		   << result._runs.size()
+		   << ", \"median_ms\": " << to_ms(result.median(&BenchRun::_run_ns))
+		   << ", \"load_ms\": " << to_ms(result.median(&BenchRun::_load_ns))
+		   << ", \"passes_ms\": " << to_ms(result.median(&BenchRun::_passes_ns))
+		   << ", \"compile_ms\": " << to_ms(result.median(&BenchRun::_compile_ns))
+		   << ", \"instrs\": " << result.median(&BenchRun::_instrs)
+		   << ", \"instrs_per_sec\": " << (uint64_t)instrs_per_sec(result)
+		   << ", \"output_hash\": \"" << hash << "\", \"output_matches\": "
+		   << (result._output_matches ? "true" : "false");
+		if (!result._error.empty()) {
+			os << ", \"error\": " << json_string(result._error);
+		}
+		os << "}";
+	}
+	os << "\n]}\n";
+}
+
+void report_bench(std::ostream& os, const std::vector<BenchResult>& results) {
+	os << std::left << std::setw(28) << "program" << std::setw(12) << "mode" << std::right
+	   << std::setw(12) << "median ms" << std::setw(12) << "Minstr/s" << std::setw(12)
+	   << "compile ms" << std::setw(10) << "speedup" << "\n";
+	os << std::fixed << std::setprecision(2);
+	const BenchResult* interp = nullptr;
+	for (auto& result : results) {
+		if (!result._mode->_jit) {
+			interp = &result;
+		}
+		auto run_ns = result.median(&BenchRun::_run_ns);
+		auto interp_ns = interp ? interp->median(&BenchRun::_run_ns) : 0;
+		auto name = std::filesystem::path(result._program).filename().string();
+		os << std::left << std::setw(28) << name << std::setw(12) << result._mode->_name
+		   << std::right << std::setw(12) << to_ms(run_ns) << std::setw(12)
+		   << instrs_per_sec(result) / 1e6 << std::setw(12)
+		   << to_ms(result.median(&BenchRun::_compile_ns)) << std::setw(9)
+		   << (run_ns ? (double)interp_ns / run_ns : 0) << "x";
+		if (!result._error.empty()) {
+			os << "  failed: " << result._error;
+		} else if (!result._output_matches) {
+			os << "  output differs";
+		}
+		os << "\n";
+	}
+	os << std::defaultfloat;
+}
+
+std::vector<ScaleRun> run_scale_bench(uint64_t max_instrs, std::ostream& log) {
+	std::vector<ScaleRun> runs;
+	for (uint64_t size = 1000; size <= max_instrs; size *= 10) {
+		auto& run = runs.emplace_back();
+		run._shape = gen_shape_for(size);
+		run._instrs = run._shape.instr_count();
+		log << "scale " << run._instrs << std::flush;
+
+		auto start = std::chrono::steady_clock::now();
+		std::ostringstream os;
+		generate_iloc(os, run._shape);
+		auto src = std::move(os).str();
+		run._generate_ns = elapsed_ns(start);
+
+		start = std::chrono::steady_clock::now();
+		auto parser = Parser();
+		auto parsed = parse_iloc(src, parser);
+		if (!parsed) {
+			std::ostringstream error;
+			error << parsed.error();
+			run._error = error.str();
+			log << " " << run._error << "\n";
+			continue;
+		}
+		parser.finalize_prog();
+		run._parse_ns = elapsed_ns(start);
+
+		start = std::chrono::steady_clock::now();
+		auto pm = PassManager();
+		(void)pm.set_opt_level(2);
+		pm.run(parser._funcs, parser._arena);
+		run._passes_ns = elapsed_ns(start);
+
+		start = std::chrono::steady_clock::now();
+		pack_instrs(parser._funcs, parser._arena);
+		auto prog = Program(std::move(parser._funcs), std::move(parser._globals),
+			std::move(parser._arena));
+		run._link_ns = elapsed_ns(start);
+
+		start = std::chrono::steady_clock::now();
+		auto verified = prog.verify();
+		run._verify_ns = elapsed_ns(start);
+		if (!verified) {
+			std::ostringstream error;
+			error << verified.error();
+			run._error = error.str();
+		}
+
+		auto ran = run_hashed(prog, run._run);
+		if (!ran) {
+			std::ostringstream error;
+			error << ran.error();
+			run._error = error.str();
+		}
+		log << (run._error.empty() ? "\n" : " " + run._error + "\n");
+	}
+	return runs;
+}
+
+// Nanoseconds per instruction of the program
+static double per_instr(uint64_t ns, const ScaleRun& run) {
+	return run._instrs ? (double)ns / run._instrs : 0;
+}
+
+void report_scale_json(std::ostream& os, const std::vector<ScaleRun>& runs) {
+	os << "{\"scale\": [";
+	for (size_t i = 0; i < runs.size(); i++) {
+		auto& run = runs[i];
+		os << (i ? ",\n" : "\n") << "  {\"instrs\": " << run._instrs
+		   << ", \"frames\": " << run._shape._frames
+		   << ", \"generate_ms\": " << to_ms(run._generate_ns)
+		   << ", \"parse_ms\": " << to_ms(run._parse_ns)
+		   << ", \"passes_ms\": " << to_ms(run._passes_ns)
+		   << ", \"link_ms\": " << to_ms(run._link_ns)
+		   << ", \"verify_ms\": " << to_ms(run._verify_ns)
+		   << ", \"compile_ms\": " << to_ms(run._run._compile_ns)
+		   << ", \"run_ms\": " << to_ms(run._run._run_ns)
+		   << ", \"instrs_run\": " << run._run._instrs;
+		if (!run._error.empty()) {
+			os << ", \"error\": " << json_string(run._error);
+		}
+		os << "}";
+	}
+	os << "\n]}\n";
+}
+
+void report_scale(std::ostream& os, const std::vector<ScaleRun>& runs) {
+	os << "ns per instruction of the program, growth is against the size before\n";
+	os << std::right << std::setw(10) << "instrs" << std::setw(10) << "parse"
+	   << std::setw(10) << "passes" << std::setw(10) << "link" << std::setw(10)
+	   << "verify" << std::setw(10) << "compile" << std::setw(10) << "run"
+	   << std::setw(10) << "growth" << "\n";
+	os << std::fixed << std::setprecision(1);
+	for (size_t i = 0; i < runs.size(); i++) {
+		auto& run = runs[i];
+		auto total = run._parse_ns + run._passes_ns + run._link_ns + run._verify_ns +
+					 run._run._compile_ns;
+		os << std::setw(10) << run._instrs << std::setw(10)
+		   << per_instr(run._parse_ns, run) << std::setw(10)
+		   << per_instr(run._passes_ns, run) << std::setw(10)
+		   << per_instr(run._link_ns, run) << std::setw(10)
+		   << per_instr(run._verify_ns, run) << std::setw(10)
+		   << per_instr(run._run._compile_ns, run) << std::setw(10)
+		   << per_instr(run._run._run_ns, run);
+		if (i > 0) {
+			auto& prev = runs[i - 1];
+			auto prev_total = prev._parse_ns + prev._passes_ns + prev._link_ns +
+							  prev._verify_ns + prev._run._compile_ns;
+			auto growth = per_instr(total, run) / per_instr(prev_total, prev);
+			os << std::setw(9) << growth << "x";
+		}
+		if (!run._error.empty()) {
+			os << "  failed: " << run._error;
+		}
+		os << "\n";
+	}
+	os << std::defaultfloat;
+}
+
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "expected.hpp"
+#include "generate.hpp"
+#include "interp.hpp"
+
+namespace jit {
+
+// How a benchmark program is run
+struct BenchMode {
+	const char* _name;
+	bool _jit;
+	uint32_t _opt_level;
+	uint32_t _unroll;
+};
+
+// Interpreter only, the JIT as it comes and the JIT with every pass and unrolling
+static constexpr BenchMode BENCH_MODES[] = {
+	{"interp", false, 0, 1},
+	{"baseline", true, 0, 1},
+	{"optimizing", true, 2, 4},
+};
+
+// One load and run of a program from scratch, times in nanoseconds
+struct BenchRun {
+	uint64_t _load_ns = 0;
+	uint64_t _passes_ns = 0;
+	uint64_t _run_ns = 0;
+	// Part of `_run_ns` spent compiling
+	uint64_t _compile_ns = 0;
+	uint64_t _instrs = 0;
+	// FNV-1a of everything the program wrote
+	uint64_t _output_hash = 0;
+};
+
+struct BenchResult {
+	std::string _program;
+	const BenchMode* _mode;
+	std::vector<BenchRun> _runs;
+	// Set when a run failed, `_runs` has the ones before it
+	std::string _error;
+	// Whether the output is the same as that of the first mode
+	bool _output_matches = true;
+
+	// The median of `field` over the runs
+	uint64_t median(uint64_t BenchRun::* field) const;
+};
+
+// Load, optimize and run `path` once in `mode`, with its output dropped.
+tl::expected<BenchRun, Error> bench_run(const std::string& path, const BenchMode& mode);
+
+// Run every program `reps` times in every mode, reporting progress to `log`.
+std::vector<BenchResult> run_bench(
+	const std::vector<std::string>& programs, uint32_t reps, std::ostream& log);
+
+// The `.il` and `.ilb` files of `dir` by name, or `dir` itself if it is a file.
+std::vector<std::string> bench_programs(const std::string& dir);
+
+// Results as a JSON document, and as a table with the speedup over the interpreter.
+void report_bench_json(std::ostream& os, const std::vector<BenchResult>& results);
+void report_bench(std::ostream& os, const std::vector<BenchResult>& results);
+
+// One generated program of each size, times in nanoseconds. Everything but `_run` is
+// done once, its compile time is that of the JIT.
+struct ScaleRun {
+	GenShape _shape;
+	uint64_t _instrs = 0;
+	uint64_t _generate_ns = 0;
+	uint64_t _parse_ns = 0;
+	uint64_t _passes_ns = 0;
+	// Packing the instructions and building the `Program`, which links the calls
+	uint64_t _link_ns = 0;
+	uint64_t _verify_ns = 0;
+	BenchRun _run;
+	std::string _error;
+};
+
+// Generate, parse, optimize, link, verify and run programs of 1K instructions and every
+// ten times as many up to `max_instrs`, to show which of them grows faster than the
+// program does.
+std::vector<ScaleRun> run_scale_bench(uint64_t max_instrs, std::ostream& log);
+
+void report_scale_json(std::ostream& os, const std::vector<ScaleRun>& runs);
+// Time per instruction of every phase, flat columns grow linearly.
+void report_scale(std::ostream& os, const std::vector<ScaleRun>& runs);
+
+}
@@ -0,0 +1,365 @@
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bytecode.hpp"
+#include "expected.hpp"
+#include "instrs.hpp"
+#include "interp.hpp"
+#include "loader.hpp"
+
+namespace jit {
+
+// The sections of an .ilb file while it is being built.
+struct IlbWriter {
+	std::vector<IlbString> _strings;
+	std::string _bytes;
+	std::map<std::string, uint32_t, std::less<>> _ids;
+	std::vector<IlbFunc> _funcs;
+	std::vector<uint32_t> _params;
+	std::vector<IlbBlock> _blocks;
+	std::vector<IlbInstr> _instrs;
+	std::vector<IlbGlobal> _globals;
+
+	uint32_t intern(std::string_view str) {
+		auto it = _ids.find(str);
+		if (it != _ids.end()) {
+			return it->second;
+		}
+		auto id = (uint32_t)_strings.size();
+		_strings.push_back(IlbString{_bytes.size(), str.size()});
+		_bytes.append(str);
+		_ids.emplace(std::string(str), id);
+		return id;
+	}
+};
+
+using BlockIds = std::map<std::string, uint32_t, std::less<>>;
+
+static tl::expected<IlbInstr, Error> encode_instr(
+	const Instruction* inst, const BlockIds& block_ids, IlbWriter& w) {
+	auto ops = operands_of(inst);
+	auto rec = IlbInstr{
+		(uint16_t)inst->_kind, 0, ops._dst._reg, ops._src1._reg, ops._src2._reg, 0};
+	switch (op_info(inst->_kind)._shape) {
+		case OS_I_R:
+		case OS_RI_R: {
+			if (ops._imm._kind != ValKind::VK_INT) {
+				break;
+			}
+			rec._imm = ops._imm.as_int();
+			return rec;
+		}
+		case OS_R_L: {
+			if (ops._label.empty()) {
+				break;
+			}
+			auto target = block_ids.find(ops._label);
+			if (target == block_ids.end()) {
+				return tl::make_unexpected(Error(ErrorKind::EK_INVALID_INST,
+					"cbr to unknown block " + std::string(ops._label)));
+			}
+			rec._imm = target->second;
+			return rec;
+		}
+		case OS_CALL:
+		case OS_CALL_R: {
+			rec._src1 = (uint32_t)w._params.size();
+			rec._src2 = (uint32_t)ops._args.size();
+			rec._imm = w.intern(ops._label);
+			for (auto& arg : ops._args) {
+				w._params.push_back(arg._reg);
+			}
+			return rec;
+		}
+		case OS_DIRECTIVE: break;
+		default: return rec;
+	}
+	return tl::make_unexpected(
+		Error(ErrorKind::EK_INVALID_INST, "instruction can not be written to .ilb"));
+}
+
+template <typename T>
+static void write_section(std::ofstream& out, const std::vector<T>& recs) {
+	out.write((const char*)recs.data(), (std::streamsize)(recs.size() * sizeof(T)));
+}
+
+tl::expected<void, Error> write_ilb(const char* path,
+	const std::map<std::string, Function>& funcs,
+	const std::map<std::string, Value>& globals) {
+	auto w = IlbWriter();
+	for (auto& [fname, func] : funcs) {
+		auto f = IlbFunc{w.intern(fname), func._size, (uint32_t)w._params.size(),
+			(uint32_t)func._args.size(), (uint32_t)w._blocks.size(),
+			(uint32_t)func._blocks.size()};
+		for (auto& arg : func._args) {
+			w._params.push_back(arg._reg);
+		}
+
+		BlockIds block_ids;
+		for (auto& [bname, blk] : func._blocks) {
+			block_ids.emplace(bname, (uint32_t)block_ids.size());
+		}
+		for (auto& [bname, blk] : func._blocks) {
+			auto fall = block_ids.find(blk._fallthrough);
+			auto fall_id = fall == block_ids.end() ? ILB_NONE : fall->second;
+			w._blocks.push_back(IlbBlock{w.intern(bname), fall_id,
+				(uint32_t)w._instrs.size(), (uint32_t)blk._instrs.size()});
+			for (auto* inst : blk._instrs) {
+				auto rec = encode_instr(inst, block_ids, w);
+				if (!rec) {
+					return tl::make_unexpected(rec.error());
+				}
+				w._instrs.push_back(*rec);
+			}
+		}
+		w._funcs.push_back(f);
+	}
+	for (auto& [name, val] : globals) {
+		auto g = IlbGlobal{w.intern(name), (uint32_t)val._kind, 0};
+		if (val._kind == ValKind::VK_INT) {
+			g._val = val.as_int();
+		} else if (val._kind == ValKind::VK_STRING || val._kind == ValKind::VK_LOCATION) {
+			g._val = w.intern(val.as_string());
+		} else {
+			return tl::make_unexpected(
+				Error(ErrorKind::EK_INVALID_INST, "global can not be written to .ilb"));
+		}
+		w._globals.push_back(g);
+	}
+
+	IlbHeader header;
+	memcpy(header._magic, ILB_MAGIC, sizeof(ILB_MAGIC));
+	header._version = ILB_VERSION;
+	header._num_strings = (uint32_t)w._strings.size();
+	header._num_funcs = (uint32_t)w._funcs.size();
+	header._num_params = (uint32_t)w._params.size();
+	header._num_blocks = (uint32_t)w._blocks.size();
+	header._num_instrs = (uint32_t)w._instrs.size();
+	header._num_globals = (uint32_t)w._globals.size();
+	header._string_bytes = w._bytes.size();
+
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) {
+		return tl::make_unexpected(
+			Error(ErrorKind::EK_IO, "failed to create " + std::string(path)));
+	}
+	out.write((const char*)&header, sizeof(header));
+	write_section(out, w._strings);
+	out.write(w._bytes.data(), (std::streamsize)w._bytes.size());
+	write_section(out, w._funcs);
+	write_section(out, w._params);
+	write_section(out, w._blocks);
+	write_section(out, w._instrs);
+	write_section(out, w._globals);
+	if (!out.good()) {
+		return tl::make_unexpected(
+			Error(ErrorKind::EK_IO, "failed to write " + std::string(path)));
+	}
+	return tl::expected<void, Error>();
+}
+
+// Reads records out of the mapped file, the sections may not be aligned for `T`.
+struct IlbReader {
+	std::string_view _src;
+	IlbHeader _header;
+	size_t _strings;
+	size_t _bytes;
+	size_t _funcs;
+	size_t _params;
+	size_t _blocks;
+	size_t _instrs;
+	size_t _globals;
+
+	template <typename T> T record(size_t section, size_t idx) const {
+		T rec;
+		memcpy(&rec, _src.data() + section + idx * sizeof(T), sizeof(T));
+		return rec;
+	}
+
+	std::optional<std::string_view> string(uint32_t id) const {
+		if (id >= _header._num_strings) {
+			return std::nullopt;
+		}
+		auto str = record<IlbString>(_strings, id);
+		auto bytes = _header._string_bytes;
+		if (str._offset > bytes || str._len > bytes - str._offset) {
+			return std::nullopt;
+		}
+		return _src.substr(_bytes + str._offset, str._len);
+	}
+};
+
+static Error corrupt(const std::string& what) {
+	return Error(ErrorKind::EK_INVALID_INST, "corrupt .ilb file: " + what);
+}
+
+static tl::expected<Instruction*, Error> decode_instr(const IlbReader& r,
+	const IlbInstr& rec, const std::vector<std::string_view>& block_names,
+	InstrArena& arena) {
+	auto kind = (InstrKind)rec._kind;
+	if (rec._kind >= std::size(OPCODES) || op_info(kind)._shape == OS_DIRECTIVE) {
+		return tl::make_unexpected(corrupt("unknown instruction kind"));
+	}
+	// Call records reuse the source fields for their argument range
+	auto shape = op_info(kind)._shape;
+	auto is_call = shape == OS_CALL || shape == OS_CALL_R;
+	if ((!is_call && (rec._src1 >= MAX_REGS || rec._src2 >= MAX_REGS)) ||
+		rec._dst >= MAX_REGS) {
+		return tl::make_unexpected(corrupt("register out of range"));
+	}
+	auto ops = Operands();
+	ops._src1 = rec._src1;
+	ops._src2 = rec._src2;
+	ops._dst = rec._dst;
+	ops._imm = Value{rec._imm};
+	if (op_info(kind)._shape == OS_R_L) {
+		if (rec._imm < 0 || (uint64_t)rec._imm >= block_names.size()) {
+			return tl::make_unexpected(corrupt("cbr target out of range"));
+		}
+		ops._label = block_names[rec._imm];
+	}
+
+	std::vector<Reg> args;
+	if (is_call) {
+		auto name = rec._imm < 0 || rec._imm > UINT32_MAX ? std::nullopt
+														  : r.string((uint32_t)rec._imm);
+		if (!name || rec._src1 > r._header._num_params ||
+			rec._src2 > r._header._num_params - rec._src1) {
+			return tl::make_unexpected(corrupt("bad call record"));
+		}
+		for (uint32_t i = 0; i < rec._src2; i++) {
+			auto arg = r.record<uint32_t>(r._params, rec._src1 + i);
+			if (arg >= MAX_REGS) {
+				return tl::make_unexpected(corrupt("register out of range"));
+			}
+			args.push_back(arg);
+		}
+		ops._label = *name;
+		ops._args = args;
+	}
+	return build_instr(arena, kind, ops);
+}
+
+static tl::expected<void, Error> read_func(
+	const IlbReader& r, const IlbFunc& rec, Parser& parser) {
+	auto& h = r._header;
+	auto name = r.string(rec._name);
+	if (!name || rec._first_param > h._num_params ||
+		rec._num_params > h._num_params - rec._first_param ||
+		rec._first_block > h._num_blocks ||
+		rec._num_blocks > h._num_blocks - rec._first_block || rec._size > MAX_REGS) {
+		return tl::make_unexpected(corrupt("bad function record"));
+	}
+
+	std::vector<Reg> params;
+	for (uint32_t i = 0; i < rec._num_params; i++) {
+		auto param = r.record<uint32_t>(r._params, rec._first_param + i);
+		if (param >= MAX_REGS) {
+			return tl::make_unexpected(corrupt("register out of range"));
+		}
+		params.push_back(param);
+	}
+	auto func = Function(std::string(*name), rec._size, params);
+
+	std::vector<std::string_view> block_names;
+	for (uint32_t i = 0; i < rec._num_blocks; i++) {
+		auto blk = r.string(r.record<IlbBlock>(r._blocks, rec._first_block + i)._name);
+		if (!blk) {
+			return tl::make_unexpected(corrupt("bad block name"));
+		}
+		block_names.push_back(*blk);
+	}
+
+	for (uint32_t i = 0; i < rec._num_blocks; i++) {
+		auto brec = r.record<IlbBlock>(r._blocks, rec._first_block + i);
+		if (brec._first_instr > h._num_instrs ||
+			brec._num_instrs > h._num_instrs - brec._first_instr ||
+			(brec._fallthrough != ILB_NONE && brec._fallthrough >= rec._num_blocks)) {
+			return tl::make_unexpected(corrupt("bad block record"));
+		}
+		auto blk = Block(std::string(block_names[i]));
+		if (brec._fallthrough != ILB_NONE) {
+			blk._fallthrough = block_names[brec._fallthrough];
+		}
+		for (uint32_t j = 0; j < brec._num_instrs; j++) {
+			auto irec = r.record<IlbInstr>(r._instrs, brec._first_instr + j);
+			auto inst = decode_instr(r, irec, block_names, parser._arena);
+			if (!inst) {
+				return tl::make_unexpected(inst.error());
+			}
+			blk._instrs.push_back(*inst);
+		}
+		func._blocks.insert(std::pair{blk._name, blk});
+	}
+	parser._funcs.insert(std::pair{func._name, func});
+	return tl::expected<void, Error>();
+}
+
+tl::expected<void, Error> load_ilb(const char* path, Parser& parser) {
+	auto file = MappedFile::open(path);
+	if (!file) {
+		return tl::make_unexpected(file.error());
+	}
+
+	auto r = IlbReader();
+	r._src = file->view();
+	if (r._src.size() < sizeof(IlbHeader)) {
+		return tl::make_unexpected(corrupt("too short"));
+	}
+	memcpy(&r._header, r._src.data(), sizeof(IlbHeader));
+	auto& h = r._header;
+	if (memcmp(h._magic, ILB_MAGIC, sizeof(ILB_MAGIC)) != 0) {
+		return tl::make_unexpected(corrupt("bad magic"));
+	}
+	if (h._version != ILB_VERSION) {
+		return tl::make_unexpected(Error(ErrorKind::EK_INVALID_ARG,
+			".ilb version " + std::to_string(h._version) + " is not supported"));
+	}
+
+	// The counts are 32 bit so none of these sums can overflow
+	r._strings = sizeof(IlbHeader);
+	r._bytes = r._strings + (size_t)h._num_strings * sizeof(IlbString);
+	if (h._string_bytes > r._src.size()) {
+		return tl::make_unexpected(corrupt("size does not match the header"));
+	}
+	r._funcs = r._bytes + h._string_bytes;
+	r._params = r._funcs + (size_t)h._num_funcs * sizeof(IlbFunc);
+	r._blocks = r._params + (size_t)h._num_params * sizeof(uint32_t);
+	r._instrs = r._blocks + (size_t)h._num_blocks * sizeof(IlbBlock);
+	r._globals = r._instrs + (size_t)h._num_instrs * sizeof(IlbInstr);
+	if (r._globals + (size_t)h._num_globals * sizeof(IlbGlobal) != r._src.size()) {
+		return tl::make_unexpected(corrupt("size does not match the header"));
+	}
+
+	for (uint32_t i = 0; i < h._num_funcs; i++) {
+		auto res = read_func(r, r.record<IlbFunc>(r._funcs, i), parser);
+		if (!res) {
+			return tl::make_unexpected(res.error());
+		}
+	}
+	for (uint32_t i = 0; i < h._num_globals; i++) {
+		auto g = r.record<IlbGlobal>(r._globals, i);
+		auto name = r.string(g._name);
+		if (!name) {
+			return tl::make_unexpected(corrupt("bad global name"));
+		}
+		if (g._kind == ValKind::VK_INT) {
+			parser._globals.insert(std::pair{std::string(*name), Value{g._val}});
+			continue;
+		}
+		auto str = g._val < 0 || g._val > UINT32_MAX ? std::nullopt
+													 : r.string((uint32_t)g._val);
+		if (!str || (g._kind != ValKind::VK_STRING && g._kind != ValKind::VK_LOCATION)) {
+			return tl::make_unexpected(corrupt("bad global value"));
+		}
+		parser._globals.insert(
+			std::pair{std::string(*name), Value{(ValKind)g._kind, std::string(*str)}});
+	}
+	return tl::expected<void, Error>();
+}
+
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "expected.hpp"
+#include "instrs.hpp"
+#include "interp.hpp"
+
+namespace jit {
+
+// A precompiled program (".ilb"), every section is an array of fixed width little endian
+// records so a mapped file can be read in place.
+//
+//     IlbHeader
+//     IlbString[_num_strings]  then the string bytes they point into
+//     IlbFunc[_num_funcs]
+//     uint32_t[_num_params]    frame parameters and call arguments
+//     IlbBlock[_num_blocks]
+//     IlbInstr[_num_instrs]
+//     IlbGlobal[_num_globals]
+//
+// Names are ids into the string table and branch targets are block ids local to their
+// function. Bump `ILB_VERSION` whenever a record or `InstrKind` changes.
+static constexpr char ILB_MAGIC[4] = {'I', 'L', 'B', 'C'};
+static constexpr uint32_t ILB_VERSION = 2;
+// A block with no fallthrough, or a global without a string value
+static constexpr uint32_t ILB_NONE = UINT32_MAX;
+
+struct IlbHeader {
+	char _magic[4];
+	uint32_t _version;
+	uint32_t _num_strings;
+	uint32_t _num_funcs;
+	uint32_t _num_params;
+	uint32_t _num_blocks;
+	uint32_t _num_instrs;
+	uint32_t _num_globals;
+	// Size of the string bytes following the string records
+	uint64_t _string_bytes;
+};
+
+struct IlbString {
+	uint64_t _offset;
+	uint64_t _len;
+};
+
+struct IlbFunc {
+	uint32_t _name;
+	uint32_t _size;
+	uint32_t _first_param;
+	uint32_t _num_params;
+	uint32_t _first_block;
+	uint32_t _num_blocks;
+};
+
+struct IlbBlock {
+	uint32_t _name;
+	// Block id in the same function or `ILB_NONE`
+	uint32_t _fallthrough;
+	uint32_t _first_instr;
+	uint32_t _num_instrs;
+};
+
+struct IlbInstr {
+	uint16_t _kind;
+	uint16_t _pad;
+	uint32_t _dst;
+	uint32_t _src1;
+	uint32_t _src2;
+	// The immediate operand, the target block id of a `cbr` or the string id of the
+	// function called. Calls keep their first argument index into the parameters in
+	// `_src1` and the argument count in `_src2`.
+	int64_t _imm;
+};
+
+struct IlbGlobal {
+	uint32_t _name;
+	uint32_t _kind;
+	// The integer value or a string id
+	int64_t _val;
+};
+
+static_assert(sizeof(IlbHeader) == 40);
+static_assert(sizeof(IlbString) == 16);
+static_assert(sizeof(IlbFunc) == 24);
+static_assert(sizeof(IlbBlock) == 16);
+static_assert(sizeof(IlbInstr) == 24);
+static_assert(sizeof(IlbGlobal) == 16);
+
+// Write the parsed program to `path`.
+tl::expected<void, Error> write_ilb(const char* path,
+	const std::map<std::string, Function>& funcs,
+	const std::map<std::string, Value>& globals);
+
+// Map `path` and fill in `parser` from it, every record is bounds checked.
+tl::expected<void, Error> load_ilb(const char* path, Parser& parser);
+
+}
@@ -0,0 +1,483 @@
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+#include <Windows.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "gdbjit.hpp"
+
+extern "C" {
+// GDB breaks here, the call and the empty body must not be optimized away
+#ifdef _MSC_VER
+__declspec(noinline) void __jit_debug_register_code() { _ReadWriteBarrier(); }
+#else
+__attribute__((noinline)) void __jit_debug_register_code() {
+	asm volatile("" ::: "memory");
+}
+#endif
+
+jit_descriptor __jit_debug_descriptor = {1, JIT_NOACTION, nullptr, nullptr};
+}
+
+namespace jit {
+
+// ELF and DWARF constants, only the ones used here
+static constexpr uint16_t ET_REL = 1;
+static constexpr uint16_t EM_X86_64 = 62;
+static constexpr uint32_t SHT_PROGBITS = 1;
+static constexpr uint32_t SHT_SYMTAB = 2;
+static constexpr uint32_t SHT_STRTAB = 3;
+static constexpr uint32_t SHT_NOBITS = 8;
+static constexpr uint64_t SHF_ALLOC = 2;
+static constexpr uint64_t SHF_EXECINSTR = 4;
+static constexpr uint16_t SHN_ABS = 0xfff1;
+static constexpr uint8_t STT_FUNC = 2;
+static constexpr uint8_t STT_FILE = 4;
+static constexpr uint8_t STB_GLOBAL = 1;
+
+static constexpr uint8_t DW_TAG_compile_unit = 0x11;
+static constexpr uint8_t DW_AT_name = 0x03;
+static constexpr uint8_t DW_AT_stmt_list = 0x10;
+static constexpr uint8_t DW_AT_low_pc = 0x11;
+static constexpr uint8_t DW_AT_high_pc = 0x12;
+static constexpr uint8_t DW_FORM_addr = 0x01;
+static constexpr uint8_t DW_FORM_data4 = 0x06;
+static constexpr uint8_t DW_FORM_string = 0x08;
+
+static constexpr uint8_t DW_LNS_copy = 1;
+static constexpr uint8_t DW_LNS_advance_pc = 2;
+static constexpr uint8_t DW_LNS_advance_line = 3;
+static constexpr uint8_t DW_LNE_end_sequence = 1;
+static constexpr uint8_t DW_LNE_set_address = 2;
+
+static constexpr uint8_t DW_CFA_advance_loc = 0x40;
+static constexpr uint8_t DW_CFA_offset = 0x80;
+static constexpr uint8_t DW_CFA_def_cfa = 0x0c;
+static constexpr uint8_t DW_CFA_def_cfa_offset = 0x0e;
+static constexpr uint8_t DW_EH_PE_udata4 = 0x03;
+static constexpr uint8_t DW_EH_PE_textrel = 0x20;
+
+// DWARF numbers of the x86-64 registers the frame saves
+static constexpr uint8_t DW_REG_RDI = 5;
+static constexpr uint8_t DW_REG_RBP = 6;
+static constexpr uint8_t DW_REG_RSP = 7;
+static constexpr uint8_t DW_REG_RA = 16;
+
+// Sections of every object, in order
+enum GdbSection {
+	GS_NULL,
+	GS_TEXT,
+	GS_COLD,
+	GS_EH_FRAME,
+	GS_SHSTRTAB,
+	GS_STRTAB,
+	GS_SYMTAB,
+	GS_DEBUG_INFO,
+	GS_DEBUG_ABBREV,
+	GS_DEBUG_LINE,
+
+	GS_SIZE
+};
+
+struct ElfSection {
+	uint32_t _name;
+	uint32_t _type;
+	uint64_t _flags;
+	uint64_t _addr;
+	uint64_t _offset;
+	uint64_t _size;
+	uint32_t _link;
+	uint32_t _info;
+	uint64_t _align;
+	uint64_t _entsize;
+};
+
+struct ElfSymbol {
+	uint32_t _name;
+	uint8_t _info;
+	uint8_t _other;
+	uint16_t _shndx;
+	uint64_t _value;
+	uint64_t _size;
+};
+
+static_assert(sizeof(ElfSection) == 64 && sizeof(ElfSymbol) == 24);
+
+// Appends the little endian encodings ELF and DWARF use.
+struct ObjWriter {
+	std::vector<uint8_t> _buf;
+
+	void u8(uint8_t v) { _buf.push_back(v); }
+	void u16(uint16_t v) { bytes(&v, sizeof(v)); }
+	void u32(uint32_t v) { bytes(&v, sizeof(v)); }
+	void u64(uint64_t v) { bytes(&v, sizeof(v)); }
+	void bytes(const void* data, size_t len) {
+		auto p = (const uint8_t*)data;
+		_buf.insert(_buf.end(), p, p + len);
+	}
+	void str(std::string_view s) {
+		bytes(s.data(), s.size());
+		u8(0);
+	}
+	void uleb(uint64_t v) {
+		do {
+			uint8_t b = v & 0x7f;
+			v >>= 7;
+			u8(v ? b | 0x80 : b);
+		} while (v);
+	}
+	void sleb(int64_t v) {
+		while (true) {
+			uint8_t b = v & 0x7f;
+			v >>= 7;
+			if ((v == 0 && !(b & 0x40)) || (v == -1 && (b & 0x40))) {
+				u8(b);
+				return;
+			}
+			u8(b | 0x80);
+		}
+	}
+	void align(size_t to, uint8_t fill = 0) {
+		while (_buf.size() % to) {
+			u8(fill);
+		}
+	}
+
+	// Leave room for a 32 bit length and fill it in with `end_length`
+	size_t begin_length() {
+		auto at = _buf.size();
+		u32(0);
+		return at;
+	}
+	void end_length(size_t at) {
+		auto len = (uint32_t)(_buf.size() - at - 4);
+		memcpy(_buf.data() + at, &len, 4);
+	}
+};
+
+// Collects section names and the offsets they end up at.
+struct StrTab {
+	ObjWriter _w;
+
+	StrTab() { _w.u8(0); }
+	uint32_t add(std::string_view s) {
+		auto at = (uint32_t)_w._buf.size();
+		_w.str(s);
+		return at;
+	}
+};
+
+// The unwind info of jitted code: `push rbp; push rdi; sub rsp, imm32` on entry, then
+// the frame stays put until the exit stub tears it down. Calls out use the shadow space
+// and spill slots reserved in the frame, so rsp does not move around them.
+static void write_eh_frame(ObjWriter& w, const uint8_t* hot, size_t hot_size,
+	const uint8_t* cold, size_t cold_size, uint32_t frame_size) {
+	auto cie = w._buf.size();
+	auto cie_len = w.begin_length();
+	w.u32(0);
+	w.u8(1);
+	w.str("zR");
+	w.uleb(1);
+	w.sleb(-8);
+	w.u8(DW_REG_RA);
+	w.uleb(1);
+	w.u8(DW_EH_PE_textrel | DW_EH_PE_udata4);
+	w.u8(DW_CFA_def_cfa);
+	w.uleb(DW_REG_RSP);
+	w.uleb(8);
+	w.u8(DW_CFA_offset | DW_REG_RA);
+	w.uleb(1);
+	w.align(8);
+	w.end_length(cie_len);
+
+	// Offsets are from .text, the cold code comes after it in the arena
+	auto fde = [&](uint32_t start, size_t size, bool in_frame) {
+		auto len = w.begin_length();
+		w.u32((uint32_t)(w._buf.size() - cie));
+		w.u32(start);
+		w.u32((uint32_t)size);
+		w.uleb(0);
+		if (!in_frame) {
+			// push rbp
+			w.u8(DW_CFA_advance_loc | 1);
+			w.u8(DW_CFA_def_cfa_offset);
+			w.uleb(16);
+			w.u8(DW_CFA_offset | DW_REG_RBP);
+			w.uleb(2);
+			// push rdi
+			w.u8(DW_CFA_advance_loc | 1);
+			w.u8(DW_CFA_def_cfa_offset);
+			w.uleb(24);
+			w.u8(DW_CFA_offset | DW_REG_RDI);
+			w.uleb(3);
+			// sub rsp, frame_size
+			w.u8(DW_CFA_advance_loc | 7);
+		} else {
+			w.u8(DW_CFA_offset | DW_REG_RBP);
+			w.uleb(2);
+			w.u8(DW_CFA_offset | DW_REG_RDI);
+			w.uleb(3);
+		}
+		w.u8(DW_CFA_def_cfa_offset);
+		w.uleb(24 + frame_size);
+		w.align(8);
+		w.end_length(len);
+	};
+	fde(0, hot_size, false);
+	if (cold_size != 0) {
+		fde((uint32_t)(cold - hot), cold_size, true);
+	}
+	w.u32(0);
+}
+
+// One sequence from the start of the hot code to its end, a row per instruction.
+static void write_debug_line(ObjWriter& w, const std::string& file, const uint8_t* hot,
+	size_t hot_size, const std::vector<std::pair<uint32_t, uint32_t>>& rows) {
+	auto unit = w.begin_length();
+	w.u16(2);
+	auto header = w.begin_length();
+	// Minimum instruction length, default is_stmt, line base, line range
+	w.u8(1);
+	w.u8(1);
+	w.u8(0);
+	w.u8(2);
+	// Only the standard opcodes up to advance_line, with their operand counts
+	w.u8(DW_LNS_advance_line + 1);
+	w.u8(0);
+	w.u8(1);
+	w.u8(1);
+	// No include directories, the one file
+	w.u8(0);
+	w.str(file);
+	w.uleb(0);
+	w.uleb(0);
+	w.uleb(0);
+	w.u8(0);
+	w.end_length(header);
+
+	w.u8(0);
+	w.uleb(1 + 8);
+	w.u8(DW_LNE_set_address);
+	w.u64((uint64_t)hot);
+	uint32_t offset = 0;
+	uint32_t line = 1;
+	for (auto [at, at_line] : rows) {
+		if (at > offset) {
+			w.u8(DW_LNS_advance_pc);
+			w.uleb(at - offset);
+			offset = at;
+		}
+		if (at_line != line) {
+			w.u8(DW_LNS_advance_line);
+			w.sleb((int64_t)at_line - line);
+			line = at_line;
+		}
+		w.u8(DW_LNS_copy);
+	}
+	w.u8(DW_LNS_advance_pc);
+	w.uleb(hot_size - offset);
+	w.u8(0);
+	w.uleb(1);
+	w.u8(DW_LNE_end_sequence);
+	w.end_length(unit);
+}
+
+tl::expected<void, Error> GdbJit::open(const std::string& dir) {
+	std::lock_guard lock(_lock);
+	_listing_path = dir + "/jit-" + std::to_string(GetCurrentProcessId()) + ".il";
+	_listing.open(_listing_path, std::ios::trunc);
+	if (!_listing.is_open()) {
+		return tl::make_unexpected(
+			Error(ErrorKind::EK_IO, "failed to create " + _listing_path));
+	}
+	return tl::expected<void, Error>();
+}
+
+void GdbJit::add_program(const Program& prog) {
+	if (!enabled()) {
+		return;
+	}
+	std::lock_guard lock(_lock);
+	std::map<const Instruction*, uint32_t> lines;
+	std::ostringstream text;
+	prog.dump(text, &lines);
+	for (auto& [inst, line] : lines) {
+		_lines[inst] = _listing_lines + line;
+	}
+	auto str = text.str();
+	_listing << str;
+	_listing.flush();
+	_listing_lines += (uint32_t)std::count(str.begin(), str.end(), '\n');
+}
+
+void GdbJit::add_code(std::string_view name, const uint8_t* hot, size_t hot_size,
+	const uint8_t* cold, size_t cold_size, uint32_t frame_size,
+	const std::vector<NativeLine>& lines) {
+	if (!enabled() || hot_size == 0) {
+		return;
+	}
+	std::lock_guard lock(_lock);
+
+	std::vector<std::pair<uint32_t, uint32_t>> rows;
+	for (auto& [at, inst] : lines) {
+		auto line = _lines.find(inst);
+		if (at < hot_size && line != _lines.end()) {
+			rows.emplace_back(at, line->second);
+		}
+	}
+	std::stable_sort(rows.begin(), rows.end(),
+		[](const auto& a, const auto& b) { return a.first < b.first; });
+
+	ElfSection sections[GS_SIZE] = {};
+	StrTab shstr;
+	StrTab str;
+	ObjWriter w;
+	// The header goes in once the sections are laid out
+	w._buf.resize(64);
+
+	auto& eh = sections[GS_EH_FRAME];
+	eh._offset = w._buf.size();
+	write_eh_frame(w, hot, hot_size, cold, cold_size, frame_size);
+	eh._size = w._buf.size() - eh._offset;
+
+	auto& info = sections[GS_DEBUG_INFO];
+	info._offset = w._buf.size();
+	auto unit = w.begin_length();
+	w.u16(2);
+	w.u32(0);
+	w.u8(8);
+	w.uleb(1);
+	w.str(_listing_path);
+	w.u64((uint64_t)hot);
+	w.u64((uint64_t)hot + hot_size);
+	w.u32(0);
+	w.end_length(unit);
+	info._size = w._buf.size() - info._offset;
+
+	auto& abbrev = sections[GS_DEBUG_ABBREV];
+	abbrev._offset = w._buf.size();
+	w.uleb(1);
+	w.uleb(DW_TAG_compile_unit);
+	w.u8(0);
+	for (auto [at, form] : {std::pair{DW_AT_name, DW_FORM_string},
+			 {DW_AT_low_pc, DW_FORM_addr}, {DW_AT_high_pc, DW_FORM_addr},
+			 {DW_AT_stmt_list, DW_FORM_data4}}) {
+		w.uleb(at);
+		w.uleb(form);
+	}
+	w.u8(0);
+	w.u8(0);
+	w.u8(0);
+	abbrev._size = w._buf.size() - abbrev._offset;
+
+	auto& line = sections[GS_DEBUG_LINE];
+	line._offset = w._buf.size();
+	write_debug_line(w, _listing_path, hot, hot_size, rows);
+	line._size = w._buf.size() - line._offset;
+
+	// A file symbol and then the functions, only the functions are global
+	auto cold_name = std::string(name) + ".cold";
+	std::vector<ElfSymbol> syms = {{},
+		{str.add("jitjit"), STT_FILE, 0, SHN_ABS, 0, 0},
+		{str.add(name), (STB_GLOBAL << 4) | STT_FUNC, 0, GS_TEXT, 0, hot_size}};
+	if (cold_size != 0) {
+		syms.push_back(
+			{str.add(cold_name), (STB_GLOBAL << 4) | STT_FUNC, 0, GS_COLD, 0, cold_size});
+	}
+	w.align(8);
+	auto& symtab = sections[GS_SYMTAB];
+	symtab._offset = w._buf.size();
+	w.bytes(syms.data(), syms.size() * sizeof(ElfSymbol));
+	symtab._size = w._buf.size() - symtab._offset;
+
+	auto& strtab = sections[GS_STRTAB];
+	strtab._offset = w._buf.size();
+	w.bytes(str._w._buf.data(), str._w._buf.size());
+	strtab._size = str._w._buf.size();
+
+	// The code itself stays where it is, the sections only give its address
+	sections[GS_TEXT] = {shstr.add(".text"), SHT_NOBITS, SHF_ALLOC | SHF_EXECINSTR,
+		(uint64_t)hot, 0, hot_size, 0, 0, 16, 0};
+	sections[GS_COLD] = {shstr.add(".text.cold"), SHT_NOBITS, SHF_ALLOC | SHF_EXECINSTR,
+		(uint64_t)cold, 0, cold_size, 0, 0, 16, 0};
+	eh._name = shstr.add(".eh_frame");
+	eh._type = SHT_PROGBITS;
+	eh._flags = SHF_ALLOC;
+	eh._align = 8;
+	symtab._name = shstr.add(".symtab");
+	symtab._type = SHT_SYMTAB;
+	symtab._link = GS_STRTAB;
+	symtab._info = 2;
+	symtab._align = 8;
+	symtab._entsize = sizeof(ElfSymbol);
+	strtab._name = shstr.add(".strtab");
+	strtab._type = SHT_STRTAB;
+	strtab._align = 1;
+	info._name = shstr.add(".debug_info");
+	abbrev._name = shstr.add(".debug_abbrev");
+	line._name = shstr.add(".debug_line");
+	for (auto* s : {&info, &abbrev, &line}) {
+		s->_type = SHT_PROGBITS;
+		s->_align = 1;
+	}
+	auto& shstrtab = sections[GS_SHSTRTAB];
+	shstrtab._name = shstr.add(".shstrtab");
+	shstrtab._type = SHT_STRTAB;
+	shstrtab._align = 1;
+	shstrtab._offset = w._buf.size();
+	w.bytes(shstr._w._buf.data(), shstr._w._buf.size());
+	shstrtab._size = shstr._w._buf.size();
+
+	w.align(8);
+	auto shoff = w._buf.size();
+	w.bytes(sections, sizeof(sections));
+
+	ObjWriter header;
+	header.bytes("\x7f" "ELF", 4);
+	// 64 bit, little endian, version 1
+	header.u8(2);
+	header.u8(1);
+	header.u8(1);
+	header.align(16);
+	header.u16(ET_REL);
+	header.u16(EM_X86_64);
+	header.u32(1);
+	header.u64(0);
+	header.u64(0);
+	header.u64(shoff);
+	header.u32(0);
+	header.u16(64);
+	header.u16(0);
+	header.u16(0);
+	header.u16(sizeof(ElfSection));
+	header.u16(GS_SIZE);
+	header.u16(GS_SHSTRTAB);
+	memcpy(w._buf.data(), header._buf.data(), header._buf.size());
+
+	auto& entry = _entries.emplace_back();
+	entry._elf = std::move(w._buf);
+	// .eh_frame is loaded, so it has an address, that of the bytes in the object
+	auto* eh_header = (ElfSection*)(entry._elf.data() + shoff) + GS_EH_FRAME;
+	eh_header->_addr = (uint64_t)(entry._elf.data() + eh_header->_offset);
+
+	entry._entry = {__jit_debug_descriptor.first_entry, nullptr,
+		(const char*)entry._elf.data(), entry._elf.size()};
+	if (entry._entry.next_entry) {
+		entry._entry.next_entry->prev_entry = &entry._entry;
+	}
+	__jit_debug_descriptor.first_entry = &entry._entry;
+	__jit_debug_descriptor.relevant_entry = &entry._entry;
+	__jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+	__jit_debug_register_code();
+}
+
+GdbJit& gdb_jit() {
+	static GdbJit gdb;
+	return gdb;
+}
+
+}
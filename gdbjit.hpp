@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "expected.hpp"
+#include "instrs.hpp"
+#include "interp.hpp"
+
+// The JIT interface of GDB. It sets a breakpoint on `__jit_debug_register_code` and reads
+// the object files listed in `__jit_debug_descriptor` when it is hit, so the names and
+// layout here are fixed by GDB.
+extern "C" {
+enum jit_actions_t : uint32_t { JIT_NOACTION = 0, JIT_REGISTER_FN, JIT_UNREGISTER_FN };
+
+struct jit_code_entry {
+	jit_code_entry* next_entry;
+	jit_code_entry* prev_entry;
+	const char* symfile_addr;
+	uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+	uint32_t version;
+	uint32_t action_flag;
+	jit_code_entry* relevant_entry;
+	jit_code_entry* first_entry;
+};
+
+void __jit_debug_register_code();
+extern jit_descriptor __jit_debug_descriptor;
+}
+
+namespace jit {
+
+// Where a jitted instruction starts, as an offset into the hot code of its block.
+using NativeLine = std::pair<uint32_t, const Instruction*>;
+
+// Tells GDB about jitted code with an in-memory ELF object per compiled block. The object
+// names the code `func:block`, maps it back to the lines of the ILOC listing and says how
+// to unwind its frame, so backtraces go through it.
+//
+// The listing is the program as it is run, after passes, the same as the dump `main`
+// prints. It is written to `<dir>/jit-<pid>.il` for GDB to show.
+struct GdbJit {
+	struct Entry {
+		std::vector<uint8_t> _elf;
+		jit_code_entry _entry;
+	};
+
+	std::mutex _lock;
+	std::string _listing_path;
+	std::ofstream _listing;
+	uint32_t _listing_lines = 0;
+	// The listing line of every instruction of the programs added
+	std::map<const Instruction*, uint32_t> _lines;
+	// Registered objects, GDB keeps pointers into them
+	std::deque<Entry> _entries;
+
+	// Start registering code, with the listing in `dir`.
+	tl::expected<void, Error> open(const std::string& dir);
+	bool enabled() const { return _listing.is_open(); }
+
+	// Append `prog` to the listing, before any of its code is compiled.
+	void add_program(const Program& prog);
+
+	// Register the `hot` and `cold` code of a block. The hot code starts with the frame
+	// set up by `push rbp; push rdi; sub rsp, frame_size`, the exit stubs in the cold code
+	// are only jumped to from inside that frame.
+	void add_code(std::string_view name, const uint8_t* hot, size_t hot_size,
+		const uint8_t* cold, size_t cold_size, uint32_t frame_size,
+		const std::vector<NativeLine>& lines);
+};
+
+// The one for this process, nothing is registered until it is opened.
+GdbJit& gdb_jit();
+
+}
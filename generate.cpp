@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <charconv>
+#include <random>
+#include <string>
+
+#include "generate.hpp"
+
+namespace jit {
+
+// Registers of a function of `shape`, loop counters first, then the trip count, the
+// values and the flags. Values only ever grow by a small constant per instruction run
+// and flags only hold compares, so no run of a generated program overflows.
+struct GenRegs {
+	uint32_t _limit;
+	uint32_t _values;
+	uint32_t _value_count;
+	uint32_t _flags;
+	uint32_t _flag_count;
+
+	GenRegs(const GenShape& shape) {
+		_limit = shape._loop_depth + 1;
+		_values = _limit + 1;
+		_flag_count = std::max(1u, shape._regs / 4);
+		_value_count = shape._regs - _flag_count;
+		_flags = _values + _value_count;
+	}
+};
+
+uint64_t GenShape::instr_count() const {
+	auto regs = GenRegs(*this);
+	uint64_t per_func = (uint64_t)_blocks * (_instrs + 1) + regs._value_count +
+						regs._flag_count + 6ull * _loop_depth + 4;
+	return _frames * (per_func + 1) + 2;
+}
+
+tl::expected<GenShape, Error> parse_gen_shape(std::string_view spec) {
+	auto shape = GenShape();
+	while (!spec.empty()) {
+		auto end = spec.find(',');
+		auto pair = spec.substr(0, end);
+		spec = end == std::string_view::npos ? "" : spec.substr(end + 1);
+		if (pair.empty()) {
+			continue;
+		}
+
+		auto eq = pair.find('=');
+		auto key = pair.substr(0, eq);
+		auto str = eq == std::string_view::npos ? "" : pair.substr(eq + 1);
+		uint64_t val = 0;
+		auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), val);
+		if (str.empty() || ec != std::errc() || ptr != str.data() + str.size()) {
+			return tl::make_unexpected(Error(ErrorKind::EK_INVALID_ARG,
+				"bad value in shape " + std::string(pair)));
+		}
+		if (key == "seed") {
+			shape._seed = val;
+			continue;
+		}
+		if (val > UINT32_MAX) {
+			return tl::make_unexpected(Error(ErrorKind::EK_INVALID_ARG,
+				"value too big in shape " + std::string(pair)));
+		}
+		if (key == "frames") {
+			shape._frames = (uint32_t)val;
+		} else if (key == "blocks") {
+			shape._blocks = (uint32_t)val;
+		} else if (key == "instrs") {
+			shape._instrs = (uint32_t)val;
+		} else if (key == "depth") {
+			shape._loop_depth = (uint32_t)val;
+		} else if (key == "trips") {
+			shape._trips = (uint32_t)val;
+		} else if (key == "regs") {
+			shape._regs = (uint32_t)val;
+		} else if (key == "branches") {
+			shape._branch_percent = (uint32_t)val;
+		} else {
+			return tl::make_unexpected(Error(
+				ErrorKind::EK_INVALID_ARG, "unknown shape key " + std::string(key)));
+		}
+	}
+	if (shape._frames == 0 || shape._blocks == 0 || shape._trips == 0) {
+		return tl::make_unexpected(Error(ErrorKind::EK_INVALID_ARG,
+			"a shape needs at least one frame, block and trip"));
+	}
+	if (shape._regs < 3 || shape._branch_percent > 100) {
+		return tl::make_unexpected(Error(ErrorKind::EK_INVALID_ARG,
+			"a shape needs at least 3 registers and at most 100% branches"));
+	}
+	return shape;
+}
+
+GenShape gen_shape_for(uint64_t instrs) {
+	auto shape = GenShape();
+	shape._frames = 1;
+	auto per_func = shape.instr_count();
+	shape._frames = (uint32_t)std::max<uint64_t>(1, instrs / per_func);
+	return shape;
+}
+
+// Writes one function at a time, every choice comes from `_rng` so a seed always gives
+// the same program
+struct Generator {
+	const GenShape& _shape;
+	GenRegs _regs;
+	std::mt19937_64 _rng;
+	std::string _out;
+
+	Generator(const GenShape& shape) : _shape(shape), _regs(shape), _rng(shape._seed) {}
+
+	uint32_t pick(uint32_t n) { return (uint32_t)(_rng() % n); }
+	std::string value() { return reg(_regs._values + pick(_regs._value_count)); }
+	std::string flag() { return reg(_regs._flags + pick(_regs._flag_count)); }
+	std::string imm() { return std::to_string((int64_t)pick(17) - 8); }
+	static std::string reg(uint32_t r) { return "%vr" + std::to_string(r); }
+
+	void line(const std::string& text) { _out += "    " + text + "\n"; }
+	void label(const std::string& name) { _out += "." + name + ": nop\n"; }
+
+	void arith() {
+		auto r = pick(100);
+		if (r < 10) {
+			line("loadI " + imm() + " => " + value());
+		} else if (r < 25) {
+			line("i2i " + value() + " => " + value());
+		} else if (r < 50) {
+			line("addI " + value() + ", " + imm() + " => " + value());
+		} else if (r < 65) {
+			line("add " + value() + ", " + flag() + " => " + value());
+		} else if (r < 75) {
+			line("mult " + value() + ", " + flag() + " => " + value());
+		} else if (r < 80) {
+			line("multI " + value() + ", " + (pick(2) ? "1" : "-1") + " => " + value());
+		} else {
+			static const char* CMPS[] = {"cmp_GT", "cmp_GE", "cmp_LT", "cmp_LE"};
+			line(std::string(CMPS[pick(4)]) + " " + value() + ", " + value() + " => " +
+				 flag());
+		}
+	}
+
+	void function(const std::string& name, bool is_main) {
+		auto depth = _shape._loop_depth;
+		auto first = _regs._values;
+		_out += ".frame " + name + ", 0" + (is_main ? "" : ", " + reg(first)) + "\n";
+		for (uint32_t i = is_main ? 0 : 1; i < _regs._value_count; i++) {
+			line("loadI " + std::to_string(i + 1) + " => " + reg(first + i));
+		}
+		for (uint32_t i = 0; i < _regs._flag_count; i++) {
+			line("loadI " + std::to_string(i % 2) + " => " + reg(_regs._flags + i));
+		}
+		line("loadI " + std::to_string(_shape._trips) + " => " + reg(_regs._limit));
+		if (depth > 0) {
+			line("loadI 0 => " + reg(1));
+		}
+		for (uint32_t d = 0; d < depth; d++) {
+			label("H" + std::to_string(d));
+			if (d + 1 < depth) {
+				line("loadI 0 => " + reg(d + 2));
+			}
+		}
+
+		// A branch skips the block after its own, the last one has nothing to skip
+		auto after_body = depth > 0 ? "T" + std::to_string(depth - 1) : std::string("X");
+		for (uint32_t b = 0; b < _shape._blocks; b++) {
+			label("B" + std::to_string(b));
+			auto branch = b + 1 < _shape._blocks && _shape._instrs > 0 &&
+						  pick(100) < _shape._branch_percent;
+			for (uint32_t i = 0; i + branch < _shape._instrs; i++) {
+				arith();
+			}
+			if (branch) {
+				auto target =
+					b + 2 < _shape._blocks ? "B" + std::to_string(b + 2) : after_body;
+				line("cbr " + flag() + " -> ." + target);
+			}
+		}
+
+		for (uint32_t d = depth; d-- > 0;) {
+			auto counter = reg(d + 1);
+			auto cond = reg(_regs._flags);
+			label("T" + std::to_string(d));
+			line("addI " + counter + ", 1 => " + counter);
+			line("cmp_LT " + counter + ", " + reg(_regs._limit) + " => " + cond);
+			line("cbr " + cond + " -> .H" + std::to_string(d));
+		}
+		label("X");
+		if (!is_main) {
+			line("iret " + value());
+			return;
+		}
+		for (uint32_t f = 1; f < _shape._frames; f++) {
+			line("icall f" + std::to_string(f) + ", " + reg(first) + " => " + reg(first));
+		}
+		line("iwrite " + reg(first));
+		line("ret");
+	}
+};
+
+void generate_iloc(std::ostream& os, const GenShape& shape) {
+	auto gen = Generator(shape);
+	os << "    .data\n    .text\n";
+	for (uint32_t f = 0; f < shape._frames; f++) {
+		gen.function(f == 0 ? "main" : "f" + std::to_string(f), f == 0);
+		os << gen._out;
+		gen._out.clear();
+	}
+}
+
+}
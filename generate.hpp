@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <string_view>
+
+#include "expected.hpp"
+#include "interp.hpp"
+
+namespace jit {
+
+// The shape of a synthetic program. `main` calls every other function once, each runs
+// its blocks inside `_loop_depth` nested loops of `_trips` iterations, so a program runs
+// about `_trips ^ _loop_depth` times the instructions it has and always returns.
+struct GenShape {
+	uint32_t _frames = 4;
+	// Blocks in the innermost loop of every function, besides the loop heads and ends
+	uint32_t _blocks = 8;
+	// Instructions after the `nop` of each of those blocks
+	uint32_t _instrs = 16;
+	uint32_t _loop_depth = 1;
+	uint32_t _trips = 2;
+	// Registers the arithmetic uses, besides the loop counters
+	uint32_t _regs = 16;
+	// Percent of blocks that end in a `cbr` skipping the block after them
+	uint32_t _branch_percent = 25;
+	uint64_t _seed = 1;
+
+	// Instructions a program of this shape has, near enough.
+	uint64_t instr_count() const;
+};
+
+// Read a shape from `key=value` pairs separated by commas, such as
+// `frames=100,blocks=20,instrs=8,depth=2,trips=3,regs=32,branches=50,seed=7`. Keys left
+// out keep their default.
+tl::expected<GenShape, Error> parse_gen_shape(std::string_view spec);
+
+// A shape of about `instrs` instructions, made of as many default sized functions as
+// it takes.
+GenShape gen_shape_for(uint64_t instrs);
+
+// Write a program of `shape` to `os`, using only instructions the loader reads. The same
+// shape always writes the same program.
+void generate_iloc(std::ostream& os, const GenShape& shape);
+
+}
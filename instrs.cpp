@@ -1,6 +1,9 @@
 #include <iostream>
 #include <variant>
 #include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <array>
 
 #include "instrs.hpp"
 #include "expected.hpp"
@@ -75,6 +78,125 @@ Value Value::add(Value& b) {
 	return Value(as_int() + b.as_int());
 }
 
+void* InstrArena::alloc(size_t size, size_t align) {
+	// Code reads `_kind` through a pointer to whatever instruction it expects before
+	// checking it, so every instruction gets the strictest alignment of any of them
+	align = std::max(align, alignof(CbrInstr));
+	_used = (_used + align - 1) & ~(align - 1);
+	if (_chunks.empty() || _used + size > CHUNK_SIZE) {
+		_chunks.push_back(std::make_unique<uint8_t[]>(CHUNK_SIZE));
+		_used = 0;
+	}
+	void* at = _chunks.back().get() + _used;
+	_used += size;
+	return at;
+}
+
+template <typename I> static void destroy_as(Instruction* inst) { ((I*)inst)->~I(); }
+
+// Instructions have no virtual destructor, the kind picks the type to destroy.
+static void destroy(Instruction* inst) {
+	switch (inst->_kind) {
+#define DESTROY(kind, type, ...) \
+	case InstrKind::kind: destroy_as<type>(inst); break;
+		JIT_OPCODES(DESTROY)
+#undef DESTROY
+	}
+}
+
+Instruction* InstrArena::copy(const Instruction* inst) {
+	switch (inst->_kind) {
+#define COPY(kind, type, ...) \
+	case InstrKind::kind: return make<type>(*(const type*)inst);
+		JIT_OPCODES(COPY)
+#undef COPY
+	}
+	return make<Instruction>(*inst);
+}
+
+void InstrArena::absorb(InstrArena&& other) {
+	// Keep allocating from our own last chunk, the other chunks just come along
+	auto last = _chunks.empty() ? nullptr : std::move(_chunks.back());
+	if (last) {
+		_chunks.pop_back();
+	}
+	for (auto& chunk : other._chunks) {
+		_chunks.push_back(std::move(chunk));
+	}
+	if (last) {
+		_chunks.push_back(std::move(last));
+	}
+	_instrs.insert(_instrs.end(), other._instrs.begin(), other._instrs.end());
+	other._chunks.clear();
+	other._instrs.clear();
+	other._used = CHUNK_SIZE;
+}
+
+void InstrArena::clear() {
+	for (auto* inst : _instrs) {
+		destroy(inst);
+	}
+	_instrs.clear();
+	_chunks.clear();
+	_used = CHUNK_SIZE;
+}
+
+std::optional<Reg> Instruction::def() const {
+	switch (op_info(_kind)._shape) {
+		case OS_R_R: return ((I2IInstr*)this)->_dst;
+		case OS_I_R: return ((LoadImmInstr*)this)->_dst;
+		case OS_RR_R: return ((BinaryInstr*)this)->_dst;
+		case OS_RI_R: return ((BinaryImmInstr*)this)->_dst;
+		case OS_CALL_R: return ((CallInstr*)this)->_dst;
+		default: return std::nullopt;
+	}
+}
+
+void Instruction::use_slots(std::vector<Reg*>& out) {
+	switch (op_info(_kind)._shape) {
+		case OS_R: {
+			out.push_back(&((UnaryInstr*)this)->_src);
+			break;
+		}
+		case OS_R_R: {
+			out.push_back(&((I2IInstr*)this)->_src);
+			break;
+		}
+		case OS_RR_R: {
+			auto bin = (BinaryInstr*)this;
+			out.push_back(&bin->_src1);
+			out.push_back(&bin->_src2);
+			break;
+		}
+		case OS_RI_R: {
+			out.push_back(&((BinaryImmInstr*)this)->_src1);
+			break;
+		}
+		case OS_R_L: {
+			out.push_back(&((CbrInstr*)this)->_src);
+			break;
+		}
+		case OS_CALL:
+		case OS_CALL_R: {
+			for (auto& arg : ((CallInstr*)this)->_args) {
+				out.push_back(&arg);
+			}
+			break;
+		}
+		default: {
+			break;
+		}
+	}
+}
+
+void Instruction::uses(std::vector<Reg>& out) const {
+	std::vector<Reg*> slots;
+	((Instruction*)this)->use_slots(slots);
+	for (auto* r : slots) {
+		out.push_back(*r);
+	}
+}
+
 std::ostream& operator<<(std::ostream& os, const Reg& reg) {
 	os << "Reg(" << reg._reg << ")";
 	return os;
@@ -109,14 +231,12 @@ std::ostream& operator<<(std::ostream& os, const Value& val) {
 }
 
 std::ostream& operator<<(std::ostream& os, const Instruction& instr) {
+	auto& op = op_info(instr._kind);
 	switch (instr._kind) {
-		case InstrKind::IK_DATA: {
-			os << ".data";
-			break;
-		}
+		case InstrKind::IK_DATA:
 		case InstrKind::IK_TEXT: {
-			os << ".text";
-			break;
+			os << op._mnemonic;
+			return os;
 		}
 		case InstrKind::IK_FRAME: {
 			auto& frame = (FrameInstr&)instr;
@@ -124,88 +244,218 @@ std::ostream& operator<<(std::ostream& os, const Instruction& instr) {
 			for (auto&& p : frame._params) {
 				os << " " << p;
 			}
+			return os;
+		}
+		case InstrKind::IK_LABEL: {
+			os << ((LabelInstr&)instr)._name;
+			return os;
+		}
+		case InstrKind::IK_GLOBAL: {
+			auto& global = (GlobalInstr&)instr;
+			os << global._name << " " << global._value;
+			return os;
+		}
+		default: {
 			break;
 		}
-		case InstrKind::IK_I2I: {
-			auto& mov = (I2IInstr&)instr;
-			os << "mov " << mov._src << " -> " << mov._dst;
+	}
+
+	auto ops = operands_of(&instr);
+	os << op._mnemonic;
+	switch (op._shape) {
+		case OS_R: {
+			os << " " << ops._src1;
 			break;
 		}
-		case InstrKind::IK_LOADIMM: {
-			auto& load = (LoadImmInstr&)instr;
-			os << "load " << load._src << " -> " << load._dst;
+		case OS_R_R: {
+			os << " " << ops._src1 << " -> " << ops._dst;
 			break;
 		}
-		case InstrKind::IK_ADDIMM: {
-			auto& add = (AddImmInstr&)instr;
-			os << "addI " << add._src1 << " + " << add._src2 << " -> " << add._dst;
+		case OS_I_R: {
+			os << " " << ops._imm << " -> " << ops._dst;
 			break;
 		}
-		case InstrKind::IK_ADD: {
-			auto& add = (AddInstr&)instr;
-			os << "add " << add._src1 << " + " << add._src2 << " -> " << add._dst;
+		case OS_RR_R: {
+			os << " " << ops._src1 << " " << op._infix << " " << ops._src2 << " -> "
+			   << ops._dst;
 			break;
 		}
-		case InstrKind::IK_MULTIMM: {
-			auto& mult = (MultImmInstr&)instr;
-			os << "multI " << mult._src1 << " * " << mult._src2 << " -> " << mult._dst;
+		case OS_RI_R: {
+			os << " " << ops._src1 << " " << op._infix << " " << ops._imm << " -> "
+			   << ops._dst;
 			break;
 		}
-		case InstrKind::IK_MULT: {
-			auto& mult = (MultInstr&)instr;
-			os << "mult " << mult._src1 << " * " << mult._src2 << " -> " << mult._dst;
+		case OS_R_L: {
+			os << " " << ops._src1 << " --> " << ((CbrInstr&)instr)._dst;
 			break;
 		}
-
-		case InstrKind::IK_CMP_GT: {
-			auto& cmp = (CmpGTInstr&)instr;
-			os << "cmp_GT " << cmp._src1 << " > " << cmp._src2 << " -> " << cmp._dst;
+		case OS_CALL:
+		case OS_CALL_R: {
+			os << " " << ops._label << "(";
+			for (size_t i = 0; i < ops._args.size(); i++) {
+				os << (i == 0 ? "" : ", ") << ops._args[i];
+			}
+			os << ")";
+			if (op._shape == OS_CALL_R) {
+				os << " -> " << ops._dst;
+			}
+			break;
+		}
+		default: {
 			break;
 		}
-		case InstrKind::IK_CMP_GE: {
-			auto& cmp = (CmpGEInstr&)instr;
-			os << "cmp_GE " << cmp._src1 << " >= " << cmp._src2 << " -> " << cmp._dst;
+	}
+	return os;
+}
+
+// The mnemonics hash into a table of `MNEMONIC_SLOTS` without collisions, the seed that
+// makes this so is searched for while compiling.
+static constexpr uint32_t MNEMONIC_SLOTS = 32;
+static constexpr uint8_t NO_OPCODE = UINT8_MAX;
+
+static constexpr uint32_t mnemonic_hash(std::string_view s, uint32_t seed) {
+	uint32_t h = 2166136261u ^ seed;
+	for (char c : s) {
+		h = (h ^ (uint8_t)c) * 16777619u;
+	}
+	return (h ^ (h >> 15)) & (MNEMONIC_SLOTS - 1);
+}
+
+static constexpr bool parsed_by_mnemonic(const OpInfo& op) {
+	return op._shape != OS_DIRECTIVE && !op._mnemonic.empty();
+}
+
+static constexpr uint32_t find_mnemonic_seed() {
+	for (uint32_t seed = 0;; seed++) {
+		bool used[MNEMONIC_SLOTS] = {};
+		bool collided = false;
+		for (auto& op : OPCODES) {
+			if (!parsed_by_mnemonic(op)) {
+				continue;
+			}
+			auto slot = mnemonic_hash(op._mnemonic, seed);
+			collided |= used[slot];
+			used[slot] = true;
+		}
+		if (!collided) {
+			return seed;
+		}
+	}
+}
+
+static constexpr uint32_t MNEMONIC_SEED = find_mnemonic_seed();
+
+static constexpr auto MNEMONIC_TABLE = [] {
+	std::array<uint8_t, MNEMONIC_SLOTS> table = {};
+	table.fill(NO_OPCODE);
+	for (size_t i = 0; i < std::size(OPCODES); i++) {
+		if (parsed_by_mnemonic(OPCODES[i])) {
+			table[mnemonic_hash(OPCODES[i]._mnemonic, MNEMONIC_SEED)] = (uint8_t)i;
+		}
+	}
+	return table;
+}();
+
+static_assert(std::size(OPCODES) < NO_OPCODE);
+static_assert(MNEMONIC_TABLE[mnemonic_hash("cmp_LE", MNEMONIC_SEED)] ==
+			  (uint8_t)InstrKind::IK_CMP_LE);
+
+std::optional<InstrKind> lookup_mnemonic(std::string_view mnemonic) {
+	auto idx = MNEMONIC_TABLE[mnemonic_hash(mnemonic, MNEMONIC_SEED)];
+	if (idx == NO_OPCODE || OPCODES[idx]._mnemonic != mnemonic) {
+		return std::nullopt;
+	}
+	return (InstrKind)idx;
+}
+
+Operands operands_of(const Instruction* inst) {
+	auto ops = Operands();
+	switch (op_info(inst->_kind)._shape) {
+		case OS_R: {
+			ops._src1 = ((const UnaryInstr*)inst)->_src;
 			break;
 		}
-		case InstrKind::IK_CMP_LT: {
-			auto& cmp = (CmpLTInstr&)instr;
-			os << "cmp_LT " << cmp._src1 << " < " << cmp._src2 << " -> " << cmp._dst;
+		case OS_R_R: {
+			auto mov = (const I2IInstr*)inst;
+			ops._src1 = mov->_src;
+			ops._dst = mov->_dst;
 			break;
 		}
-		case InstrKind::IK_CMP_LE: {
-			auto& cmp = (CmpLEInstr&)instr;
-			os << "cmp_LE " << cmp._src1 << " <= " << cmp._src2 << " -> " << cmp._dst;
+		case OS_I_R: {
+			auto load = (const LoadImmInstr*)inst;
+			ops._imm = load->_src;
+			ops._dst = load->_dst;
 			break;
 		}
-		case InstrKind::IK_CBR: {
-			auto& cbr = (CbrInstr&)instr;
-			os << "cbr " << cbr._src << " --> " << cbr._dst;
+		case OS_RR_R: {
+			auto bin = (const BinaryInstr*)inst;
+			ops._src1 = bin->_src1;
+			ops._src2 = bin->_src2;
+			ops._dst = bin->_dst;
 			break;
 		}
-
-		case InstrKind::IK_IWRITE: {
-			auto& w = (IWriteInstr&)instr;
-			os << "write " << w._src;
+		case OS_RI_R: {
+			auto bin = (const BinaryImmInstr*)inst;
+			ops._src1 = bin->_src1;
+			ops._imm = bin->_src2;
+			ops._dst = bin->_dst;
 			break;
 		}
-
-		case InstrKind::IK_RET: {
-			os << "ret";
+		case OS_R_L: {
+			auto cbr = (const CbrInstr*)inst;
+			ops._src1 = cbr->_src;
+			if (cbr->_dst._kind == ValKind::VK_LOCATION) {
+				ops._label = cbr->_dst.as_loc();
+			}
 			break;
 		}
-
-		case InstrKind::IK_LABEL: {
-			auto& lab = (LabelInstr&)instr;
-			os << lab._name;
+		case OS_CALL:
+		case OS_CALL_R: {
+			auto call = (const CallInstr*)inst;
+			ops._label = call->_name;
+			ops._args = call->_args;
+			ops._dst = call->_dst;
 			break;
 		}
-
 		default: {
-			os << "INVALID INSTRUCTION "
-			   << "\n";
 			break;
 		}
 	}
-	return os;
+	return ops;
+}
+
+template <typename I, OperandShape S>
+static Instruction* build_as(InstrArena& arena, const Operands& ops) {
+	if constexpr (S == OS_NONE) {
+		return arena.make<I>();
+	} else if constexpr (S == OS_R) {
+		return arena.make<I>(ops._src1);
+	} else if constexpr (S == OS_R_R) {
+		return arena.make<I>(ops._src1, ops._dst);
+	} else if constexpr (S == OS_I_R) {
+		return arena.make<I>(ops._imm, ops._dst);
+	} else if constexpr (S == OS_RR_R) {
+		return arena.make<I>(ops._src1, ops._src2, ops._dst);
+	} else if constexpr (S == OS_RI_R) {
+		return arena.make<I>(ops._src1, ops._imm, ops._dst);
+	} else if constexpr (S == OS_R_L) {
+		return arena.make<I>(
+			ops._src1, Value{ValKind::VK_LOCATION, std::string(ops._label)});
+	} else if constexpr (S == OS_CALL || S == OS_CALL_R) {
+		return arena.make<I>(std::string(ops._label),
+			std::vector<Reg>(ops._args.begin(), ops._args.end()), ops._dst);
+	} else {
+		return nullptr;
+	}
+}
+
+Instruction* build_instr(InstrArena& arena, InstrKind kind, const Operands& ops) {
+	switch (kind) {
+#define BUILD(kind, type, mnemonic, infix, shape, ...) \
+	case InstrKind::kind: return build_as<type, OS_##shape>(arena, ops);
+		JIT_OPCODES(BUILD)
+#undef BUILD
+	}
+	return nullptr;
+}
 }
-}
\ No newline at end of file
@@ -1,17 +1,55 @@
 #pragma once
 
 #include <map>
+#include <atomic>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <ostream>
 #include <variant>
 #include <optional>
+#include <span>
+#include <memory>
+#include <utility>
 
 #include "expected.hpp"
 
 namespace jit {
 struct Empty {};
 
+// A field that every context running a program may update at once, like a profile
+// counter. Loads and stores are relaxed atomics and `+=` is a load then a store instead
+// of a locked add, so concurrent runs can lose the odd update. The heuristics these feed
+// do not mind and a single run still only does plain moves.
+template <typename T> struct Relaxed {
+	std::atomic<T> _val;
+
+	Relaxed(T val = T()) : _val(val) {}
+	Relaxed(const Relaxed& other) : _val(other.load()) {}
+	Relaxed& operator=(const Relaxed& other) {
+		store(other.load());
+		return *this;
+	}
+	Relaxed& operator=(T val) {
+		store(val);
+		return *this;
+	}
+
+	T load(std::memory_order order = std::memory_order_relaxed) const {
+		return _val.load(order);
+	}
+	void store(T val, std::memory_order order = std::memory_order_relaxed) {
+		_val.store(val, order);
+	}
+	operator T() const { return load(); }
+
+	Relaxed& operator+=(T by) {
+		store(load() + by);
+		return *this;
+	}
+};
+
 enum ValKind {
 	// Integer value
 	VK_INT,
@@ -51,64 +89,111 @@ struct Value {
 	friend std::ostream& operator<<(std::ostream& os, const Value& instr);
 };
 
+// The most registers a frame may declare, loaders reject anything larger so sizing a
+// call's frame can not overflow.
+static constexpr uint32_t MAX_REGS = 1 << 20;
+
+// Whether `val` can be encoded as the sign extended 32-bit immediate of an x86 add,
+// imul or cmp.
+constexpr bool fits_imm32(int64_t val) { return val >= INT32_MIN && val <= INT32_MAX; }
+
 struct Reg {
 	uint32_t _reg;
 	Reg(uint32_t r) : _reg(r) {}
 
 	bool constexpr operator<(const Reg& b) const { return _reg < b._reg; }
+	bool constexpr operator==(const Reg& b) const { return _reg == b._reg; }
 
 	friend std::ostream& operator<<(std::ostream& os, const Reg& reg);
 };
 
+// Every instruction kind in `InstrKind` order, which is also the .ilb encoding:
+//
+//     X(kind, type, mnemonic, infix operator, operand shape, flags, eval)
+//
+// The enum, the mnemonic lookup of the loader, the printer, generic operand access and
+// copying and destroying instructions are all generated from this one list. `eval` is
+// the `Value` method computing an arithmetic instruction.
+#define JIT_OPCODES(X)                                                                  \
+	X(IK_DATA, DataInstr, ".data", "", DIRECTIVE, OF_NONE, nullptr)                     \
+	X(IK_TEXT, TextInstr, ".text", "", DIRECTIVE, OF_NONE, nullptr)                     \
+	X(IK_GLOBAL, GlobalInstr, "", "", DIRECTIVE, OF_NONE, nullptr)                      \
+	X(IK_FRAME, FrameInstr, ".frame", "", DIRECTIVE, OF_NONE, nullptr)                  \
+	X(IK_I2I, I2IInstr, "i2i", "", R_R, OF_PURE | OF_JIT, nullptr)                      \
+	X(IK_LOADIMM, LoadImmInstr, "loadI", "", I_R, OF_PURE | OF_JIT, nullptr)            \
+	X(IK_IWRITE, IWriteInstr, "iwrite", "", R, OF_EFFECT | OF_JIT, nullptr)             \
+	X(IK_CBR, CbrInstr, "cbr", "", R_L, OF_BRANCH | OF_JIT, nullptr)                    \
+	X(IK_CMP_GT, CmpGTInstr, "cmp_GT", ">", RR_R, OF_PURE | OF_JIT, &Value::cmp_gt)     \
+	X(IK_CMP_GE, CmpGEInstr, "cmp_GE", ">=", RR_R, OF_PURE | OF_JIT, &Value::cmp_ge)    \
+	X(IK_CMP_LT, CmpLTInstr, "cmp_LT", "<", RR_R, OF_PURE | OF_JIT, &Value::cmp_lt)     \
+	X(IK_CMP_LE, CmpLEInstr, "cmp_LE", "<=", RR_R, OF_PURE | OF_JIT, &Value::cmp_le)    \
+	X(IK_ADD, AddInstr, "add", "+", RR_R, OF_PURE | OF_JIT, &Value::add)                \
+	X(IK_ADDIMM, AddImmInstr, "addI", "+", RI_R, OF_PURE | OF_JIT, &Value::add)         \
+	X(IK_MULT, MultInstr, "mult", "*", RR_R, OF_PURE | OF_JIT, &Value::mult)            \
+	X(IK_MULTIMM, MultImmInstr, "multI", "*", RI_R, OF_PURE | OF_JIT, &Value::mult)     \
+	X(IK_RET, RetInstr, "ret", "", NONE, OF_BRANCH | OF_RETURN, nullptr)                \
+	X(IK_LABEL, LabelInstr, "", "", DIRECTIVE, OF_NONE, nullptr)                        \
+	X(IK_NOP, NopInstr, "nop", "", NONE, OF_PURE | OF_JIT, nullptr)                     \
+	X(IK_CALL, VoidCallInstr, "call", "", CALL, OF_EFFECT, nullptr)                     \
+	X(IK_ICALL, ICallInstr, "icall", "", CALL_R, OF_EFFECT, nullptr)                    \
+	X(IK_IRET, IRetInstr, "iret", "", R, OF_BRANCH | OF_RETURN, nullptr)
+
 enum class InstrKind {
-	// The .data section
-	IK_DATA,
-	// The .text section
-	IK_TEXT,
-	// Global value
-	IK_GLOBAL,
-	// The start of a function
-	IK_FRAME,
-	// Integer to integer move
-	IK_I2I,
-	// Load immediate
-	IK_LOADIMM,
-	// Integer write
-	IK_IWRITE,
-	// Conditional branch when true
-	IK_CBR,
-
-	// Compare, true if greater than
-	IK_CMP_GT,
-	// Compare, true if greater than or equal
-	IK_CMP_GE,
-	// Compare, true if less than
-	IK_CMP_LT,
-	// Compare, true if less than or equal
-	IK_CMP_LE,
-
-	// Add two registers contents
-	IK_ADD,
-	// Add register and literal contents
-	IK_ADDIMM,
-	// Multiply two registers contents
-	IK_MULT,
-	// Multiply register and literal contents
-	IK_MULTIMM,
-
-	// Return to the last frame
-	IK_RET,
-	// Label
-	IK_LABEL,
-
-	// A no-op instruction
-	IK_NOP,
+#define INSTR_KIND(kind, ...) kind,
+	JIT_OPCODES(INSTR_KIND)
+#undef INSTR_KIND
+};
+
+// Which operands an instruction has, as written in ILOC.
+enum OperandShape {
+	// `op`
+	OS_NONE,
+	// `op %vrA`
+	OS_R,
+	// `op %vrA => %vrB`
+	OS_R_R,
+	// `op imm => %vrB`
+	OS_I_R,
+	// `op %vrA, %vrB => %vrC`
+	OS_RR_R,
+	// `op %vrA, imm => %vrC`
+	OS_RI_R,
+	// `op %vrA -> label`
+	OS_R_L,
+	// `op name, %vrA, ...`
+	OS_CALL,
+	// `op name, %vrA, ... => %vrD`
+	OS_CALL_R,
+	// Sections, frames, labels and globals, each has its own syntax
+	OS_DIRECTIVE,
 };
+
+enum OpFlags {
+	OF_NONE = 0,
+	// No effect besides writing its destination
+	OF_PURE = 1 << 0,
+	// Visible outside the program, like output
+	OF_EFFECT = 1 << 1,
+	// May leave the block
+	OF_BRANCH = 1 << 2,
+	// The JIT can emit native code for it
+	OF_JIT = 1 << 3,
+	// Leaves the function
+	OF_RETURN = 1 << 4,
+};
+
 struct Instruction {
 	InstrKind _kind;
 
 	Instruction(InstrKind k) : _kind(k) {}
 
+	// The register this instruction writes, if any.
+	std::optional<Reg> def() const;
+	// Push every register this instruction reads onto `out`.
+	void uses(std::vector<Reg>& out) const;
+	// Like `uses` but the operands themselves so passes can rewrite them.
+	void use_slots(std::vector<Reg*>& out);
+
 	friend std::ostream& operator<<(std::ostream& os, const Instruction& instr);
 };
 struct DataInstr : Instruction {
@@ -151,88 +236,175 @@ struct LoadImmInstr : Instruction {
 		: Instruction(InstrKind::IK_LOADIMM), _src(src), _dst(dst) {}
 };
 
-struct AddInstr : Instruction {
+// `op %vrA, %vrB => %vrC`, the arithmetic and compare instructions
+struct BinaryInstr : Instruction {
 	Reg _src1;
 	Reg _src2;
 	Reg _dst;
 
-	AddInstr(Reg src1, Reg src2, Reg dst)
-		: Instruction(InstrKind::IK_ADD), _src1(src1), _src2(src2), _dst(dst) {}
+	BinaryInstr(InstrKind k, Reg src1, Reg src2, Reg dst)
+		: Instruction(k), _src1(src1), _src2(src2), _dst(dst) {}
 };
-struct AddImmInstr : Instruction {
+// `op %vrA, imm => %vrC`
+struct BinaryImmInstr : Instruction {
 	Reg _src1;
 	Value _src2;
 	Reg _dst;
 
-	AddImmInstr(Reg src1, Value src2, Reg dst)
-		: Instruction(InstrKind::IK_ADDIMM), _src1(src1), _src2(src2), _dst(dst) {}
+	BinaryImmInstr(InstrKind k, Reg src1, Value src2, Reg dst)
+		: Instruction(k), _src1(src1), _src2(src2), _dst(dst) {}
 };
-struct MultInstr : Instruction {
-	Reg _src1;
-	Reg _src2;
-	Reg _dst;
-
-	MultInstr(Reg src1, Reg src2, Reg dst)
-		: Instruction(InstrKind::IK_MULT), _src1(src1), _src2(src2), _dst(dst) {}
+template <InstrKind K> struct BinaryOp : BinaryInstr {
+	BinaryOp(Reg src1, Reg src2, Reg dst) : BinaryInstr(K, src1, src2, dst) {}
 };
-struct MultImmInstr : Instruction {
-	Reg _src1;
-	Value _src2;
-	Reg _dst;
+template <InstrKind K> struct BinaryImmOp : BinaryImmInstr {
+	BinaryImmOp(Reg src1, Value src2, Reg dst) : BinaryImmInstr(K, src1, src2, dst) {}
+};
+
+using AddInstr = BinaryOp<InstrKind::IK_ADD>;
+using AddImmInstr = BinaryImmOp<InstrKind::IK_ADDIMM>;
+using MultInstr = BinaryOp<InstrKind::IK_MULT>;
+using MultImmInstr = BinaryImmOp<InstrKind::IK_MULTIMM>;
+
+using CmpGTInstr = BinaryOp<InstrKind::IK_CMP_GT>;
+using CmpGEInstr = BinaryOp<InstrKind::IK_CMP_GE>;
+using CmpLTInstr = BinaryOp<InstrKind::IK_CMP_LT>;
+using CmpLEInstr = BinaryOp<InstrKind::IK_CMP_LE>;
+
+struct CbrInstr : Instruction {
+	Reg _src;
+	Value _dst;
+
+	// How often this branch went each way while interpreting
+	Relaxed<uint64_t> _taken = 0;
+	Relaxed<uint64_t> _not_taken = 0;
 
-	MultImmInstr(Reg src1, Value src2, Reg dst)
-		: Instruction(InstrKind::IK_MULTIMM), _src1(src1), _src2(src2), _dst(dst) {}
+	CbrInstr(Reg src, Value loc) : Instruction(InstrKind::IK_CBR), _src(src), _dst(loc) {}
 };
 
-struct CmpGTInstr : Instruction {
-	Reg _src1;
-	Reg _src2;
-	Reg _dst;
+// `op %vrA`
+struct UnaryInstr : Instruction {
+	Reg _src;
 
-	CmpGTInstr(Reg src1, Reg src2, Reg dst)
-		: Instruction(InstrKind::IK_CMP_GT), _src1(src1), _src2(src2), _dst(dst) {}
+	UnaryInstr(InstrKind k, Reg src) : Instruction(k), _src(src) {}
 };
-struct CmpGEInstr : Instruction {
-	Reg _src1;
-	Reg _src2;
-	Reg _dst;
+template <InstrKind K> struct UnaryOp : UnaryInstr {
+	UnaryOp(Reg src) : UnaryInstr(K, src) {}
+};
+
+using IWriteInstr = UnaryOp<InstrKind::IK_IWRITE>;
+// Return the value of a register to the `icall` that called this function
+using IRetInstr = UnaryOp<InstrKind::IK_IRET>;
 
-	CmpGEInstr(Reg src1, Reg src2, Reg dst)
-		: Instruction(InstrKind::IK_CMP_GE), _src1(src1), _src2(src2), _dst(dst) {}
+struct RetInstr : Instruction {
+	RetInstr() : Instruction(InstrKind::IK_RET) {}
 };
-struct CmpLTInstr : Instruction {
-	Reg _src1;
-	Reg _src2;
-	Reg _dst;
 
-	CmpLTInstr(Reg src1, Reg src2, Reg dst)
-		: Instruction(InstrKind::IK_CMP_LT), _src1(src1), _src2(src2), _dst(dst) {}
+struct NopInstr : Instruction {
+	NopInstr() : Instruction(InstrKind::IK_NOP) {}
 };
-struct CmpLEInstr : Instruction {
-	Reg _src1;
-	Reg _src2;
+
+struct Function;
+
+// `call name, %vrA, ...` and `icall name, %vrA, ... => %vrD`
+struct CallInstr : Instruction {
+	std::string _name;
+	std::vector<Reg> _args;
+	// Only written by `icall`
 	Reg _dst;
+	// Resolved before running so calls do not look the function up by name
+	Function* _callee = nullptr;
 
-	CmpLEInstr(Reg src1, Reg src2, Reg dst)
-		: Instruction(InstrKind::IK_CMP_LE), _src1(src1), _src2(src2), _dst(dst) {}
+	CallInstr(InstrKind k, std::string name, std::vector<Reg> args, Reg dst)
+		: Instruction(k), _name(name), _args(args), _dst(dst) {}
+};
+template <InstrKind K> struct CallOp : CallInstr {
+	CallOp(std::string name, std::vector<Reg> args, Reg dst)
+		: CallInstr(K, std::move(name), std::move(args), dst) {}
 };
 
-struct CbrInstr : Instruction {
-	Reg _src;
-	Value _dst;
+using VoidCallInstr = CallOp<InstrKind::IK_CALL>;
+using ICallInstr = CallOp<InstrKind::IK_ICALL>;
 
-	CbrInstr(Reg src, Value loc) : Instruction(InstrKind::IK_CBR), _src(src), _dst(loc) {}
+struct OpInfo {
+	InstrKind _kind;
+	std::string_view _mnemonic;
+	// How the printer writes the operator of `OS_RR_R` and `OS_RI_R` instructions
+	std::string_view _infix;
+	OperandShape _shape;
+	uint32_t _flags;
+	Value (Value::*_eval)(Value& b);
 };
 
-struct IWriteInstr : Instruction {
-	Reg _src;
+static constexpr OpInfo OPCODES[] = {
+#define OP_INFO(kind, type, mnemonic, infix, shape, flags, eval) \
+	OpInfo{InstrKind::kind, mnemonic, infix, OS_##shape, flags, eval},
+	JIT_OPCODES(OP_INFO)
+#undef OP_INFO
+};
 
-	IWriteInstr(Reg src)
-		: Instruction(InstrKind::IK_IWRITE), _src(src) {}
+constexpr const OpInfo& op_info(InstrKind k) { return OPCODES[(size_t)k]; }
+
+// The kind of the instruction written as `mnemonic`, directives are not in the table.
+std::optional<InstrKind> lookup_mnemonic(std::string_view mnemonic);
+
+// The operands of any non directive instruction, which of them are used depends on the
+// shape of its kind.
+struct Operands {
+	Reg _src1 = 0;
+	Reg _src2 = 0;
+	Reg _dst = 0;
+	Value _imm;
+	// Branch target of `OS_R_L` or the function called, a view into the instruction or
+	// the source text
+	std::string_view _label;
+	std::span<const Reg> _args;
 };
 
-struct RetInstr : Instruction {
-	RetInstr() : Instruction(InstrKind::IK_RET) {}
+// The operands of `inst`.
+Operands operands_of(const Instruction* inst);
+
+// Owns the instructions of a program. They are bump allocated out of large chunks so
+// the instructions of a block sit next to each other and all of them go away with the
+// arena.
+struct InstrArena {
+	static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+	std::vector<std::unique_ptr<uint8_t[]>> _chunks;
+	// Bytes handed out from the last chunk
+	size_t _used = CHUNK_SIZE;
+	// Every instruction in allocation order, they are destroyed through this
+	std::vector<Instruction*> _instrs;
+
+	InstrArena() = default;
+	InstrArena(InstrArena&& other) = default;
+	InstrArena& operator=(InstrArena&& other) {
+		clear();
+		_chunks = std::move(other._chunks);
+		_used = std::exchange(other._used, CHUNK_SIZE);
+		_instrs = std::move(other._instrs);
+		return *this;
+	}
+	~InstrArena() { clear(); }
+
+	InstrArena(const InstrArena&) = delete;
+	InstrArena& operator=(const InstrArena&) = delete;
+
+	template <typename I, typename... Args> I* make(Args&&... args) {
+		auto inst = new (alloc(sizeof(I), alignof(I))) I(std::forward<Args>(args)...);
+		_instrs.push_back(inst);
+		return inst;
+	}
+
+	void* alloc(size_t size, size_t align);
+	// Copy `inst` from wherever it lives into this arena.
+	Instruction* copy(const Instruction* inst);
+	// Take over every instruction of `other`.
+	void absorb(InstrArena&& other);
+	void clear();
 };
 
+// Make an instruction of `kind` out of `ops`, directives can not be built this way.
+Instruction* build_instr(InstrArena& arena, InstrKind kind, const Operands& ops);
+
 }
\ No newline at end of file
@@ -1,8 +1,18 @@
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <set>
 
 #include "interp.hpp"
 #include "expected.hpp"
 #include "jit.hpp"
+#include "output.hpp"
+#include "passes.hpp"
+#include "profiler.hpp"
+#include "sampler.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+#include "verify.hpp"
 
 namespace jit {
 std::ostream& operator<<(std::ostream& os, const Error& err) {
@@ -61,187 +71,692 @@ void Parser::finalize_prog() {
 	}
 }
 
-tl::expected<void, Error> Interpreter::run() {
-	auto ok_result = tl::expected<void, Error>();
+tl::expected<uint32_t, Error> parse_profile_points(std::string_view names) {
+	static constexpr std::pair<std::string_view, uint32_t> POINTS[] = {
+		{"none", PP_NONE},
+		{"cmp", PP_CMP},
+		{"mult", PP_MULT},
+		{"add", PP_ADD},
+		{"all", PP_ALL},
+	};
+	uint32_t points = PP_NONE;
+	while (!names.empty()) {
+		auto end = names.find(',');
+		auto name = names.substr(0, end);
+		names = end == std::string_view::npos ? "" : names.substr(end + 1);
+		if (name.empty()) {
+			continue;
+		}
+
+		auto point = std::find_if(std::begin(POINTS), std::end(POINTS),
+			[&](const auto& p) { return name == p.first; });
+		if (point == std::end(POINTS)) {
+			return tl::make_unexpected(Error(
+				ErrorKind::EK_INVALID_ARG, "unknown profile point " + std::string(name)));
+		}
+		points |= point->second;
+	}
+	return points;
+}
+
+// The `ProfilePoint` an arithmetic or compare instruction samples its operands at.
+static uint32_t profile_point(InstrKind kind) {
+	switch (kind) {
+		case InstrKind::IK_CMP_GT:
+		case InstrKind::IK_CMP_GE:
+		case InstrKind::IK_CMP_LT:
+		case InstrKind::IK_CMP_LE: return PP_CMP;
+		case InstrKind::IK_ADD:
+		case InstrKind::IK_ADDIMM: return PP_ADD;
+		case InstrKind::IK_MULT:
+		case InstrKind::IK_MULTIMM: return PP_MULT;
+		default: return PP_NONE;
+	}
+}
+
+// A register that looked constant every time so far but has too few samples to trust.
+static bool profile_warming_up(const Block& blk) {
+	if (!blk._specialize || blk._exec_count > VALUE_PROFILE_MIN_SAMPLES) {
+		return false;
+	}
+	// Slots are there from the start, only the ones sampled so far count
+	return std::any_of(blk._value_profile.begin(), blk._value_profile.end(),
+		[](const auto& p) {
+			return p.second._samples != 0 && p.second._hits == p.second._samples;
+		});
+}
+
+void pack_instrs(std::map<std::string, Function>& funcs, InstrArena& arena) {
+	auto packed = InstrArena();
+	for (auto& [fname, func] : funcs) {
+		for (auto& [bname, blk] : func._blocks) {
+			for (auto& inst : blk._instrs) {
+				inst = packed.copy(inst);
+			}
+		}
+	}
+	arena = std::move(packed);
+}
+
+// Compile every block of `func` that has run more than once, in layout order so hot
+// chains end up next to each other in the arena.
+void Program::compile_function(Function& func) {
+	layout_blocks(func);
+	for (auto& name : func._layout) {
+		auto& blk = func._blocks.at(name);
+		if (blk._exec_count < 2 || blk._compiled || blk._jit_failed ||
+			profile_warming_up(blk)) {
+			continue;
+		}
+		auto scope = TraceScope("compile", "jit");
+		auto start = std::chrono::steady_clock::now();
+		auto j = Jit(func, blk, _arena, _unroll_factor);
+		j._store_kinds = !_verified;
+		auto compiled = j.compile();
+		std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+		auto& stats = thread_stats();
+		stats.add(STAT_COMPILES);
+		stats.add(STAT_COMPILE_NS, elapsed.count());
+		stats.add(HIST_COMPILE_NS, elapsed.count());
+		if (!compiled) {
+			stats.add(STAT_COMPILE_FAILURES);
+			blk._jit_failed = true;
+			if (scope._on) {
+				scope._args.add("block", func._name + ":" + name).add("failed", 1);
+			}
+			continue;
+		}
+		if (scope._on) {
+			scope._args.add("block", func._name + ":" + name)
+				.add("hot_bytes", j._code_idx)
+				.add("cold_bytes", j._cold_idx);
+		}
+		stats.add(STAT_CODE_BYTES, j._code_idx + j._cold_idx);
+		stats.add(HIST_CODE_BYTES, j._code_idx + j._cold_idx);
+		if (_sampler) {
+			_sampler->add_code(func, blk, j._code, j._code_idx, j._cold,
+				j._cold ? j._cold_idx : 0, j._trace);
+		}
+		_compiled.push_back(CompiledBlock{j._code, j._exits,
+			std::vector<Reg>(j._reads.begin(), j._reads.end()),
+			std::vector<Reg>(j._stores.begin(), j._stores.end())});
+		blk._compiled.store(&_compiled.back(), std::memory_order_release);
+	}
+}
+
+std::vector<BranchProfile> Program::branch_profile() const {
+	std::vector<BranchProfile> profile;
+	for (auto& [fname, func] : _funcs) {
+		for (auto& [bname, blk] : func._blocks) {
+			for (uint32_t i = 0; i < blk._instrs.size(); i++) {
+				auto cbr = (CbrInstr*)blk._instrs[i];
+				if (cbr->_kind != InstrKind::IK_CBR) {
+					continue;
+				}
+				profile.push_back(
+					BranchProfile{fname, bname, i, cbr, cbr->_taken, cbr->_not_taken});
+			}
+		}
+	}
+	return profile;
+}
+
+const CompiledBlock* Program::tier_up(Function& func, Block& blk) {
+	auto code = blk._compiled.load(std::memory_order_acquire);
+	if (code || blk._jit_failed) {
+		return code;
+	}
+	std::lock_guard lock(_jit_lock);
+	// Every block entered with its code compiled is a hit of the code cache, this is a
+	// miss. Blocks still warming up make it compile nothing.
+	auto scope = TraceScope("tier_up", "jit");
+	auto compiled = _compiled.size();
+	thread_stats().add(STAT_CODE_CACHE_MISSES);
+	if (_profiler) {
+		auto start = std::chrono::steady_clock::now();
+		compile_function(func);
+		std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+		_profiler->_compile_ns += elapsed.count();
+	} else {
+		compile_function(func);
+	}
+	if (scope._on) {
+		scope._args.add("block", func._name + ":" + blk._name)
+			.add("compiled_blocks", _compiled.size() - compiled);
+	}
+	return blk._compiled.load(std::memory_order_acquire);
+}
+
+void Program::link_calls() {
+	std::vector<Reg> regs;
+	for (auto& [fname, func] : _funcs) {
+		uint64_t num_regs = 0;
+		for (auto& arg : func._args) {
+			num_regs = std::max(num_regs, (uint64_t)arg._reg + 1);
+		}
+		for (auto& [bname, blk] : func._blocks) {
+			for (auto* inst : blk._instrs) {
+				regs.clear();
+				inst->uses(regs);
+				if (auto def = inst->def()) {
+					regs.push_back(*def);
+				}
+				for (auto& r : regs) {
+					num_regs = std::max(num_regs, (uint64_t)r._reg + 1);
+				}
+
+				auto shape = op_info(inst->_kind)._shape;
+				if (shape == OS_CALL || shape == OS_CALL_R) {
+					auto call = (CallInstr*)inst;
+					auto callee = _funcs.find(call->_name);
+					call->_callee = callee == _funcs.end() ? nullptr : &callee->second;
+				}
+			}
+		}
+		if (num_regs > MAX_REGS) {
+			_link_error = Error(ErrorKind::EK_INVALID_INST,
+				func._name + ": register out of range");
+			num_regs = 0;
+		}
+		func._num_regs = (uint32_t)num_regs;
+	}
+}
+
+void Program::add_profile_slots() {
+	for (auto& [fname, func] : _funcs) {
+		for (auto& [bname, blk] : func._blocks) {
+			blk._edge_counts.try_emplace(blk._fallthrough);
+			for (auto* inst : blk._instrs) {
+				auto ops = operands_of(inst);
+				auto shape = op_info(inst->_kind)._shape;
+				if (shape == OS_R_L && !ops._label.empty()) {
+					blk._edge_counts.try_emplace(std::string(ops._label));
+				}
+				if (!(_profile_points & profile_point(inst->_kind))) {
+					continue;
+				}
+				blk._value_profile.try_emplace(ops._src1);
+				if (shape == OS_RR_R) {
+					blk._value_profile.try_emplace(ops._src2);
+				}
+			}
+			// Map nodes never move, so the slots can be resolved once for every run
+			blk._value_slots.clear();
+			if (blk._value_profile.empty()) {
+				continue;
+			}
+			blk._value_slots.resize(blk._instrs.size());
+			for (size_t i = 0; i < blk._instrs.size(); i++) {
+				auto* inst = blk._instrs[i];
+				if (!(_profile_points & profile_point(inst->_kind))) {
+					continue;
+				}
+				auto ops = operands_of(inst);
+				blk._value_slots[i][0] = &blk._value_profile.find(ops._src1)->second;
+				if (op_info(inst->_kind)._shape == OS_RR_R) {
+					blk._value_slots[i][1] = &blk._value_profile.find(ops._src2)->second;
+				}
+			}
+		}
+	}
+}
+
+template <bool Checked>
+tl::expected<void, Error> ExecutionContext::push_call(
+	Function& func, const CallInstr* call) {
+	if (_call_stack.size() >= MAX_CALL_DEPTH) {
+		return tl::make_unexpected(Error(ErrorKind::EK_OOM, "call stack overflow"));
+	}
+	if constexpr (Checked) {
+		if (call && call->_args.size() != func._args.size()) {
+			return tl::make_unexpected(Error(ErrorKind::EK_INVALID_INST,
+				"wrong number of arguments to " + func._name));
+		}
+	}
+
+	size_t caller = 0;
+	size_t base = 0;
+	if (!_call_stack.empty()) {
+		caller = _call_stack.back()._base;
+		base = caller + _call_stack.back()._func->_num_regs;
+	}
+	size_t end = base + func._num_regs;
+	if (_values.size() < end) {
+		_values.resize(std::max({end, _values.size() * 2, VALUE_STACK_SLOTS}));
+		_counts._stack_growths += 1;
+	}
+	// Checked reads tell unwritten registers by their null kind. Jitted code only
+	// stores the integer of a register, so a verified program starts them as integers.
+	auto empty = Checked ? Value() : Value((int64_t)0);
+	std::fill(_values.begin() + base, _values.begin() + end, empty);
+	if (call) {
+		for (size_t i = 0; i < func._args.size(); i++) {
+			_values[base + func._args[i]._reg] = _values[caller + call->_args[i]._reg];
+		}
+	}
+
+	auto ret_block = call ? &get_block() : nullptr;
+	_call_stack.push_back(CallInfo{&func, base, call, ret_block, _inst_idx});
+	_regs = _values.data() + base;
+	_func_name = func._name;
+	_block_name = "__start__";
+	_inst_idx = 0;
+	return tl::expected<void, Error>();
+}
+
+bool ExecutionContext::native_ready(const CompiledBlock& code) {
+	for (auto& r : code._reads) {
+		if (_regs[r._reg]._kind == ValKind::VK_NULL &&
+			!std::binary_search(code._stores.begin(), code._stores.end(), r)) {
+			return false;
+		}
+	}
+	// Native code stores the integer and then the kind, the integer has to be the
+	// alternative held for that to make a `Value`. Unwritten registers stay null until
+	// the code writes them.
+	for (auto& r : code._stores) {
+		auto& slot = _regs[r._reg];
+		if (slot._kind == ValKind::VK_NULL) {
+			slot._val = (int64_t)0;
+		}
+	}
+	return true;
+}
+
+bool ExecutionContext::pop_call() {
+	auto done = _call_stack.back();
+	_call_stack.pop_back();
+	if (_call_stack.empty()) {
+		return false;
+	}
+	auto& caller = _call_stack.back();
+	_regs = _values.data() + caller._base;
+	_func_name = caller._func->_name;
+	_block_name = done._ret_block->_name;
+	_inst_idx = done._ret_idx;
+	if (_prog._sampler) {
+		sample_at(done._ret_block, ST_INTERP);
+	}
+	return true;
+}
 
+tl::expected<void, Error> Program::verify() {
+	auto scope = TraceScope("verify", "load");
+	if (_link_error) {
+		return tl::make_unexpected(*_link_error);
+	}
+	auto res = verify_program(_funcs);
+	if (!res) {
+		return tl::make_unexpected(res.error());
+	}
+	_verified = true;
+	return tl::expected<void, Error>();
+}
+
+void Program::dump(
+	std::ostream& os, std::map<const Instruction*, uint32_t>* lines) const {
+	uint32_t line = 1;
 	for (auto&& p : _funcs) {
 		auto&& [fname, func] = p;
-		std::cout << "func " << fname << "{\n";
+		os << "func " << fname << "{\n";
+		line += 1;
 		for (auto&& pair : func._blocks) {
 			auto&& [bname, blk] = pair;
-			std::cout << "  blk " << bname << "{\n";
+			os << "  blk " << bname << "{\n";
+			line += 1;
 			for (auto&& inst : blk._instrs) {
-				std::cout << "    " << *inst << "\n";
+				os << "    " << *inst << "\n";
+				if (lines) {
+					(*lines)[inst] = line;
+				}
+				line += 1;
 			}
-			std::cout << "  }\n";
+			os << "  }\n";
+			line += 1;
 		}
-		std::cout << "}\n";
+		os << "}\n";
+		line += 1;
 	}
+}
 
-	auto inst = get_inst();
-	while (true) {
-		_inst_idx += 1;
+static const char* status_name(const tl::expected<RunStatus, Error>& res) {
+	if (!res) {
+		return "error";
+	}
+	switch (*res) {
+		case RS_DONE:
+			return "done";
+		case RS_OUT_OF_FUEL:
+			return "out_of_fuel";
+		case RS_OUTPUT_HELD:
+			return "output_held";
+	}
+	return "unknown";
+}
 
-		switch (inst->_kind) {
-			case InstrKind::IK_LOADIMM: {
-				auto load = (LoadImmInstr*)inst;
-				_registers.insert_or_assign(load->_dst, load->_src);
-				break;
+tl::expected<RunStatus, Error> ExecutionContext::run() {
+	if (_prog._link_error) {
+		return tl::make_unexpected(*_prog._link_error);
+	}
+	tl::expected<RunStatus, Error> res;
+	auto resumed = !_call_stack.empty();
+	auto scope = TraceScope("run", "run");
+	_counts = RunCounts();
+	_interp_since = scope._start;
+	if (_prog._sampler) {
+		_prog._sampler->add(this);
+	}
+	if (_prog._profiler) {
+		auto start = std::chrono::steady_clock::now();
+		res = _prog._verified ? run_loop<false, true>() : run_loop<true, true>();
+		std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+		_prog._profiler->_run_ns += elapsed.count();
+	} else {
+		res = _prog._verified ? run_loop<false, false>() : run_loop<true, false>();
+	}
+	// Idle first, waiting to be removed is not running the program
+	if (_prog._sampler) {
+		_sample_at = 0;
+		_prog._sampler->remove(this);
+	}
+	// A run that failed can not be picked up again
+	if (!res) {
+		_call_stack.clear();
+	}
+	auto& stats = thread_stats();
+	// Fuel slices, async resumes and held output all come back through here, only
+	// count the run once it is over
+	if (!res || *res == RS_DONE) {
+		stats.add(STAT_RUNS);
+	}
+	if (resumed) {
+		stats.add(STAT_RESUMES);
+	}
+	stats.add(STAT_BLOCKS_ENTERED, _counts._blocks);
+	stats.add(STAT_INTERP_INSTRS, _counts._interp_instrs);
+	stats.add(STAT_NATIVE_INSTRS, _counts._native_instrs);
+	stats.add(STAT_CODE_CACHE_HITS, _counts._native_entries);
+	stats.add(STAT_DEOPTS, _counts._deopts);
+	stats.add(STAT_VALUE_STACK_GROWTHS, _counts._stack_growths);
+	if (scope._on) {
+		tracer().span("interpret", "interp", _interp_since);
+		scope._args.add("status", status_name(res))
+			.add("native_entries", _counts._native_entries)
+			.add("deopts", _counts._deopts);
+	}
+	// Returning from `main`, stopping early or on an error, the output goes out now
+	_out->flush();
+	return res;
+}
+
+static Error missing_register(const Reg& reg) {
+	return Error(
+		ErrorKind::EK_INVALID_REG, "missing register " + std::to_string(reg._reg));
+}
+
+// Count leaving `blk` for `succ`, the slot was added by `add_profile_slots`.
+static void count_edge(Block& blk, std::string_view succ) {
+	auto it = blk._edge_counts.find(succ);
+	if (it != blk._edge_counts.end()) {
+		it->second += 1;
+	}
+}
+
+void ExecutionContext::trace_native(
+	const Block& blk, uint64_t start, const JitExit& exit) {
+	auto name = _func_name + ":" + blk._name;
+	tracer().span("native", "jit", start,
+		TraceArgs().add("block", name).add("exit", _func_name + ":" + exit._block));
+	if (exit._deopt) {
+		tracer().instant("deopt", "jit", TraceArgs().add("block", name));
+	}
+	_interp_since = tracer().now();
+}
+
+template <bool Checked, bool Profiled>
+tl::expected<RunStatus, Error> ExecutionContext::run_loop() {
+	auto ok_result = tl::expected<RunStatus, Error>(RS_DONE);
+	auto& out = *_out;
+	auto traced = tracer().enabled();
+	auto sampled = _prog._sampler != nullptr;
+	auto jit = _prog._jit;
+
+	// A run that stopped early did so at the start of a block with its calls intact
+	if (_call_stack.empty()) {
+		auto main = _prog._funcs.find("main");
+		if (main == _prog._funcs.end()) {
+			return tl::make_unexpected(
+				Error(ErrorKind::EK_INVALID_INST, "no main function"));
+		}
+		auto entered = push_call<Checked>(main->second, nullptr);
+		if (!entered) {
+			return tl::make_unexpected(entered.error());
+		}
+	}
+
+	while (true) {
+		// Follow fallthroughs and pay for every block entered, running the ones with
+		// native code until the next instruction has to be interpreted
+		auto* blk = &get_block();
+		while (true) {
+			while (_inst_idx == blk->_instrs.size()) {
+				count_edge(*blk, blk->_fallthrough);
+				_inst_idx = 0;
+				_block_name = blk->_fallthrough;
+				blk = &get_block();
 			}
-			case InstrKind::IK_I2I: {
-				auto mov = (I2IInstr*)inst;
-				tl::expected<Value*, Error> res = get_register_value(mov->_src);
-				if (!res) {
-					return tl::make_unexpected(res.error());
-				}
-				_registers.insert_or_assign(mov->_dst, *res.value());
+			if (_inst_idx != 0) {
 				break;
 			}
 
-			case InstrKind::IK_ADD: {
-				auto add = (AddInstr*)inst;
-				tl::expected<Value*, Error> res = get_register_value(add->_src1);
-				if (!res) {
-					return tl::make_unexpected(res.error());
-				}
-				tl::expected<Value*, Error> res2 = get_register_value(add->_src2);
-				if (!res2) {
-					return tl::make_unexpected(res2.error());
-				}
-				_registers.insert_or_assign(add->_dst, res.value()->add(*res2.value()));
-				break;
+			if (_fuel <= 0) {
+				return RS_OUT_OF_FUEL;
+			}
+			if (!out._held.empty()) {
+				return RS_OUTPUT_HELD;
 			}
-			case InstrKind::IK_ADDIMM: {
-				auto add = (AddImmInstr*)inst;
-				tl::expected<Value*, Error> res = get_register_value(add->_src1);
-				if (!res) {
-					return tl::make_unexpected(res.error());
+			blk->_exec_count += 1;
+			_counts._blocks += 1;
+			auto warm = jit && blk->_exec_count >= 2;
+			if (sampled && warm && !blk->_jit_failed &&
+				!blk->_compiled.load(std::memory_order_relaxed)) {
+				sample_at(blk, ST_COMPILE);
+			}
+			auto* code = warm ? _prog.tier_up(get_func(), *blk) : nullptr;
+			if constexpr (Checked) {
+				if (code && !native_ready(*code)) {
+					code = nullptr;
 				}
-				_registers.insert_or_assign(add->_dst, res.value()->add(add->_src2));
-				break;
 			}
-			case InstrKind::IK_MULT: {
-				auto mult = (MultInstr*)inst;
-				tl::expected<Value*, Error> res = get_register_value(mult->_src1);
-				if (!res) {
-					return tl::make_unexpected(res.error());
+			// Native code leaves at a block it can not pay for in full, that block is
+			// interpreted on what is left
+			auto cost = (int64_t)blk->_instrs.size();
+			if (!code || _fuel < cost) {
+				_fuel -= cost;
+				_counts._interp_instrs += cost;
+				if (sampled) {
+					sample_at(blk, ST_INTERP);
 				}
-				tl::expected<Value*, Error> res2 = get_register_value(mult->_src2);
-				if (!res2) {
-					return tl::make_unexpected(res2.error());
+				if constexpr (Profiled) {
+					blk->_profile->_interp_runs += 1;
 				}
-				_registers.insert_or_assign(mult->_dst, res.value()->mult(*res2.value()));
 				break;
 			}
-			case InstrKind::IK_MULTIMM: {
-				auto mult = (MultImmInstr*)inst;
-				tl::expected<Value*, Error> res = get_register_value(mult->_src1);
-				if (!res) {
-					return tl::make_unexpected(res.error());
-				}
-				_registers.insert_or_assign(mult->_dst, res.value()->mult(mult->_src2));
-				break;
+			// Native code pays for its blocks itself
+			std::chrono::steady_clock::time_point start;
+			if constexpr (Profiled) {
+				blk->_profile->_jit_entries += 1;
+				start = std::chrono::steady_clock::now();
+			}
+			if (sampled) {
+				sample_at(blk, ST_NATIVE);
 			}
+			uint64_t native_start = 0;
+			if (traced) {
+				native_start = tracer().now();
+				tracer().span("interpret", "interp", _interp_since);
+			}
+			auto fuel = _fuel;
+			auto exit = ((JitCall)code->_entry)(_regs, _out, &_fuel);
+			auto& next = code->_exits[exit];
+			_counts._native_instrs += fuel - _fuel;
+			_counts._native_entries += 1;
+			if (traced) {
+				trace_native(*blk, native_start, next);
+			}
+			if constexpr (Profiled) {
+				auto elapsed = std::chrono::steady_clock::now() - start;
+				_prog._profiler->_native_ns +=
+					std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+				blk->_profile->_deopts += next._deopt ? 1 : 0;
+			}
+			if (next._deopt) {
+				_counts._deopts += 1;
+				blk->_compiled = nullptr;
+				blk->_specialize = false;
+			}
+			_block_name = next._block;
+			_inst_idx = next._inst_idx;
+			blk = &get_block();
+			if constexpr (Profiled) {
+				blk->_profile->_jit_exits += 1;
+			}
+		}
 
-			case InstrKind::IK_CMP_GE: {
-				auto cmp = (CmpGEInstr*)inst;
-				tl::expected<Value*, Error> res = get_register_value(cmp->_src1);
-				if (!res) {
-					return tl::make_unexpected(res.error());
-				}
-				tl::expected<Value*, Error> res2 = get_register_value(cmp->_src2);
-				if (!res2) {
-					return tl::make_unexpected(res2.error());
-				}
-				_registers.insert_or_assign(
-					cmp->_dst, res.value()->cmp_ge(*res2.value()));
+		auto inst = blk->_instrs[_inst_idx];
+		if constexpr (Profiled) {
+			blk->_profile->_instr_counts[_inst_idx] += 1;
+		}
+		_inst_idx += 1;
+
+		switch (inst->_kind) {
+			case InstrKind::IK_LOADIMM: {
+				auto load = (LoadImmInstr*)inst;
+				write_register(load->_dst, load->_src);
 				break;
 			}
-			case InstrKind::IK_CMP_LT: {
-				auto cmp = (CmpLTInstr*)inst;
-				tl::expected<Value*, Error> res = get_register_value(cmp->_src1);
-				if (!res) {
-					return tl::make_unexpected(res.error());
-				}
-				tl::expected<Value*, Error> res2 = get_register_value(cmp->_src2);
-				if (!res2) {
-					return tl::make_unexpected(res2.error());
+			case InstrKind::IK_I2I: {
+				auto mov = (I2IInstr*)inst;
+				auto src = read_register<Checked>(mov->_src);
+				if (Checked && !src) {
+					return tl::make_unexpected(missing_register(mov->_src));
 				}
-				_registers.insert_or_assign(
-					cmp->_dst, res.value()->cmp_lt(*res2.value()));
+				write_register(mov->_dst, *src);
 				break;
 			}
 
 			case InstrKind::IK_CBR: {
 				auto cmp = (CbrInstr*)inst;
-				tl::expected<Value*, Error> res = get_register_value(cmp->_src);
-				if (!res) {
-					return tl::make_unexpected(res.error());
-				}
-				auto val = res.value();
-				if (val->_kind != ValKind::VK_INT) {
-					return tl::make_unexpected(
-						Error(ErrorKind::EK_INVALID_INST, "cbr with non integer value"));
-				}
-				
-				if (cmp->_dst._kind != ValKind::VK_LOCATION) {
-					return tl::make_unexpected(
-						Error(ErrorKind::EK_INVALID_INST, "cbr with non location jump"));
+				auto val = read_register<Checked>(cmp->_src);
+				if constexpr (Checked) {
+					if (!val) {
+						return tl::make_unexpected(missing_register(cmp->_src));
+					}
+					if (val->_kind != ValKind::VK_INT) {
+						return tl::make_unexpected(Error(
+							ErrorKind::EK_INVALID_INST, "cbr with non integer value"));
+					}
+					if (cmp->_dst._kind != ValKind::VK_LOCATION) {
+						return tl::make_unexpected(Error(
+							ErrorKind::EK_INVALID_INST, "cbr with non location jump"));
+					}
 				}
 				if (val->as_int()) {
+					cmp->_taken += 1;
+					count_edge(get_block(), cmp->_dst.as_loc());
 					_block_name = cmp->_dst.as_loc();
 					_inst_idx = 0;
+				} else {
+					cmp->_not_taken += 1;
 				}
 				break;
 			}
 			case InstrKind::IK_RET: {
-				_stack.pop_back();
-				if (_stack.size() == 0) {
+				if (!pop_call()) {
 					return ok_result;
 				}
 				break;
 			}
+			case InstrKind::IK_IRET: {
+				auto iret = (IRetInstr*)inst;
+				auto src = read_register<Checked>(iret->_src);
+				if (Checked && !src) {
+					return tl::make_unexpected(missing_register(iret->_src));
+				}
+				auto val = *src;
+				auto call = _call_stack.back()._call;
+				if (!pop_call()) {
+					return ok_result;
+				}
+				if (call->_kind == InstrKind::IK_ICALL) {
+					write_register(call->_dst, val);
+				}
+				break;
+			}
+			case InstrKind::IK_CALL:
+			case InstrKind::IK_ICALL: {
+				auto call = (CallInstr*)inst;
+				if (Checked && !call->_callee) {
+					return tl::make_unexpected(Error(ErrorKind::EK_INVALID_INST,
+						"call to unknown function " + call->_name));
+				}
+				auto pushed = push_call<Checked>(*call->_callee, call);
+				if (!pushed) {
+					return tl::make_unexpected(pushed.error());
+				}
+				break;
+			}
 
 			case InstrKind::IK_IWRITE: {
 				auto write = (IWriteInstr*)inst;
-				tl::expected<Value*, Error> res = get_register_value(write->_src);
-				if (!res) {
-					return tl::make_unexpected(res.error());
+				auto src = read_register<Checked>(write->_src);
+				if (Checked && !src) {
+					return tl::make_unexpected(missing_register(write->_src));
 				}
-				std::cout << *res.value() << "\n";
+				out.write_value(*src);
+				break;
+			}
+			case InstrKind::IK_NOP: {
 				break;
 			}
-			default:
-				for (auto& pair : _registers._reg_map) {
-					auto& [reg, val] = pair;
-					std::cout << reg << " = " << *val << "\n";
+
+			// The arithmetic and compare instructions only differ in `OpInfo::_eval`
+			default: {
+				auto& op = op_info(inst->_kind);
+				if (op._shape == OS_RR_R) {
+					auto bin = (BinaryInstr*)inst;
+					auto src1 = read_register<Checked>(bin->_src1);
+					auto src2 = read_register<Checked>(bin->_src2);
+					if (Checked && (!src1 || !src2)) {
+						return tl::make_unexpected(
+							missing_register(src1 ? bin->_src2 : bin->_src1));
+					}
+					sample(*blk, _inst_idx - 1, *src1, src2);
+					write_register(bin->_dst, (src1->*op._eval)(*src2));
+					break;
+				}
+				if (op._shape == OS_RI_R) {
+					auto bin = (BinaryImmInstr*)inst;
+					auto src1 = read_register<Checked>(bin->_src1);
+					if (Checked && !src1) {
+						return tl::make_unexpected(missing_register(bin->_src1));
+					}
+					sample(*blk, _inst_idx - 1, *src1, nullptr);
+					write_register(bin->_dst, (src1->*op._eval)(bin->_src2));
+					break;
+				}
+
+				out.flush();
+				for (uint32_t r = 0; r < get_func()._num_regs; r++) {
+					if (_regs[r]._kind != ValKind::VK_NULL) {
+						std::cout << Reg{r} << " = " << _regs[r] << "\n";
+					}
 				}
 				std::cout << "INVALID INSTR" << *inst << "\n";
 				return tl::make_unexpected(
 					Error(ErrorKind::EK_INVALID_INST, "invalid instruction"));
+			}
 		}
-
-		auto& blk = get_block();
-		while (_inst_idx == blk._instrs.size()) {
-			_inst_idx = 0;
-			_block_name = blk._fallthrough;
-			blk = get_block();
-		}
-
-		if (_inst_idx == 0) {
-			blk._exec_count += 1;
-		}
-
-		if (_inst_idx == 0 && blk._exec_count > 1) {
-			auto j = Jit(blk._name, blk._instrs);
-			j.compile();
-			auto res = j.execute(_registers._reg_flat.data(), nullptr);
-			
-			std::cout << "jit code value: " << res << "\n";
-
-			_block_name = blk._fallthrough;
-		}
-		inst = get_inst();
 	}
 
 	return ok_result;
@@ -1,12 +1,19 @@
 #pragma once
 
 #include <map>
+#include <array>
+#include <deque>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <optional>
+#include <functional>
+#include <string_view>
 
 #include "expected.hpp"
 #include "instrs.hpp"
+#include "arena.hpp"
+#include "output.hpp"
 
 namespace jit {
 #define TRY_OR_BAIL(expr)                                                                \
@@ -29,13 +36,16 @@ enum ErrorKind {
 	EK_INVALID_REG,
 	EK_INVALID_INST,
 	EK_OOM,
+	EK_INVALID_ARG,
+	EK_IO,
 
 	EK_SIZE
 };
 
 struct Error {
 	static constexpr const char* ERR[ErrorKind::EK_SIZE] = {
-		"EK_CAST", "EK_INVALID_REG", "EK_INVALID_INST", "EK_OOM"
+		"EK_CAST", "EK_INVALID_REG", "EK_INVALID_INST", "EK_OOM", "EK_INVALID_ARG",
+		"EK_IO"
 	};
 	ErrorKind _kind;
 	std::string _msg;
@@ -45,31 +55,122 @@ struct Error {
 	friend std::ostream& operator<<(std::ostream& os, const Error& instr);
 };
 
-struct Registers {
-	std::map<Reg, Value*> _reg_map;
-	std::vector<Value> _reg_flat;
 
-	std::pair<std::map<Reg, Value*>::iterator, bool> insert_or_assign(Reg r, Value v) {
-		if (_reg_flat.size() <= r._reg) {
-			_reg_flat.resize(r._reg + 1);
-			for (auto& p : _reg_map) {
-				auto& [k, junk_val] = p;
-				*junk_val = _reg_flat[k._reg];
+struct BlockProfile;
+struct Profiler;
+struct Sampler;
+
+// Where the interpreter picks up after jitted code returns.
+struct JitExit {
+	std::string _block;
+	uint32_t _inst_idx;
+	// A value the code was specialized to changed, the block has to be compiled again
+	// without assuming constants
+	bool _deopt = false;
+
+	bool operator==(const JitExit& b) const = default;
+};
+
+struct CompiledBlock {
+	uint8_t* _entry;
+	// Jitted code returns `i` to resume at `_exits[i]`
+	std::vector<JitExit> _exits;
+	// Registers the code reads and writes, the checked loop looks at their kinds before
+	// entering it
+	std::vector<Reg> _reads;
+	std::vector<Reg> _stores;
+};
+
+// Instructions whose register operands the interpreter samples for specialization.
+enum ProfilePoint {
+	PP_NONE = 0,
+	PP_CMP = 1 << 0,
+	PP_MULT = 1 << 1,
+	PP_ADD = 1 << 2,
+
+	PP_DEFAULT = PP_CMP | PP_MULT,
+	PP_ALL = PP_CMP | PP_MULT | PP_ADD
+};
+
+// Parse a comma separated list of `cmp`, `mult`, `add`, `all` or `none`.
+tl::expected<uint32_t, Error> parse_profile_points(std::string_view names);
+
+// A block is interpreted this many times before it is compiled when it has registers
+// that still look constant, so the profile has something to go on.
+static constexpr uint64_t VALUE_PROFILE_MIN_SAMPLES = 8;
+// Percentage of samples that have to match for a register to count as constant.
+static constexpr uint64_t VALUE_PROFILE_CONST_PCT = 95;
+
+// The values one register held at the sampled points of a block, only the first integer
+// seen is tracked. Runs on other threads sample the same slots, the first integer claims
+// `_value` and publishes it once written, so every hit is counted against that one value.
+struct ValueProfile {
+	enum State : uint8_t { VP_EMPTY, VP_CLAIMED, VP_SET };
+
+	Relaxed<uint8_t> _state = VP_EMPTY;
+	Relaxed<int64_t> _value = 0;
+	Relaxed<uint64_t> _samples = 0;
+	// Samples that matched `_value`
+	Relaxed<uint64_t> _hits = 0;
+
+	void sample(const Value& val) {
+		_samples += 1;
+		if (val._kind != ValKind::VK_INT) {
+			return;
+		}
+		auto state = _state.load(std::memory_order_acquire);
+		if (state == VP_EMPTY) {
+			uint8_t expected = VP_EMPTY;
+			if (_state._val.compare_exchange_strong(
+					expected, VP_CLAIMED, std::memory_order_relaxed)) {
+				_value = val.as_int();
+				_state.store(VP_SET, std::memory_order_release);
+				_hits += 1;
+				return;
 			}
+			state = expected;
+		}
+		// Samples racing the claim only count as misses
+		if (state == VP_SET) {
+			_hits += val.as_int() == _value ? 1 : 0;
 		}
-		_reg_flat[r._reg] = v;
-		return _reg_map.insert_or_assign(r, &_reg_flat[r._reg]);
 	}
-};
 
-struct CallInfo {};
+	bool near_constant() const {
+		return _state.load(std::memory_order_acquire) == VP_SET &&
+			   _samples >= VALUE_PROFILE_MIN_SAMPLES &&
+			   _hits * 100 >= _samples * VALUE_PROFILE_CONST_PCT;
+	}
+};
 
+// The profile of a block is shared by every context running the program. Its maps get
+// an entry for every successor and sampled register up front, see
+// `Program::add_profile_slots`, so running only ever updates counters in place.
 struct Block {
 	std::string _name;
 	std::string _fallthrough;
-	uint32_t _exec_count;
+	Relaxed<uint64_t> _exec_count;
 	std::vector<Instruction*> _instrs;
 
+	// How many times control left this block for each successor
+	std::map<std::string, Relaxed<uint64_t>, std::less<>> _edge_counts;
+	// Set by block layout when this block rarely runs compared to the rest of the
+	// function
+	bool _cold = false;
+	// Register values seen at the `ProfilePoint`s of this block
+	std::map<Reg, ValueProfile> _value_profile;
+	// The `_value_profile` entries of the operands each instruction samples, indexed
+	// like `_instrs` and empty when nothing in the block is sampled
+	std::vector<std::array<ValueProfile*, 2>> _value_slots;
+	// Cleared when a guard of specialized code failed, later compiles ignore the profile
+	Relaxed<bool> _specialize = true;
+
+	Relaxed<bool> _jit_failed = false;
+	// Published with a release store once the code is written, owned by the `Program`
+	Relaxed<const CompiledBlock*> _compiled = nullptr;
+	// Set when the program has a `Profiler`, which owns it
+	BlockProfile* _profile = nullptr;
+
 	Block(std::string n) : _name(n), _exec_count(0) {}
 };
 
@@ -78,12 +179,45 @@ struct Function {
 	uint32_t _size;
 	std::vector<Reg> _args;
 	std::map<std::string, Block> _blocks;
+	// Value stack slots a call of this function takes, one more than its highest register
+	uint32_t _num_regs = 0;
+	// Order jitted blocks are placed in, hottest chains first and cold blocks last
+	std::vector<std::string> _layout;
 
 	Function(std::string n, uint32_t s, std::vector<Reg> a)
 		: _name(n), _size(s), _args(a) {}
 };
 
+// Taken/not taken counts of one `cbr`.
+struct BranchProfile {
+	std::string _func;
+	std::string _block;
+	uint32_t _inst_idx;
+	const CbrInstr* _cbr;
+	uint64_t _taken;
+	uint64_t _not_taken;
+};
+
+// One active call. Its registers are the `_func->_num_regs` slots of the value stack
+// starting at `_base`, right above those of its caller.
+struct CallInfo {
+	Function* _func;
+	size_t _base;
+	// The `call` or `icall` that made this call, null for `main`
+	const CallInstr* _call;
+	// Where the caller continues once this call returns
+	Block* _ret_block;
+	uint32_t _ret_idx;
+};
+
+// Value stack slots allocated up front, the stack doubles when a call does not fit.
+static constexpr size_t VALUE_STACK_SLOTS = 16 * 1024;
+// Calls nested deeper than this fail instead of growing the stack without bound.
+static constexpr size_t MAX_CALL_DEPTH = 1024 * 1024;
+
 struct Parser {
+	// Owns every instruction parsed, hand it to the `Program` with the functions
+	InstrArena _arena;
 	bool _in_data_section = false;
 	std::map<std::string, Value> _globals;
 	std::map<std::string, Function> _funcs;
@@ -101,42 +235,185 @@ struct Parser {
 	void finalize_prog();
 };
 
-struct Interpreter {
-	std::map<std::string, Value> _globals;
-	Registers _registers;
-	std::vector<std::vector<Value*>> _stack;
+// Copy the instructions of `funcs` into a fresh arena in function and block order, so
+// each block is one contiguous run, and free the old arena along with anything passes
+// dropped.
+void pack_instrs(std::map<std::string, Function>& funcs, InstrArena& arena);
 
+// A loaded program, shared by every `ExecutionContext` running it. Once built only the
+// profile counters change, through `Relaxed`, and the compiled code, under `_jit_lock`.
+struct Program {
+	std::map<std::string, Value> _globals;
 	std::map<std::string, Function> _funcs;
+	// Backs every `Instruction*` in `_funcs`
+	InstrArena _instr_arena;
+
+	// How many copies of a counted loop body the JIT emits per trip
+	uint32_t _unroll_factor;
+	// Which `ProfilePoint`s sample register values
+	uint32_t _profile_points;
+	// Set by `link_calls` when a function uses more than `MAX_REGS` registers, such a
+	// program is never run
+	std::optional<Error> _link_error;
+	// Set by `verify`
+	bool _verified = false;
+	// Compile blocks that run more than once, off only runs the interpreter
+	bool _jit = true;
+	// Set by `Profiler::attach`, runs take the profiling loop and compiles count blocks
+	Profiler* _profiler = nullptr;
+	// Set by `Sampler::attach`, runs say which block they are in as they enter it
+	Sampler* _sampler = nullptr;
+
+	// Held while compiling, which also lays out blocks and so writes to `_funcs`
+	std::mutex _jit_lock;
+	CodeArena _arena;
+	// Every block ever compiled, code a guard threw away may still be running elsewhere
+	std::deque<CompiledBlock> _compiled;
+
+	Program(std::map<std::string, Function> funcs, std::map<std::string, Value> globals,
+		InstrArena instrs, uint32_t unroll_factor = 4,
+		uint32_t profile_points = PP_DEFAULT)
+		: _globals(globals), _funcs(funcs), _instr_arena(std::move(instrs)),
+		  _unroll_factor(unroll_factor), _profile_points(profile_points) {
+		link_calls();
+		add_profile_slots();
+	}
+
+	// Size the frame of every function and point every call at the function it calls.
+	void link_calls();
+	// Add every successor and sampled register to the block profiles before running.
+	void add_profile_slots();
+
+	// Every `cbr` in the program and which way it went so far.
+	std::vector<BranchProfile> branch_profile() const;
+
+	// The native code of `blk`, compiling `func` if needed, or null if it has none.
+	const CompiledBlock* tier_up(Function& func, Block& blk);
+	void compile_function(Function& func);
+
+	// Check the program with `verify_program`, runs skip the register and operand checks
+	// once this passed.
+	tl::expected<void, Error> verify();
+
+	// Print every function, with `lines` the line each instruction is printed on.
+	void dump(std::ostream& os,
+		std::map<const Instruction*, uint32_t>* lines = nullptr) const;
+};
+
+enum RunStatus {
+	// `main` returned
+	RS_DONE,
+	// The fuel ran out, `run` again with more to carry on from the next block
+	RS_OUT_OF_FUEL,
+	// The output is holding text, `run` again once it went out
+	RS_OUTPUT_HELD,
+};
+
+// What a run is doing in a block, for a `Sampler`
+enum SampleTier : uintptr_t {
+	ST_IDLE,
+	ST_INTERP,
+	ST_NATIVE,
+	// Compiling, or waiting on another thread compiling
+	ST_COMPILE,
+	ST_COUNT,
+};
+
+// One run of a `Program`. A context only belongs to the thread running it, so any number
+// of them can run the same program at once.
+struct ExecutionContext {
+	Program& _prog;
+	// Lua style value stack, every active call owns a contiguous slice of it
+	std::vector<Value> _values;
 	std::vector<CallInfo> _call_stack;
+	// The registers of the running call, they move whenever the value stack grows
+	Value* _regs = nullptr;
 
 	std::string _func_name;
 	std::string _block_name;
 	uint32_t _inst_idx;
 
-	Interpreter(
-		std::map<std::string, Function> funcs, std::map<std::string, Value> globals)
-		: _globals(globals), _funcs(funcs), _func_name("main"), _block_name("__start__"),
-		  _inst_idx(0) {
-		_stack.push_back(std::vector<Value*>());
-	}
+	// Where `iwrite` goes, jitted code gets this too
+	OutputSink* _out;
+	// Instructions left to run. Each block entered is paid for in full, so the last one a
+	// run gets to may overdraw. Jitted code pays for every block it loops through too.
+	int64_t _fuel = INT64_MAX;
+
+	// Counted as the run goes, added to the `thread_stats` when `run` returns
+	struct RunCounts {
+		uint64_t _blocks = 0;
+		uint64_t _interp_instrs = 0;
+		uint64_t _native_instrs = 0;
+		uint64_t _native_entries = 0;
+		uint64_t _deopts = 0;
+		uint64_t _stack_growths = 0;
+	};
+	RunCounts _counts;
+	// While tracing, when the interpreter last took over from native code
+	uint64_t _interp_since = 0;
+	// The block the run is in with its `SampleTier` in the low bits, only kept when the
+	// program has a sampler
+	Relaxed<uintptr_t> _sample_at = 0;
+
+	ExecutionContext(Program& prog, OutputSink* out = &stdout_sink())
+		: _prog(prog), _func_name("main"), _block_name("__start__"), _inst_idx(0),
+		  _out(out) {}
 
 	// TODO: tl::expected<Function&, Error> for all these
-	Function& get_func() { return _funcs.find(_func_name)->second; }
+	Function& get_func() { return _prog._funcs.find(_func_name)->second; }
 
 	Block& get_block() { return get_func()._blocks.find(_block_name)->second; }
 
 	Instruction* get_inst() { return get_block()._instrs[_inst_idx]; }
 
-	tl::expected<Value*, Error> get_register_value(const Reg& reg) {
-		auto x = _registers._reg_map.find(reg);
-		if (x == _registers._reg_map.end()) {
-			return tl::make_unexpected(
-				Error(ErrorKind::EK_INVALID_REG, "missing register"));
+	// The slot of `reg` or null if it was never written. The verifier proved a register
+	// is written before every read, so unchecked reads skip the test.
+	template <bool Checked> Value* read_register(const Reg& reg) {
+		auto slot = &_regs[reg._reg];
+		if constexpr (Checked) {
+			return slot->_kind == ValKind::VK_NULL ? nullptr : slot;
 		}
-		return x->second;
+		return slot;
 	}
 
+	void write_register(const Reg& reg, const Value& val) { _regs[reg._reg] = val; }
+
+	// Carve the frame of a call to `func` out of the value stack above the running call.
+	template <bool Checked>
+	tl::expected<void, Error> push_call(Function& func, const CallInstr* call);
+	// Drop the running call and continue in its caller, false when `main` returned.
+	bool pop_call();
+	// Whether `code` can run on the registers of an unverified program. Native code can
+	// not report a missing register, so a read of an unwritten register it does not write
+	// itself is left to the interpreter.
+	bool native_ready(const CompiledBlock& code);
 
-	tl::expected<void, Error> run();
+	// Sample the operands of the instruction at `idx` in `blk`. Once the block is
+	// compiled or has deopted the profile is no longer read, so stop paying for it.
+	void sample(Block& blk, size_t idx, const Value& src1, const Value* src2) {
+		if (blk._value_slots.empty() || !blk._specialize ||
+			blk._compiled.load(std::memory_order_relaxed)) {
+			return;
+		}
+		auto [slot1, slot2] = blk._value_slots[idx];
+		if (slot1) {
+			slot1->sample(src1);
+		}
+		if (slot2 && src2) {
+			slot2->sample(*src2);
+		}
+	}
+
+	// Run `main` until it returns or stops early and flush the output. A suspended
+	// run continues where it stopped, one that is done starts over.
+	tl::expected<RunStatus, Error> run();
+	// The interpreter loop, `Checked` reports what a verified program can not do and
+	// `Profiled` updates the profile of every block and instruction
+	template <bool Checked, bool Profiled> tl::expected<RunStatus, Error> run_loop();
+	void sample_at(const Block* blk, SampleTier tier) {
+		_sample_at = (uintptr_t)blk | tier;
+	}
+	// Record a call into the native code of `blk` from `start` that left at `exit`.
+	void trace_native(const Block& blk, uint64_t start, const JitExit& exit);
 };
 }
\ No newline at end of file
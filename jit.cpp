@@ -4,16 +4,35 @@
 #include <optional>
 #include <iostream>
 #include <utility>
+#include <tuple>
+#include <set>
+#include <cstring>
+#include <cstddef>
 
 #include "expected.hpp"
 #include "instrs.hpp"
 #include "jit.hpp"
+#include "output.hpp"
+#include "perfmap.hpp"
+#include "gdbjit.hpp"
+#include "profiler.hpp"
 
 namespace jit {
 
+// Shadow space for calls out of jitted code, then the slots rcx and rdx are spilled to
+// around them. After the return address and the two pushes in the prologue this leaves
+// rsp 16 byte aligned, and rsp never moves between the prologue and the exit stub.
+static constexpr uint32_t JIT_FRAME_SIZE = 56;
+static constexpr uint8_t JIT_SPILL_RCX = 32;
+static constexpr uint8_t JIT_SPILL_RDX = 40;
+
 static constexpr uint8_t encode(const MCReg& r) { return std::to_underlying(r) & 0x7; }
 
-void iwrite_call(int64_t x) { std::cout << "yo: " << x << "\n"; }
+// Jitted code only calls out once the queue in `OutputSink` is full.
+void drain_output(OutputSink* sink) { sink->drain(); }
+
+static_assert(offsetof(OutputSink, _num_pending) == 0);
+static_assert(offsetof(OutputSink, _pending) == 8);
 
 // This is a register to register move.
 //
@@ -29,6 +48,7 @@ void Jit::write_mov(const MCReg& src, const MCReg& dst) {
 //
 // `mov reg, [reg+offset]`
 void Jit::write_load_jsval(const Reg& from, const MCReg& to) {
+	_reads.insert(from);
 	write_byte(0x48
 			   // This is dst
 			   | (std::to_underlying(to) >= 8 ? 1 << 2 : 0)
@@ -46,7 +66,8 @@ void Jit::write_load_jsval(const Reg& from, const MCReg& to) {
 //
 // `mov reg, 0x1234`
 void Jit::write_load_imm(uint64_t from, const MCReg& to) {
-	write_byte(0x48 | (std::to_underlying(to) >= 8 ? 1 << 2 : 0));
+	// The register is in the opcode so its high bit goes in REX.B
+	write_byte(0x48 | (std::to_underlying(to) >= 8 ? 1 << 0 : 0));
 	write_byte(0xb8 | encode(to));
 	write_qword(from);
 }
@@ -61,6 +82,15 @@ void Jit::write_store_jsval(const MCReg& from, const Reg& to) {
 	write_byte(0x89);
 	write_byte(0x80 | (encode(from) << 3) | encode(MCReg::RCX));
 	write_dword(to._reg * sizeof(Value) + 8);
+	_stores.insert(to);
+	if (_store_kinds) {
+		// mov dword [rcx + to], VK_INT
+		static_assert(sizeof(ValKind) == 4);
+		write_byte(0xc7);
+		write_byte(0x81);
+		write_dword(to._reg * sizeof(Value));
+		write_dword(ValKind::VK_INT);
+	}
 }
 
 // Add src and dst collecting into dst.
@@ -95,163 +125,888 @@ void Jit::write_subimm(uint32_t src, const MCReg& dst) {
 
 // Mult src and dst collecting into dst.
 //
-// mult dst, src
+// imul dst, src
 void Jit::write_mult(const MCReg& src, const MCReg& dst) {
-	write_byte(0x48 | (std::to_underlying(src) >= 8 ? 1 << 2 : 0) |
-			   (std::to_underlying(dst) >= 8 ? 1 << 0 : 0));
+	// Unlike `add` the destination of `imul` goes in the reg field
+	write_byte(0x48 | (std::to_underlying(dst) >= 8 ? 1 << 2 : 0) |
+			   (std::to_underlying(src) >= 8 ? 1 << 0 : 0));
 	write_byte(0x0f);
 	write_byte(0xaf);
-	write_byte(0xc0 | (encode(src) << 3) | encode(dst));
+	write_byte(0xc0 | (encode(dst) << 3) | encode(src));
+}
+
+// Mult imm and dst collecting into dst.
+//
+// imul dst, dst, imm
+void Jit::write_multimm(uint32_t src, const MCReg& dst) {
+	write_byte(0x48 | (std::to_underlying(dst) >= 8 ? (1 << 2) | (1 << 0) : 0));
+	write_byte(0x69);
+	write_byte(0xc0 | (encode(dst) << 3) | encode(dst));
+	write_dword(src);
 }
 
-// Compare src and dst collecting into dst.
+// Compare lhs and rhs setting the flags as if `lhs - rhs`.
 //
-// cmp dst, src
-void Jit::write_cmplt(const MCReg& lhs, const MCReg& rhs) {
-	// cmp
-	write_byte(0x48 | (std::to_underlying(lhs) >= 8 ? 1 << 2 : 0)
-					| (std::to_underlying(rhs) >= 8 ? 1 << 0 : 0));
+// cmp lhs, rhs
+void Jit::write_cmp(const MCReg& lhs, const MCReg& rhs) {
+	write_byte(0x48 | (std::to_underlying(rhs) >= 8 ? 1 << 2 : 0)
+					| (std::to_underlying(lhs) >= 8 ? 1 << 0 : 0));
 	write_byte(0x39);
-	write_byte(0xc0 | (encode(lhs) << 3) | encode(rhs));
+	write_byte(0xc0 | (encode(rhs) << 3) | encode(lhs));
+}
 
-	// setl
+// Compare lhs against a sign extended immediate.
+//
+// cmp lhs, imm
+void Jit::write_cmpimm(uint32_t imm, const MCReg& lhs) {
+	write_byte(0x48 | (std::to_underlying(lhs) >= 8 ? 1 << 0 : 0));
+	write_byte(0x81);
+	write_byte(0xf8 | encode(lhs));
+	write_dword(imm);
+}
 
-	//write_byte(0x48 | (std::to_underlying(rhs) >= 8 ? 1 << 0 : 0));
-	//write_byte(0x0f);
-	//write_byte(0xaf);
-	//write_byte(0xc0 | encode(rhs));
+// Set `to` to 1 if the condition holds and 0 otherwise, flags are left untouched.
+//
+// setcc to8
+// movzx to, to8
+void Jit::write_setcc(MCCond cond, const MCReg& to) {
+	write_byte(0x40 | (std::to_underlying(to) >= 8 ? 1 << 0 : 0));
+	write_byte(0x0f);
+	write_byte(0x90 | std::to_underlying(cond));
+	write_byte(0xc0 | encode(to));
+
+	write_byte(0x48 | (std::to_underlying(to) >= 8 ? (1 << 2) | (1 << 0) : 0));
+	write_byte(0x0f);
+	write_byte(0xb6);
+	write_byte(0xc0 | (encode(to) << 3) | encode(to));
 }
 
-void Jit::write_jmp(const InstrKind& kind) {
+// Jump to `target` (an offset into the code page) when `cond` holds.
+//
+// jcc rel32
+void Jit::write_jcc(MCCond cond, uint32_t target) {
 	write_byte(0x0f);
-	uint8_t jmp_byte = 0;
-	if (kind == InstrKind::IK_CMP_LT) {
-		jmp_byte = 0x8f;
-	} else if (kind == InstrKind::IK_CMP_LE) {
-		jmp_byte = 0x8e;
-	} else if (kind == InstrKind::IK_CMP_GT) {
-		jmp_byte = 0x8f;
-	} else if (kind == InstrKind::IK_CMP_GE) {
-		jmp_byte = 0x8d;
+	write_byte(0x80 | std::to_underlying(cond));
+	write_dword(target - (_code_idx + 4));
+}
+
+// A forward `jcc` that is fixed up with `patch_rel32` once the target is known.
+uint8_t* Jit::write_jcc_fwd(MCCond cond) {
+	write_byte(0x0f);
+	write_byte(0x80 | std::to_underlying(cond));
+	uint8_t* at = _code + _code_idx;
+	write_dword(0);
+	return at;
+}
+
+// jmp rel32
+void Jit::write_jmp(uint32_t target) {
+	write_byte(0xe9);
+	write_dword(target - (_code_idx + 4));
+}
+
+uint8_t* Jit::write_jmp_fwd() {
+	write_byte(0xe9);
+	uint8_t* at = _code + _code_idx;
+	write_dword(0);
+	return at;
+}
+
+// Both pointers are absolute so this also links hot code to cold code.
+void Jit::patch_rel32(uint8_t* at, uint8_t* target) {
+	if (_overflow) {
+		return;
 	}
-	write_byte(jmp_byte);
-	write_dword(-((int64_t)_code_idx + 4 - 11));
+	int32_t rel = (int32_t)(target - (at + 4));
+	memcpy(at, &rel, sizeof(rel));
 }
 
-tl::expected<void, Error> Jit::compile() {
-	if (!_code) {
-		if (!set_exec_mem().has_value()) {
-			std::cout << "Failed to set page\n";
+uint32_t Jit::exit_id(const JitExit& exit) {
+	auto it = std::find(_exits.begin(), _exits.end(), exit);
+	if (it == _exits.end()) {
+		_exits.push_back(exit);
+		it = _exits.end() - 1;
+	}
+	return (uint32_t)(it - _exits.begin());
+}
+
+// Leave the jitted code telling the interpreter which block to resume at.
+void Jit::emit_exit(uint32_t id) {
+	// mov eax, id
+	write_byte(0xb8 | encode(MCReg::RAX));
+	write_dword(id);
+	// Undo the sub rsp to set up stack
+	write_addimm(JIT_FRAME_SIZE, MCReg::RSP);
+	// Pop rdi
+	write_byte(0x58 | encode(MCReg::RDI));
+	// pop base pointer
+	write_byte(0x58 | encode(MCReg::RBP));
+	// ret
+	write_byte(0xc3);
+}
+
+// Exits taken by the unlikely side of a branch go after the block, in the cold part of
+// the arena when the block itself is hot.
+void Jit::emit_stubs() {
+	bool out_of_line = _cold != nullptr;
+	if (out_of_line) {
+		swap_streams();
+	}
+	for (auto& [at, id] : _stubs) {
+		patch_rel32(at, _code + _code_idx);
+		emit_exit(id);
+	}
+	for (auto& [at, id, cost] : _fuel_stubs) {
+		patch_rel32(at, _code + _code_idx);
+		// add qword [rdi], cost
+		write_byte(0x48);
+		write_byte(0x81);
+		write_byte(0x07);
+		write_dword(cost);
+		emit_exit(id);
+	}
+	if (out_of_line) {
+		swap_streams();
+	}
+}
+
+// Pay for running `blk`, the same as entering it in the interpreter costs. When the fuel
+// runs out the code leaves for the start of `blk` without paying, the interpreter runs
+// that block on what is left and stops after it.
+void Jit::emit_fuel_check(const Block& blk) {
+	auto cost = (uint32_t)blk._instrs.size();
+	// sub qword [rdi], cost
+	write_byte(0x48);
+	write_byte(0x81);
+	write_byte(0x2f);
+	write_dword(cost);
+	_fuel_stubs.emplace_back(
+		write_jcc_fwd(MCCond::S), exit_id(JitExit{blk._name, 0}), cost);
+	emit_count(blk, 1);
+	// The flags are gone
+	_last_cmp.reset();
+}
+
+// Add `runs` to the native runs in the profile of `blk`, if it has one.
+void Jit::emit_count(const Block& blk, uint32_t runs) {
+	if (!blk._profile) {
+		return;
+	}
+	static_assert(sizeof(blk._profile->_native_runs) == sizeof(uint64_t));
+	write_load_imm((uint64_t)&blk._profile->_native_runs, MCReg::RAX);
+	// add qword [rax], runs
+	write_byte(0x48);
+	write_byte(0x81);
+	write_byte(0x00);
+	write_dword(runs);
+}
+
+static constexpr MCCond cond_for(InstrKind kind) {
+	switch (kind) {
+		case InstrKind::IK_CMP_LT: return MCCond::L;
+		case InstrKind::IK_CMP_LE: return MCCond::LE;
+		case InstrKind::IK_CMP_GT: return MCCond::G;
+		case InstrKind::IK_CMP_GE: return MCCond::GE;
+		default: return MCCond::NE;
+	}
+}
+
+// The opposite condition only differs in the lowest bit.
+static constexpr MCCond negate(MCCond cond) {
+	return (MCCond)(std::to_underlying(cond) ^ 1);
+}
+
+// All four compares have the same shape, this pulls out `src1`, `src2` and `dst`.
+static std::optional<std::tuple<Reg, Reg, Reg>> cmp_operands(Instruction* inst) {
+	switch (inst->_kind) {
+		case InstrKind::IK_CMP_LT:
+		case InstrKind::IK_CMP_LE:
+		case InstrKind::IK_CMP_GT:
+		case InstrKind::IK_CMP_GE: {
+			auto cmp = (BinaryInstr*)inst;
+			return std::tuple{cmp->_src1, cmp->_src2, cmp->_dst};
 		}
+		default: return std::nullopt;
 	}
+}
 
-	// Push base pointer
-	write_byte(0x50 | encode(MCReg::RBP));
-	// Do preamble stuff
-	//write_mov(MCReg::RBP, MCReg::RSP);
-	// 
-	// push rdi
-	write_byte(0x50 | encode(MCReg::RDI));
-	write_subimm(32, MCReg::RSP);
+int64_t CountedLoop::trip_count(int64_t iv, int64_t bound) const {
+	// Distance left to travel towards `bound` measured in steps direction
+	int64_t dist = _step > 0 ? bound - iv : iv - bound;
+	int64_t step = _step > 0 ? _step : -_step;
+	int64_t trips = 0;
+	if (_cmp == InstrKind::IK_CMP_LT || _cmp == InstrKind::IK_CMP_GT) {
+		trips = dist > 0 ? (dist + step - 1) / step : 0;
+	} else {
+		trips = dist >= 0 ? dist / step + 1 : 0;
+	}
+	// The body runs before the first check so a loop always makes one trip
+	return std::max<int64_t>(trips, 1);
+}
 
-	InstrKind jump_kind;
-	for (auto& inst : _instrs) {
-		switch (inst->_kind) {
-			case InstrKind::IK_I2I: {
-				auto mov = (I2IInstr*)inst;
-				write_load_jsval(mov->_src, MCReg::R8);
-				write_store_jsval(MCReg::R8, mov->_dst);
-				break;
+std::optional<CountedLoop> find_counted_loop(
+	const std::string& name, const std::vector<Instruction*>& instrs) {
+	if (instrs.size() < 3) {
+		return std::nullopt;
+	}
+	size_t cbr_idx = instrs.size() - 1;
+	size_t cmp_idx = instrs.size() - 2;
+
+	auto cbr = (CbrInstr*)instrs[cbr_idx];
+	if (cbr->_kind != InstrKind::IK_CBR || cbr->_dst._kind != ValKind::VK_LOCATION ||
+		cbr->_dst.as_loc() != name) {
+		return std::nullopt;
+	}
+	auto operands = cmp_operands(instrs[cmp_idx]);
+	if (!operands.has_value()) {
+		return std::nullopt;
+	}
+	auto [checked, bound, cond] = *operands;
+	if (!(cond == cbr->_src) || checked == bound) {
+		return std::nullopt;
+	}
+
+	// Where each register is written and how often it is read, registers written more
+	// than once are never part of the loop control
+	std::map<Reg, size_t> writes;
+	std::set<Reg> rewritten;
+	std::map<Reg, size_t> reads;
+	std::vector<Reg> used;
+	for (size_t i = 0; i < instrs.size(); i++) {
+		// Leaving in the middle of an unrolled group would skip the folded update
+		if (i < cmp_idx && instrs[i]->_kind == InstrKind::IK_CBR) {
+			return std::nullopt;
+		}
+		used.clear();
+		instrs[i]->uses(used);
+		for (auto& r : used) {
+			reads[r] += 1;
+		}
+		auto def = instrs[i]->def();
+		if (def.has_value() && i < cmp_idx) {
+			if (writes.contains(*def)) {
+				rewritten.insert(*def);
 			}
+			writes[*def] = i;
+		}
+	}
+	auto single_write = [&](const Reg& r) -> std::optional<size_t> {
+		if (rewritten.contains(r) || !writes.contains(r)) {
+			return std::nullopt;
+		}
+		return writes[r];
+	};
+	if (writes.contains(bound) || writes.contains(cond) || reads[cond] != 1) {
+		return std::nullopt;
+	}
+
+	// The compare either checks the induction variable itself or the stepped
+	// temporary that is moved back into it
+	auto write = single_write(checked);
+	if (!write.has_value()) {
+		return std::nullopt;
+	}
+	auto iv = checked;
+	auto tmp = checked;
+	size_t step_idx = *write;
+	size_t mov_idx = *write;
+	if (instrs[*write]->_kind == InstrKind::IK_I2I) {
+		// addI %iv, step => %tmp; i2i %tmp => %iv; cmp %iv, %bound
+		tmp = ((I2IInstr*)instrs[*write])->_src;
+		auto step_write = single_write(tmp);
+		if (!step_write.has_value() || *step_write > *write || reads[tmp] != 1) {
+			return std::nullopt;
+		}
+		step_idx = *step_write;
+	} else if (instrs[*write]->_kind == InstrKind::IK_ADDIMM &&
+			   !(((AddImmInstr*)instrs[*write])->_src1 == checked)) {
+		// addI %iv, step => %tmp; i2i %tmp => %iv; cmp %tmp, %bound
+		iv = ((AddImmInstr*)instrs[*write])->_src1;
+		auto mov_write = single_write(iv);
+		if (!mov_write.has_value() || *mov_write < *write ||
+			instrs[*mov_write]->_kind != InstrKind::IK_I2I ||
+			!(((I2IInstr*)instrs[*mov_write])->_src == checked) || reads[checked] != 2) {
+			return std::nullopt;
+		}
+		mov_idx = *mov_write;
+	}
+	if (iv == bound) {
+		return std::nullopt;
+	}
+
+	auto step = (AddImmInstr*)instrs[step_idx];
+	if (step->_kind != InstrKind::IK_ADDIMM || !(step->_src1 == iv) ||
+		step->_src2._kind != ValKind::VK_INT) {
+		return std::nullopt;
+	}
+	auto by = step->_src2.as_int();
+	bool counts_up = cond_for(instrs[cmp_idx]->_kind) == MCCond::L ||
+					 cond_for(instrs[cmp_idx]->_kind) == MCCond::LE;
+	if (by == 0 || (by > 0) != counts_up ||
+		std::abs(by) > (int64_t)(INT32_MAX / MAX_UNROLL)) {
+		return std::nullopt;
+	}
+
+	auto loop = CountedLoop(iv, bound, cond, by, instrs[cmp_idx]->_kind);
+	loop._iv_tmp = tmp;
+	loop._step_idx = step_idx;
+	loop._mov_idx = mov_idx;
+	loop._cmp_idx = cmp_idx;
+	loop._cbr_idx = cbr_idx;
+	return loop;
+}
+
+std::optional<int64_t> Jit::const_of(const Reg& reg) const {
+	auto it = _consts.find(reg);
+	if (it == _consts.end()) {
+		return std::nullopt;
+	}
+	return it->second;
+}
+
+bool Jit::writes_const(const Block& blk) const {
+	for (auto* inst : blk._instrs) {
+		auto def = inst->def();
+		if (def.has_value() && _consts.contains(*def)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Assume the registers the profile saw as constant really are, as long as the block never
+// writes them itself. Checking them once on entry then covers every trip around a loop.
+void Jit::specialize() {
+	if (!_blk._specialize) {
+		return;
+	}
+	for (auto& [reg, prof] : _blk._value_profile) {
+		if (prof.near_constant() && fits_imm32(prof._value)) {
+			_consts[reg] = prof._value;
+		}
+	}
+	for (auto* inst : _instrs) {
+		auto def = inst->def();
+		if (def.has_value()) {
+			_consts.erase(*def);
+		}
+	}
+}
 
-			case InstrKind::IK_MULT: {
-				auto mult = (MultInstr*)inst;
-				write_load_jsval(mult->_src1, MCReg::R8);
-				write_load_jsval(mult->_src2, MCReg::RAX);
+// Leave to the interpreter when a register no longer holds the value the code was
+// specialized to.
+void Jit::emit_guards() {
+	for (auto& [reg, val] : _consts) {
+		write_load_jsval(reg, MCReg::RAX);
+		write_cmpimm((uint32_t)val, MCReg::RAX);
+		_stubs.emplace_back(
+			write_jcc_fwd(MCCond::NE), exit_id(JitExit{_blk_name, 0, true}));
+	}
+}
+
+// Load an ILOC register, adding in the induction step folded so far when unrolling.
+void Jit::emit_load(const Reg& from, const MCReg& to) {
+	auto val = const_of(from);
+	if (val.has_value()) {
+		write_load_imm((uint64_t)*val, to);
+		return;
+	}
+	write_load_jsval(from, to);
+	if (_fold_iv.has_value() && *_fold_iv == from && _fold_off != 0) {
+		write_addimm((uint32_t)_fold_off, to);
+	}
+}
+
+tl::expected<void, Error> Jit::emit_instr(Instruction* inst, uint32_t loop_head) {
+	if (_mark_lines) {
+		_lines.emplace_back(_code_idx, inst);
+	}
+	auto last_cmp = _last_cmp;
+	_last_cmp.reset();
+	switch (inst->_kind) {
+		case InstrKind::IK_LOADIMM: {
+			auto load = (LoadImmInstr*)inst;
+			write_load_imm(load->_src.to_bytes(), MCReg::RAX);
+			write_store_jsval(MCReg::RAX, load->_dst);
+			break;
+		}
+		case InstrKind::IK_I2I: {
+			auto mov = (I2IInstr*)inst;
+			emit_load(mov->_src, MCReg::R8);
+			write_store_jsval(MCReg::R8, mov->_dst);
+			break;
+		}
+
+		case InstrKind::IK_MULT: {
+			auto mult = (MultInstr*)inst;
+			auto lhs = const_of(mult->_src1);
+			auto rhs = const_of(mult->_src2);
+			if (lhs.has_value() && rhs.has_value()) {
+				write_load_imm((uint64_t)*lhs * (uint64_t)*rhs, MCReg::RAX);
+			} else if (lhs.has_value() || rhs.has_value()) {
+				// Multiply by the specialized side as an immediate
+				emit_load(lhs.has_value() ? mult->_src2 : mult->_src1, MCReg::RAX);
+				write_multimm((uint32_t)lhs.value_or(rhs.value_or(0)), MCReg::RAX);
+			} else {
+				emit_load(mult->_src1, MCReg::R8);
+				emit_load(mult->_src2, MCReg::RAX);
+				write_mult(MCReg::R8, MCReg::RAX);
+			}
+			write_store_jsval(MCReg::RAX, mult->_dst);
+			break;
+		}
+		case InstrKind::IK_MULTIMM: {
+			auto mult = (MultImmInstr*)inst;
+			auto src = const_of(mult->_src1);
+			if (src.has_value()) {
+				write_load_imm((uint64_t)*src * mult->_src2.to_bytes(), MCReg::RAX);
+			} else if (fits_imm32((int64_t)mult->_src2.to_bytes())) {
+				emit_load(mult->_src1, MCReg::RAX);
+				write_multimm((uint32_t)mult->_src2.to_bytes(), MCReg::RAX);
+			} else {
+				// Too wide for imul's immediate, multiply through a register instead
+				emit_load(mult->_src1, MCReg::RAX);
+				write_load_imm(mult->_src2.to_bytes(), MCReg::R8);
 				write_mult(MCReg::R8, MCReg::RAX);
-				write_store_jsval(MCReg::RAX, mult->_dst);
-				break;
 			}
-			case InstrKind::IK_ADD: {
-				auto add = (AddInstr*)inst;
-				write_load_jsval(add->_src1, MCReg::R8);
-				write_load_jsval(add->_src2, MCReg::RAX);
+			write_store_jsval(MCReg::RAX, mult->_dst);
+			break;
+		}
+		case InstrKind::IK_ADD: {
+			auto add = (AddInstr*)inst;
+			auto lhs = const_of(add->_src1);
+			auto rhs = const_of(add->_src2);
+			if (lhs.has_value() || rhs.has_value()) {
+				emit_load(lhs.has_value() ? add->_src2 : add->_src1, MCReg::RAX);
+				write_addimm((uint32_t)lhs.value_or(rhs.value_or(0)), MCReg::RAX);
+			} else {
+				emit_load(add->_src1, MCReg::R8);
+				emit_load(add->_src2, MCReg::RAX);
 				write_add(MCReg::R8, MCReg::RAX);
-				write_store_jsval(MCReg::RAX, add->_dst);
-				break;
 			}
-			case InstrKind::IK_ADDIMM: {
-				auto add = (AddImmInstr*)inst;
-				write_load_jsval(add->_src1, MCReg::RAX);
+			write_store_jsval(MCReg::RAX, add->_dst);
+			break;
+		}
+		case InstrKind::IK_ADDIMM: {
+			auto add = (AddImmInstr*)inst;
+			emit_load(add->_src1, MCReg::RAX);
+			if (fits_imm32((int64_t)add->_src2.to_bytes())) {
 				write_addimm((uint32_t)add->_src2.to_bytes(), MCReg::RAX);
-				write_store_jsval(MCReg::RAX, add->_dst);
-				break;
+			} else {
+				write_load_imm(add->_src2.to_bytes(), MCReg::R8);
+				write_add(MCReg::R8, MCReg::RAX);
 			}
+			write_store_jsval(MCReg::RAX, add->_dst);
+			break;
+		}
 
-			case InstrKind::IK_CMP_LT: {
-				jump_kind = InstrKind::IK_CMP_LT;
-				auto cmp = (CmpLTInstr*)inst;
-				write_load_jsval(cmp->_src1, MCReg::R8);
-				write_load_jsval(cmp->_src2, MCReg::RAX);
-				write_cmplt(MCReg::R8, MCReg::RAX);
-				// TODO: make this work
-				//write_store_jsval(MCReg::RAX, cmp->_dst);
-				break;
+		case InstrKind::IK_CMP_LT:
+		case InstrKind::IK_CMP_LE:
+		case InstrKind::IK_CMP_GT:
+		case InstrKind::IK_CMP_GE: {
+			auto [src1, src2, dst] = *cmp_operands(inst);
+			emit_load(src1, MCReg::R8);
+			auto rhs = const_of(src2);
+			if (rhs.has_value()) {
+				write_cmpimm((uint32_t)*rhs, MCReg::R8);
+			} else {
+				emit_load(src2, MCReg::RAX);
+				write_cmp(MCReg::R8, MCReg::RAX);
+			}
+			write_setcc(cond_for(inst->_kind), MCReg::RAX);
+			write_store_jsval(MCReg::RAX, dst);
+			_last_cmp = std::pair{inst->_kind, dst};
+			break;
+		}
+		case InstrKind::IK_CBR: {
+			// Only the back-edge of a loop, other branches go through `emit_cbr`
+			auto cbr = (CbrInstr*)inst;
+			if (cbr->_dst._kind != ValKind::VK_LOCATION ||
+				cbr->_dst.as_loc() != _blk_name) {
+				return tl::make_unexpected(
+					Error(ErrorKind::EK_INVALID_INST, "cbr out of the jitted loop"));
 			}
-			case InstrKind::IK_CBR: {
-				auto cbr = (CbrInstr*)inst;
-				write_jmp(jump_kind);
-				break;
+			if (last_cmp.has_value() && last_cmp->second == cbr->_src) {
+				// The flags from the compare are still live
+				write_jcc(cond_for(last_cmp->first), loop_head);
+			} else {
+				emit_load(cbr->_src, MCReg::RAX);
+				// test rax, rax
+				write_byte(0x48);
+				write_byte(0x85);
+				write_byte(0xc0);
+				write_jcc(MCCond::NE, loop_head);
 			}
+			break;
+		}
 
-			case InstrKind::IK_IWRITE: {
-				auto wrt = (IWriteInstr*)inst;
-				
-				// Push rcx and rdx
-				write_byte(0x50 | encode(MCReg::RDX));
-				write_byte(0x50 | encode(MCReg::RCX));
+		case InstrKind::IK_IWRITE: {
+			auto wrt = (IWriteInstr*)inst;
 
-				write_subimm(16, MCReg::RSP);
+			// The sink of the running context is in rdx
+			//
+			// mov rax, rdx
+			// mov r8, [rax]
+			write_mov(MCReg::RDX, MCReg::RAX);
+			write_byte(0x4c);
+			write_byte(0x8b);
+			write_byte(0x00);
+			write_cmpimm(OutputSink::PENDING_INTS, MCReg::R8);
+			auto* room = write_jcc_fwd(MCCond::L);
 
-				write_load_jsval(wrt->_src, MCReg::RCX);
+			// The queue is full, only now is there a call out. The frame already has
+			// the shadow space, spill rcx and rdx above it
+			//
+			// mov [rsp + JIT_SPILL_RCX], rcx
+			// mov [rsp + JIT_SPILL_RDX], rdx
+			write_byte(0x48);
+			write_byte(0x89);
+			write_byte(0x4c);
+			write_byte(0x24);
+			write_byte(JIT_SPILL_RCX);
+			write_byte(0x48);
+			write_byte(0x89);
+			write_byte(0x54);
+			write_byte(0x24);
+			write_byte(JIT_SPILL_RDX);
+			write_mov(MCReg::RAX, MCReg::RCX);
+			write_load_imm((intptr_t)drain_output, MCReg::RAX);
+			// Call rax
+			write_byte(0xff);
+			write_byte(0xd0);
+			// mov rcx, [rsp + JIT_SPILL_RCX]
+			// mov rdx, [rsp + JIT_SPILL_RDX]
+			write_byte(0x48);
+			write_byte(0x8b);
+			write_byte(0x4c);
+			write_byte(0x24);
+			write_byte(JIT_SPILL_RCX);
+			write_byte(0x48);
+			write_byte(0x8b);
+			write_byte(0x54);
+			write_byte(0x24);
+			write_byte(JIT_SPILL_RDX);
+			write_mov(MCReg::RDX, MCReg::RAX);
+			write_load_imm(0, MCReg::R8);
+			patch_rel32(room, _code + _code_idx);
 
-				// Load call address into rax
-				write_load_imm((intptr_t)iwrite_call, MCReg::RAX);
+			// mov [rax + r8*8 + 8], r9
+			// add r8, 1
+			// mov [rax], r8
+			emit_load(wrt->_src, MCReg::R9);
+			write_byte(0x4e);
+			write_byte(0x89);
+			write_byte(0x4c);
+			write_byte(0xc0);
+			write_byte(0x08);
+			write_addimm(1, MCReg::R8);
+			write_byte(0x4c);
+			write_byte(0x89);
+			write_byte(0x00);
+			break;
+		}
 
-				// Call rax
-				write_byte(0xff);
-				write_byte(0xd0);
+		case InstrKind::IK_NOP: break;
 
-				write_addimm(16, MCReg::RSP);
+		default: {
+			std::cout << "INVALID INSTR" << *inst << "\n";
+			return tl::make_unexpected(
+				Error(ErrorKind::EK_INVALID_INST, "invalid instruction"));
+		}
+	}
+	return tl::expected<void, Error>();
+}
 
-				// Pop rcx and rdx back to registers
-				write_byte(0x58 | encode(MCReg::RCX));
-				write_byte(0x58 | encode(MCReg::RDX));
-				break;
-			}
+static bool can_compile(const Block& blk) {
+	for (auto* inst : blk._instrs) {
+		if (!(op_info(inst->_kind)._flags & OF_JIT)) {
+			return false;
+		}
+	}
+	return true;
+}
 
-			default: {
-				std::cout << "INVALID INSTR" << *inst << "\n";
-				return tl::make_unexpected(
-					Error(ErrorKind::EK_INVALID_INST, "invalid instruction"));
+static bool almost_always_taken(const CbrInstr* cbr) {
+	return cbr->_taken >= SPECULATE_MIN_SAMPLES &&
+		   cbr->_not_taken * SPECULATE_RATIO <= cbr->_taken;
+}
+
+// Emit the `cbr` at `blk._instrs[idx]`. The likely side of the branch is laid out as
+// the fallthrough and a branch that is almost always taken is turned into a guard with
+// a side exit, the target is then returned so the trace continues there.
+tl::expected<std::optional<std::string>, Error> Jit::emit_cbr(
+	const Block& blk, size_t idx) {
+	auto last_cmp = _last_cmp;
+	_last_cmp.reset();
+
+	auto cbr = (CbrInstr*)blk._instrs[idx];
+	if (_mark_lines) {
+		_lines.emplace_back(_code_idx, cbr);
+	}
+	if (cbr->_dst._kind != ValKind::VK_LOCATION) {
+		return tl::make_unexpected(
+			Error(ErrorKind::EK_INVALID_INST, "cbr with non location jump"));
+	}
+	auto cond = MCCond::NE;
+	if (last_cmp.has_value() && last_cmp->second == cbr->_src) {
+		// The flags from the compare are still live
+		cond = cond_for(last_cmp->first);
+	} else {
+		emit_load(cbr->_src, MCReg::RAX);
+		// test rax, rax
+		write_byte(0x48);
+		write_byte(0x85);
+		write_byte(0xc0);
+	}
+
+	auto target = std::string(cbr->_dst.as_loc());
+	auto taken = JitExit{target, 0};
+	auto not_taken = idx + 1 == blk._instrs.size()
+						 ? JitExit{blk._fallthrough, 0}
+						 : JitExit{blk._name, (uint32_t)idx + 1};
+	auto in_trace = _trace.find(target);
+	if (in_trace != _trace.end()) {
+		write_jcc(cond, in_trace->second);
+	} else if (almost_always_taken(cbr)) {
+		_stubs.emplace_back(write_jcc_fwd(negate(cond)), exit_id(not_taken));
+		return std::optional{target};
+	} else if (cbr->_taken > cbr->_not_taken) {
+		// Leave inline and jump over the exit in the rare case
+		auto skip = write_jcc_fwd(negate(cond));
+		emit_exit(exit_id(taken));
+		patch_rel32(skip, _code + _code_idx);
+	} else {
+		_stubs.emplace_back(write_jcc_fwd(cond), exit_id(taken));
+	}
+	return std::optional<std::string>();
+}
+
+// Emit the entry block and keep following into the block control goes to next, as long
+// as that block is hot and can be compiled. Jumps to blocks already in the trace stay in
+// native code so loops over several blocks never leave it.
+tl::expected<void, Error> Jit::emit_trace(uint32_t loop_head) {
+	const Block* curr = &_blk;
+	for (uint32_t len = 1;; len++) {
+		_trace[curr->_name] = curr == &_blk ? loop_head : _code_idx;
+		// Other branches of the trace land here with their own flags
+		_last_cmp.reset();
+		emit_fuel_check(*curr);
+
+		std::optional<std::string> next;
+		for (size_t i = 0; i < curr->_instrs.size() && !next.has_value(); i++) {
+			auto inst = curr->_instrs[i];
+			if (inst->_kind == InstrKind::IK_CBR) {
+				auto res = emit_cbr(*curr, i);
+				if (!res) {
+					return tl::make_unexpected(res.error());
+				}
+				next = *res;
+				continue;
+			}
+			auto res = emit_instr(inst, loop_head);
+			if (!res) {
+				return tl::make_unexpected(res.error());
 			}
 		}
+
+		auto cont = next.value_or(curr->_fallthrough);
+		auto in_trace = _trace.find(cont);
+		if (in_trace != _trace.end()) {
+			write_jmp(in_trace->second);
+			return tl::expected<void, Error>();
+		}
+		auto blk = _func._blocks.find(cont);
+		if (len >= MAX_TRACE_BLOCKS || blk == _func._blocks.end() ||
+			blk->second._exec_count < 2 || !can_compile(blk->second) ||
+			writes_const(blk->second)) {
+			emit_exit(exit_id(JitExit{cont, 0}));
+			return tl::expected<void, Error>();
+		}
+		curr = &blk->second;
+	}
+}
+
+// Emit `_unroll` copies of the body per trip around the loop. The induction update is
+// folded into the loads of the copies and the compare and branch only happen once per
+// group. When fewer than `_unroll` trips are left the original body finishes the loop.
+//
+//   head:  if !(iv + step * (unroll - 1) < bound) goto rem
+//          body x unroll
+//          iv += step * unroll
+//          if (iv < bound) goto head
+//          goto exit
+//   rem:   body
+//          if (iv < bound) goto rem
+//   exit:
+//
+// When the bound is a profiled constant the group check is one compare of `iv` against
+// the immediate `bound - step * (unroll - 1)` and full groups loop straight to `body`.
+tl::expected<void, Error> Jit::emit_unrolled(
+	const CountedLoop& loop, uint32_t loop_head) {
+	auto cond = cond_for(loop._cmp);
+	auto bound = const_of(loop._bound);
+	int64_t limit = bound.value_or(0) - loop._step * (_unroll - 1);
+	bool by_limit = bound.has_value() && fits_imm32(limit);
+
+	write_load_jsval(loop._iv, MCReg::RAX);
+	if (by_limit) {
+		write_cmpimm((uint32_t)limit, MCReg::RAX);
+	} else {
+		write_addimm((uint32_t)(loop._step * (_unroll - 1)), MCReg::RAX);
+		write_load_jsval(loop._bound, MCReg::R8);
+		write_cmp(MCReg::RAX, MCReg::R8);
 	}
-	
-	// After the conditional jmp what was a fall through is now
-	// RET. We know this is safe since the only way to jit is
-	// a backedge (loop) since they must run more than 1
+	auto to_rem = write_jcc_fwd(negate(cond));
+	uint32_t body = _code_idx;
+	// A group is paid for up front, trips the fuel does not cover in full go one at a
+	// time through the remainder loop. Leaving here instead would come straight back.
 	//
-	// leave
-	//write_byte(0xc9);
-	// Undo the sub rsp, 8 to set up stack
-	write_addimm(32, MCReg::RSP);
-	// Pop rdi
-	write_byte(0x58 | encode(MCReg::RDI));
-	// pop base pointer
-	write_byte(0x58 | encode(MCReg::RBP));
-	// ret
-	write_byte(0xc3);
+	// cmp qword [rdi], cost
+	// jl rem_head
+	// sub qword [rdi], cost
+	auto group_cost = (uint32_t)_instrs.size() * _unroll;
+	write_byte(0x48);
+	write_byte(0x81);
+	write_byte(0x3f);
+	write_dword(group_cost);
+	auto short_of_fuel = write_jcc_fwd(MCCond::L);
+	write_byte(0x48);
+	write_byte(0x81);
+	write_byte(0x2f);
+	write_dword(group_cost);
+	emit_count(_blk, _unroll);
+	_last_cmp.reset();
+
+	_fold_iv = loop._iv;
+	for (uint32_t copy = 0; copy < _unroll; copy++) {
+		for (size_t i = 0; i < _instrs.size(); i++) {
+			if (i == loop._mov_idx) {
+				_fold_off += loop._step;
+			}
+			if (loop.is_loop_control(i)) {
+				continue;
+			}
+			auto res = emit_instr(_instrs[i], loop_head);
+			if (!res) {
+				return tl::make_unexpected(res.error());
+			}
+		}
+	}
+	_fold_iv.reset();
+	_fold_off = 0;
+
+	// Write back the induction variable once for the whole group
+	write_load_jsval(loop._iv, MCReg::RAX);
+	write_addimm((uint32_t)(loop._step * _unroll), MCReg::RAX);
+	write_store_jsval(MCReg::RAX, loop._iv);
+	if (!(loop._iv_tmp == loop._iv)) {
+		write_store_jsval(MCReg::RAX, loop._iv_tmp);
+	}
+	uint8_t* to_exit = nullptr;
+	if (by_limit) {
+		write_cmpimm((uint32_t)limit, MCReg::RAX);
+		write_jcc(cond, body);
+		// Fewer than `_unroll` trips left, finish in the remainder loop unless done
+		auto res = emit_instr(_instrs[loop._cmp_idx], loop_head);
+		if (!res) {
+			return tl::make_unexpected(res.error());
+		}
+		_last_cmp.reset();
+		to_exit = write_jcc_fwd(negate(cond));
+	} else {
+		for (auto idx : {loop._cmp_idx, loop._cbr_idx}) {
+			auto res = emit_instr(_instrs[idx], loop_head);
+			if (!res) {
+				return tl::make_unexpected(res.error());
+			}
+		}
+		to_exit = write_jmp_fwd();
+	}
+
+	patch_rel32(to_rem, _code + _code_idx);
+	patch_rel32(short_of_fuel, _code + _code_idx);
+	uint32_t rem_head = _code_idx;
+	emit_fuel_check(_blk);
+	for (auto& inst : _instrs) {
+		auto res = emit_instr(inst, rem_head);
+		if (!res) {
+			return tl::make_unexpected(res.error());
+		}
+	}
+	patch_rel32(to_exit, _code + _code_idx);
+	return tl::expected<void, Error>();
+}
+
+tl::expected<void, Error> Jit::compile() {
+	// Calls and returns stay in the interpreter
+	if (!can_compile(_blk)) {
+		return tl::make_unexpected(
+			Error(ErrorKind::EK_INVALID_INST, "block has instructions the JIT lacks"));
+	}
+
+	if (_blk._cold) {
+		_code = _arena.cold_cursor();
+		_code_cap = (uint32_t)std::min<size_t>(_arena.cold_left(), UINT32_MAX);
+	} else {
+		_code = _arena.hot_cursor();
+		_code_cap = (uint32_t)std::min<size_t>(_arena.hot_left(), UINT32_MAX);
+		_cold = _arena.cold_cursor();
+		_cold_cap = (uint32_t)std::min<size_t>(_arena.cold_left(), UINT32_MAX);
+	}
+
+	_mark_lines = gdb_jit().enabled();
+
+	// Push base pointer
+	write_byte(0x50 | encode(MCReg::RBP));
+	// Do preamble stuff
+	//write_mov(MCReg::RBP, MCReg::RSP);
+	// 
+	// push rdi
+	write_byte(0x50 | encode(MCReg::RDI));
+	write_subimm(JIT_FRAME_SIZE, MCReg::RSP);
+	// The fuel pointer lives in rdi, calls out keep it
+	write_mov(MCReg::R8, MCReg::RDI);
+
+	specialize();
+	emit_guards();
+
+	uint32_t loop_head = _code_idx;
+	auto loop = _unroll > 1 ? find_counted_loop(_blk_name, _instrs) : std::nullopt;
+	if (loop.has_value()) {
+		auto res = emit_unrolled(*loop, loop_head);
+		if (!res) {
+			return tl::make_unexpected(res.error());
+		}
+		// Falling off the end of the loop continues at the fallthrough block
+		emit_exit(exit_id(JitExit{_blk._fallthrough, 0}));
+	} else {
+		auto res = emit_trace(loop_head);
+		if (!res) {
+			return tl::make_unexpected(res.error());
+		}
+	}
+	emit_stubs();
+
+	if (_overflow) {
+		return tl::make_unexpected(Error(ErrorKind::EK_OOM, "code arena is full"));
+	}
+	if (_blk._cold) {
+		_arena.commit(0, _code_idx);
+	} else {
+		_arena.commit(_code_idx, _cold_idx);
+	}
+
+	if (perf_map().enabled()) {
+		auto name = _func._name + ":" + _blk_name;
+		perf_map().add_code(_code, _code_idx, name);
+		if (_cold) {
+			perf_map().add_code(_cold, _cold_idx, name + ".cold");
+		}
+	}
+	if (gdb_jit().enabled()) {
+		gdb_jit().add_code(_func._name + ":" + _blk_name, _code, _code_idx, _cold,
+			_cold ? _cold_idx : 0, JIT_FRAME_SIZE, _lines);
+	}
 
 	return tl::expected<void, Error>();
 }
@@ -1,23 +1,26 @@
 #pragma once
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 #include <optional>
 #include <functional>
 #include <iostream>
 #include <utility>
-
-#include <Windows.h>
-#include <Memoryapi.h>
+#include <tuple>
+#include <algorithm>
 
 #include "expected.hpp"
 #include "instrs.hpp"
 #include "interp.hpp"
+#include "gdbjit.hpp"
 
 namespace jit {
 
-typedef uint64_t (*JitCall)(Value* registers, uint64_t* locals);
+// Jitted code gets the registers of the running call in rcx, the output of its context in
+// rdx and the fuel of the context in r8, which it keeps in rdi.
+typedef uint64_t (*JitCall)(Value* registers, OutputSink* out, int64_t* fuel);
 
 enum class MCReg {
 	RAX = 0,
@@ -38,36 +41,125 @@ enum class MCReg {
 	R15 = 15,
 };
 
+// Condition codes, these are the low nibble of the `jcc` and `setcc` opcodes.
+enum class MCCond : uint8_t {
+	E = 0x4,
+	NE = 0x5,
+	S = 0x8,
+	L = 0xc,
+	GE = 0xd,
+	LE = 0xe,
+	G = 0xf,
+};
+
+// Upper bound on how many copies of a loop body are emitted per iteration.
+static constexpr uint32_t MAX_UNROLL = 16;
+// Upper bound on how many blocks one compile follows into a trace.
+static constexpr uint32_t MAX_TRACE_BLOCKS = 8;
+// A `cbr` is only assumed to always be taken after this many samples and when the other
+// way happened at most once per this many times.
+static constexpr uint64_t SPECULATE_MIN_SAMPLES = 16;
+static constexpr uint64_t SPECULATE_RATIO = 50;
+
+// A block that branches back to its own start, stepping an induction variable by a
+// constant and comparing it against a loop invariant bound right before the `cbr`.
+//
+//     addI %iv, step => %tmp
+//     i2i %tmp => %iv
+//     cmp_LT %iv, %bound => %cond
+//     cbr %cond -> .self
+struct CountedLoop {
+	Reg _iv;
+	// Where `addI` writes the stepped value, this is `_iv` when there is no `i2i`
+	Reg _iv_tmp;
+	Reg _bound;
+	Reg _cond;
+	int64_t _step;
+	InstrKind _cmp;
+
+	// Indices into the block of the instructions making up the loop control
+	size_t _step_idx;
+	size_t _mov_idx;
+	size_t _cmp_idx;
+	size_t _cbr_idx;
+
+	CountedLoop(Reg iv, Reg bound, Reg cond, int64_t step, InstrKind cmp)
+		: _iv(iv), _iv_tmp(iv), _bound(bound), _cond(cond), _step(step), _cmp(cmp),
+		  _step_idx(0), _mov_idx(0), _cmp_idx(0), _cbr_idx(0) {}
+
+	bool is_loop_control(size_t idx) const {
+		return idx == _step_idx || idx == _mov_idx || idx == _cmp_idx || idx == _cbr_idx;
+	}
+
+	// How many times the body runs when the block is entered with `iv` and `bound`.
+	int64_t trip_count(int64_t iv, int64_t bound) const;
+};
+
+std::optional<CountedLoop> find_counted_loop(
+	const std::string& name, const std::vector<Instruction*>& instrs);
+
 struct Jit {
-	
+	const Function& _func;
+	const Block& _blk;
 	const std::string& _blk_name;
 	const std::vector<Instruction*>& _instrs;
+	CodeArena& _arena;
+
 	uint8_t* _code = nullptr;
 	uint32_t _code_idx = 0;
-
-	Jit(const std::string& name, const std::vector<Instruction*>& instrs)
-		: _blk_name(name), _instrs(instrs) {}
-
-	~Jit() {
-		if (_code) {
-			if (VirtualFree((LPVOID)_code, 0, MEM_RELEASE) == 0) {
-				std::cout << "FAILED TO FREE CODE PAGE\n";
-			}
-		}
-	}
-
-	[[nodiscard]]
-	tl::expected<void, Error> set_exec_mem() {
-		LPVOID res =
-			VirtualAlloc(nullptr, 4096, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
-		if (!res) {
-			return tl::make_unexpected(Error(ErrorKind::EK_OOM, "mmap failed"));
-		}
-		_code = (uint8_t*)res;
-		return tl::expected<void, Error>();
-	}
+	uint32_t _code_cap = 0;
+	// Out of line code for the unlikely side of branches, null when the whole block is
+	// cold and already lives in the cold part of the arena
+	uint8_t* _cold = nullptr;
+	uint32_t _cold_idx = 0;
+	uint32_t _cold_cap = 0;
+	bool _overflow = false;
+
+	// Where the jitted code can leave to, see `CompiledBlock::_exits`
+	std::vector<JitExit> _exits;
+	// Blocks already emitted in this trace and their offset into `_code`
+	std::map<std::string, uint32_t> _trace;
+	// Jumps to exit stubs that are emitted out of line after the block, the rel32 to
+	// patch and the exit it leads to
+	std::vector<std::pair<uint8_t*, uint32_t>> _stubs;
+	// Jumps taken when a block could not be paid for, like `_stubs` with the fuel to give
+	// back before leaving
+	std::vector<std::tuple<uint8_t*, uint32_t, uint32_t>> _fuel_stubs;
+
+	// Copies of a counted loop body emitted per trip around the loop
+	uint32_t _unroll;
+
+	// While emitting an unrolled copy, reads of `_fold_iv` see `_fold_off` added to the
+	// value in memory instead of storing every intermediate step.
+	std::optional<Reg> _fold_iv;
+	int64_t _fold_off = 0;
+
+	// The last emitted compare, a `cbr` right after it can reuse the flags
+	std::optional<std::pair<InstrKind, Reg>> _last_cmp;
+
+	// Registers this code assumes hold a profiled constant, checked once on entry
+	std::map<Reg, int64_t> _consts;
+
+	// Set for programs the verifier did not pass, every store then also marks the register
+	// as an integer so the interpreter still tells the unwritten ones apart
+	bool _store_kinds = false;
+	// Every register the code loads and stores
+	std::set<Reg> _reads;
+	std::set<Reg> _stores;
+
+	// Where each instruction starts, kept for the debugger when it wants them
+	bool _mark_lines = false;
+	std::vector<NativeLine> _lines;
+
+	Jit(const Function& func, const Block& blk, CodeArena& arena, uint32_t unroll = 1)
+		: _func(func), _blk(blk), _blk_name(blk._name), _instrs(blk._instrs),
+		  _arena(arena), _unroll(std::clamp(unroll, 1u, MAX_UNROLL)) {}
 
 	void write_byte(uint8_t b) {
+		if (_code_idx >= _code_cap) {
+			_overflow = true;
+			return;
+		}
 		_code[_code_idx] = b;
 		_code_idx += 1;
 	}
@@ -84,21 +176,52 @@ struct Jit {
 		}
 	}
 
+	void swap_streams() {
+		std::swap(_code, _cold);
+		std::swap(_code_idx, _cold_idx);
+		std::swap(_code_cap, _cold_cap);
+	}
+
 	void write_load_jsval(const Reg& from, const MCReg& to);
 	void write_load_imm(uint64_t from, const MCReg& to);
 	void write_store_jsval(const MCReg& from, const Reg& to);
 	void write_mov(const MCReg& from, const MCReg& to);
 	void write_mult(const MCReg& from, const MCReg& to);
+	void write_multimm(uint32_t from, const MCReg& to);
 	void write_add(const MCReg& from, const MCReg& to);
 	void write_addimm(uint32_t from, const MCReg& to);
 	void write_subimm(uint32_t from, const MCReg& to);
-	void write_cmplt(const MCReg& from, const MCReg& to);
-	void write_jmp(const InstrKind& kind);
+	void write_cmp(const MCReg& lhs, const MCReg& rhs);
+	void write_cmpimm(uint32_t imm, const MCReg& lhs);
+	void write_setcc(MCCond cond, const MCReg& to);
+	void write_jcc(MCCond cond, uint32_t target);
+	uint8_t* write_jcc_fwd(MCCond cond);
+	void write_jmp(uint32_t target);
+	uint8_t* write_jmp_fwd();
+	void patch_rel32(uint8_t* at, uint8_t* target);
+
+	uint32_t exit_id(const JitExit& exit);
+	void emit_exit(uint32_t id);
+	void emit_stubs();
+	void emit_fuel_check(const Block& blk);
+	void emit_count(const Block& blk, uint32_t runs);
+
+	std::optional<int64_t> const_of(const Reg& reg) const;
+	bool writes_const(const Block& blk) const;
+	void specialize();
+	void emit_guards();
+
+	void emit_load(const Reg& from, const MCReg& to);
+	tl::expected<void, Error> emit_instr(Instruction* inst, uint32_t loop_head);
+	tl::expected<std::optional<std::string>, Error> emit_cbr(
+		const Block& blk, size_t idx);
+	tl::expected<void, Error> emit_trace(uint32_t loop_head);
+	tl::expected<void, Error> emit_unrolled(const CountedLoop& loop, uint32_t loop_head);
 
 	tl::expected<void, Error> compile();
 
-	uint64_t execute(Value* registers, uint64_t* globals) {
-		auto val = ((JitCall)_code)(registers, globals);
+	uint64_t execute(Value* registers, OutputSink* out, int64_t* fuel) {
+		auto val = ((JitCall)_code)(registers, out, fuel);
 		return val;
 	}
 };
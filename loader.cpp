@@ -0,0 +1,379 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <iostream>
+#include <charconv>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "expected.hpp"
+#include "instrs.hpp"
+#include "interp.hpp"
+#include "loader.hpp"
+
+namespace jit {
+
+MappedFile::~MappedFile() {
+	if (_data) {
+		UnmapViewOfFile((LPCVOID)_data);
+	}
+	if (_mapping) {
+		CloseHandle(_mapping);
+	}
+	if (_file != INVALID_HANDLE_VALUE) {
+		CloseHandle(_file);
+	}
+}
+
+tl::expected<MappedFile, Error> MappedFile::open(const char* path) {
+	auto file = MappedFile();
+	file._file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file._file == INVALID_HANDLE_VALUE) {
+		return tl::make_unexpected(
+			Error(ErrorKind::EK_IO, "failed to open " + std::string(path)));
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file._file, &size)) {
+		return tl::make_unexpected(
+			Error(ErrorKind::EK_IO, "failed to stat " + std::string(path)));
+	}
+	file._size = (size_t)size.QuadPart;
+	// An empty file can not be mapped but it is a valid (empty) program
+	if (file._size == 0) {
+		return file;
+	}
+
+	file._mapping = CreateFileMappingA(file._file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!file._mapping) {
+		return tl::make_unexpected(
+			Error(ErrorKind::EK_IO, "failed to map " + std::string(path)));
+	}
+	file._data = (const char*)MapViewOfFile(file._mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!file._data) {
+		return tl::make_unexpected(
+			Error(ErrorKind::EK_IO, "failed to map " + std::string(path)));
+	}
+	return file;
+}
+
+// The longest line is `.frame` with its parameters, a line with more is rejected.
+static constexpr size_t MAX_TOKENS = 64;
+
+// The whitespace separated tokens of one line with any trailing comma removed.
+struct Tokens {
+	std::array<std::string_view, MAX_TOKENS> _toks;
+	size_t _len = 0;
+	// Set when the line has more than `MAX_TOKENS` tokens
+	bool _overflow = false;
+
+	Tokens(std::string_view line) {
+		while (!line.empty()) {
+			auto start = line.find_first_not_of(" \t\r");
+			if (start == std::string_view::npos) {
+				break;
+			}
+			line.remove_prefix(start);
+			auto end = line.find_first_of(" \t\r");
+			auto tok = line.substr(0, end);
+			line.remove_prefix(tok.size());
+			if (tok.ends_with(',')) {
+				tok.remove_suffix(1);
+			}
+			if (tok.empty()) {
+				continue;
+			}
+			if (_len == MAX_TOKENS) {
+				_overflow = true;
+				break;
+			}
+			_toks[_len++] = tok;
+		}
+	}
+
+	std::string_view operator[](size_t i) const { return i < _len ? _toks[i] : ""; }
+};
+
+static std::optional<int64_t> parse_int(std::string_view tok) {
+	int64_t val = 0;
+	auto [end, ec] = std::from_chars(tok.data(), tok.data() + tok.size(), val);
+	if (ec != std::errc() || end != tok.data() + tok.size()) {
+		return std::nullopt;
+	}
+	return val;
+}
+
+// A register is written `%vr12`, frame parameters may also leave off the prefix.
+static std::optional<Reg> parse_reg(std::string_view tok) {
+	if (tok.starts_with("%vr")) {
+		tok.remove_prefix(3);
+	}
+	uint32_t reg = 0;
+	auto [end, ec] = std::from_chars(tok.data(), tok.data() + tok.size(), reg);
+	if (ec != std::errc() || end != tok.data() + tok.size() || reg >= MAX_REGS) {
+		return std::nullopt;
+	}
+	return Reg{reg};
+}
+
+static Error illegal(std::string_view op, std::string_view line) {
+	return Error(ErrorKind::EK_INVALID_INST,
+		"Illegal argument to " + std::string(op) + " instruction\n" + std::string(line));
+}
+
+// Read the operands of an instruction of `shape` from `toks`, as laid out in
+// `OperandShape`. Call arguments go into `args`, which the operands point to.
+static std::optional<Operands> parse_operands(
+	OperandShape shape, const Tokens& toks, std::vector<Reg>& args) {
+	auto ops = Operands();
+	std::optional<Reg> s1 = Reg{0};
+	std::optional<Reg> s2 = Reg{0};
+	std::optional<Reg> d = Reg{0};
+	std::optional<int64_t> imm = 0;
+	switch (shape) {
+		case OS_NONE: break;
+		case OS_R: {
+			s1 = parse_reg(toks[1]);
+			break;
+		}
+		case OS_R_R: {
+			s1 = parse_reg(toks[1]);
+			d = parse_reg(toks[3]);
+			break;
+		}
+		case OS_I_R: {
+			imm = parse_int(toks[1]);
+			d = parse_reg(toks[3]);
+			break;
+		}
+		case OS_RR_R: {
+			s1 = parse_reg(toks[1]);
+			s2 = parse_reg(toks[2]);
+			d = parse_reg(toks[4]);
+			break;
+		}
+		case OS_RI_R: {
+			s1 = parse_reg(toks[1]);
+			imm = parse_int(toks[2]);
+			d = parse_reg(toks[4]);
+			break;
+		}
+		case OS_R_L: {
+			s1 = parse_reg(toks[1]);
+			ops._label = toks[3];
+			if (ops._label.empty()) {
+				return std::nullopt;
+			}
+			break;
+		}
+		case OS_CALL:
+		case OS_CALL_R: {
+			ops._label = toks[1];
+			size_t i = 2;
+			for (; i < toks._len && toks[i] != "=>"; i++) {
+				auto arg = parse_reg(toks[i]);
+				if (!arg) {
+					return std::nullopt;
+				}
+				args.push_back(*arg);
+			}
+			if (shape == OS_CALL_R) {
+				d = parse_reg(toks[i + 1]);
+			}
+			if (ops._label.empty() || (shape == OS_CALL) != (i == toks._len)) {
+				return std::nullopt;
+			}
+			ops._args = args;
+			break;
+		}
+		case OS_DIRECTIVE: return std::nullopt;
+	}
+	if (!s1 || !s2 || !d || !imm) {
+		return std::nullopt;
+	}
+	ops._src1 = *s1;
+	ops._src2 = *s2;
+	ops._dst = *d;
+	ops._imm = Value{*imm};
+	return ops;
+}
+
+static tl::expected<void, Error> parse_line(std::string_view line, Parser& parser) {
+	auto toks = Tokens(line);
+	if (toks._len == 0) {
+		return tl::expected<void, Error>();
+	}
+
+	auto op = toks[0];
+	if (toks._overflow) {
+		return tl::make_unexpected(illegal(op, line));
+	}
+	if (op.starts_with('.')) {
+		if (op == ".data") {
+			parser.start_data(parser._arena.make<DataInstr>());
+		} else if (op == ".text") {
+			parser.start_text(parser._arena.make<TextInstr>());
+		} else if (op == ".frame") {
+			auto size = parse_int(toks[2]);
+			if (toks[1].empty() || !size || *size < 0 || *size > MAX_REGS) {
+				return tl::make_unexpected(Error(ErrorKind::EK_INVALID_INST,
+					"Illegal argument to .frame instruction\n" + std::string(line)));
+			}
+			std::vector<Reg> params;
+			for (size_t i = 3; i < toks._len; i++) {
+				auto p = parse_reg(toks[i]);
+				if (!p) {
+					return tl::make_unexpected(Error(ErrorKind::EK_INVALID_INST,
+						"Illegal argument to .frame instruction\n" + std::string(line)));
+				}
+				params.push_back(*p);
+			}
+			parser.push_frame(parser._arena.make<FrameInstr>(
+				std::string(toks[1]), (uint32_t)*size, std::move(params)));
+		} else if (op.ends_with(':')) {
+			parser.push_label(
+				parser._arena.make<LabelInstr>(std::string(op.substr(0, op.size() - 1))));
+		} else {
+			std::cout << "INVALID INSTRUCTION WITH ." << line << "\n";
+		}
+	} else if (auto kind = lookup_mnemonic(op)) {
+		std::vector<Reg> args;
+		auto ops = parse_operands(op_info(*kind)._shape, toks, args);
+		if (!ops) {
+			return tl::make_unexpected(illegal(op, line));
+		}
+		parser.push_instr(build_instr(parser._arena, *kind, *ops));
+	}
+	return tl::expected<void, Error>();
+}
+
+tl::expected<void, Error> parse_iloc(std::string_view src, Parser& parser) {
+	while (!src.empty()) {
+		auto end = src.find('\n');
+		auto line = src.substr(0, end);
+		src.remove_prefix(end == std::string_view::npos ? src.size() : end + 1);
+
+		auto res = parse_line(line, parser);
+		if (!res) {
+			return tl::make_unexpected(res.error());
+		}
+	}
+	return tl::expected<void, Error>();
+}
+
+// Where a line starts once leading whitespace is skipped.
+static std::string_view first_token(std::string_view line) {
+	auto start = line.find_first_not_of(" \t\r");
+	return start == std::string_view::npos ? "" : line.substr(start);
+}
+
+// Split `src` at `.frame` lines into about `count` runs of whole functions. Lines before
+// the first function go into `preamble`.
+static std::vector<Chunk> split_frames(
+	std::string_view src, size_t count, std::string_view& preamble) {
+	std::vector<Chunk> chunks;
+	size_t target = src.size() / count;
+	size_t start = std::string_view::npos;
+	bool in_data = false;
+	size_t pos = 0;
+	while (pos < src.size()) {
+		auto end = src.find('\n', pos);
+		auto len = end == std::string_view::npos ? end : end - pos;
+		auto line = first_token(src.substr(pos, len));
+		if (line.starts_with(".frame")) {
+			if (start == std::string_view::npos) {
+				preamble = src.substr(0, pos);
+				start = pos;
+				chunks.push_back(Chunk{std::string_view(), in_data});
+			} else if (pos - start >= target) {
+				chunks.back()._src = src.substr(start, pos - start);
+				start = pos;
+				chunks.push_back(Chunk{std::string_view(), in_data});
+			}
+		} else if (line.starts_with(".data")) {
+			in_data = true;
+		} else if (line.starts_with(".text")) {
+			in_data = false;
+		}
+		pos = end == std::string_view::npos ? src.size() : end + 1;
+	}
+	if (start == std::string_view::npos) {
+		preamble = src;
+	} else {
+		chunks.back()._src = src.substr(start);
+	}
+	return chunks;
+}
+
+// Parse every chunk into its own `Parser` and merge them in file order. Each chunk starts
+// at a `.frame` so it finishes the last function of the chunk before it, and merging with
+// `insert` keeps the first of two functions with the same name like `push_frame` does.
+static tl::expected<void, Error> parse_parallel(
+	std::string_view src, Parser& parser, uint32_t threads) {
+	std::string_view preamble;
+	auto chunks = split_frames(src, threads * CHUNKS_PER_THREAD, preamble);
+	auto res = parse_iloc(preamble, parser);
+	if (!res) {
+		return tl::make_unexpected(res.error());
+	}
+	if (chunks.empty()) {
+		parser.finalize_prog();
+		return tl::expected<void, Error>();
+	}
+
+	std::vector<Parser> parsers(chunks.size());
+	std::vector<tl::expected<void, Error>> results(chunks.size());
+	std::atomic<size_t> next = 0;
+	auto work = [&]() {
+		for (size_t i = next.fetch_add(1); i < chunks.size(); i = next.fetch_add(1)) {
+			parsers[i]._in_data_section = chunks[i]._in_data;
+			results[i] = parse_iloc(chunks[i]._src, parsers[i]);
+			if (results[i]) {
+				parsers[i].finalize_prog();
+			}
+		}
+	};
+	std::vector<std::thread> pool;
+	for (size_t t = 1; t < std::min<size_t>(threads, chunks.size()); t++) {
+		pool.emplace_back(work);
+	}
+	work();
+	for (auto& t : pool) {
+		t.join();
+	}
+
+	for (size_t i = 0; i < chunks.size(); i++) {
+		if (!results[i]) {
+			return tl::make_unexpected(results[i].error());
+		}
+		parser._funcs.insert(std::make_move_iterator(parsers[i]._funcs.begin()),
+			std::make_move_iterator(parsers[i]._funcs.end()));
+		parser._globals.insert(std::make_move_iterator(parsers[i]._globals.begin()),
+			std::make_move_iterator(parsers[i]._globals.end()));
+		parser._arena.absorb(std::move(parsers[i]._arena));
+	}
+	parser._in_data_section = parsers.back()._in_data_section;
+	return tl::expected<void, Error>();
+}
+
+tl::expected<void, Error> load_iloc(const char* path, Parser& parser, uint32_t threads) {
+	auto file = MappedFile::open(path);
+	if (!file) {
+		return tl::make_unexpected(file.error());
+	}
+	if (threads > 1 && file->_size >= PARALLEL_MIN_BYTES) {
+		return parse_parallel(file->view(), parser, threads);
+	}
+
+	auto res = parse_iloc(file->view(), parser);
+	if (!res) {
+		return tl::make_unexpected(res.error());
+	}
+	parser.finalize_prog();
+	return tl::expected<void, Error>();
+}
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+
+#include <Windows.h>
+#include <Memoryapi.h>
+
+#include "expected.hpp"
+#include "interp.hpp"
+
+namespace jit {
+
+// A read only view of a whole file, the bytes stay mapped until this is destroyed.
+struct MappedFile {
+	HANDLE _file = INVALID_HANDLE_VALUE;
+	HANDLE _mapping = nullptr;
+	const char* _data = nullptr;
+	size_t _size = 0;
+
+	MappedFile() = default;
+	MappedFile(MappedFile&& other) noexcept { *this = std::move(other); }
+	MappedFile& operator=(MappedFile&& other) noexcept {
+		std::swap(_file, other._file);
+		std::swap(_mapping, other._mapping);
+		std::swap(_data, other._data);
+		std::swap(_size, other._size);
+		return *this;
+	}
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	static tl::expected<MappedFile, Error> open(const char* path);
+
+	std::string_view view() const { return std::string_view(_data, _size); }
+};
+
+// Parse the ILOC text in `src` into `parser`, this does not call `finalize_prog`. Tokens
+// are views into `src` so nothing is allocated besides the instructions themselves.
+tl::expected<void, Error> parse_iloc(std::string_view src, Parser& parser);
+
+// Files at least this big are split at `.frame` lines and parsed on several threads.
+static constexpr size_t PARALLEL_MIN_BYTES = 1024 * 1024;
+// Chunks per thread, more than one so a thread that got small functions can take more.
+static constexpr size_t CHUNKS_PER_THREAD = 4;
+
+// A run of whole functions and whether the first starts in the `.data` section.
+struct Chunk {
+	std::string_view _src;
+	bool _in_data;
+};
+
+// Map the file at `path` and parse the whole program in it using up to `threads` threads.
+tl::expected<void, Error> load_iloc(
+	const char* path, Parser& parser, uint32_t threads = 1);
+
+}
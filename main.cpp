@@ -2,36 +2,33 @@
 //
 
 #include <iostream>
-#include <filesystem>
 #include <fstream>
+#include <map>
+#include <memory>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <algorithm>
 
 #include "interp.hpp"
 #include "expected.hpp"
 #include "instrs.hpp"
 #include "jit.hpp"
-
-template<typename T>
-std::vector<T> split(const T& str, const T& delimiters) {
-    std::vector<T> v;
-    typename T::size_type start = 0;
-    auto pos = str.find_first_of(delimiters, start);
-    while (pos != T::npos) {
-        // ignore empty tokens
-        if (pos != start) {
-            v.emplace_back(str, start, pos - start);
-        }
-        start = pos + 1;
-        pos = str.find_first_of(delimiters, start);
-    }
-    // ignore trailing delimiter
-    if (start < str.length()) {
-        // add what's left of the string
-        v.emplace_back(str, start, str.length() - start);
-    }
-    return v;
-}
+#include "passes.hpp"
+#include "loader.hpp"
+#include "bytecode.hpp"
+#include "output.hpp"
+#include "batch.hpp"
+#include "async.hpp"
+#include "profiler.hpp"
+#include "sampler.hpp"
+#include "stats.hpp"
+#include "perfmap.hpp"
+#include "gdbjit.hpp"
+#include "trace.hpp"
+#include "bench.hpp"
+#include "generate.hpp"
 
 tl::expected<uint32_t, jit::Error> str_to_u32(const std::string& s) {
     try {
@@ -49,180 +46,353 @@ tl::expected<int32_t, jit::Error> str_to_i32(const std::string& s) {
     }
 }
 
+tl::expected<void, jit::Error> load_file(
+    const char* path, jit::Parser& parser, uint32_t jobs) {
+    auto scope = jit::TraceScope("load", "load");
+    if (scope._on) {
+        scope._args.add("path", path);
+    }
+    if (std::string_view(path).ends_with(".ilb")) {
+        return jit::load_ilb(path, parser);
+    }
+    return jit::load_iloc(path, parser, jobs);
+}
+
+void write_trace() {
+    auto res = jit::tracer().write();
+    if (!res) {
+        std::cerr << res.error() << "\n";
+    }
+}
+
+// Run every program listed in `list`, one path per line, on `jobs` threads. A path listed
+// more than once is loaded once and all its jobs share the program and its native code.
+// With `async` the runs are coroutines and the output is written by a thread of its own.
+// With `sample_us` the runs are sampled that often and the profile goes to stderr.
+int run_batch_file(const std::string& list, jit::PassManager& pm, uint32_t jobs,
+                   uint32_t unroll_factor, uint32_t profile_points, bool verify,
+                   bool use_jit, int64_t slice, bool async, uint32_t sample_us) {
+    std::ifstream in(list);
+    if (!in) {
+        std::cout << "Failed to open " << list << "\n";
+        return -1;
+    }
+
+    auto sampler = jit::Sampler(std::chrono::microseconds(sample_us));
+    std::map<std::string, std::unique_ptr<jit::Program>> programs;
+    std::vector<jit::Program*> batch;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+        auto& prog = programs[line];
+        if (!prog) {
+            auto parser = jit::Parser();
+            auto loaded = load_file(line.c_str(), parser, jobs);
+            if (!loaded) {
+                std::cout << line << ": " << loaded.error() << "\n";
+                return -1;
+            }
+            pm.run(parser._funcs, parser._arena);
+            jit::pack_instrs(parser._funcs, parser._arena);
+            prog = std::make_unique<jit::Program>(std::move(parser._funcs),
+                std::move(parser._globals), std::move(parser._arena), unroll_factor,
+                profile_points);
+            prog->_jit = use_jit;
+            jit::gdb_jit().add_program(*prog);
+            if (sample_us != 0) {
+                sampler.attach(*prog);
+            }
+            if (verify) {
+                auto verified = prog->verify();
+                if (!verified) {
+                    std::cerr << line << ": running unverified: " << verified.error()
+                              << "\n";
+                }
+            }
+        }
+        batch.push_back(prog.get());
+    }
+
+    auto pool = jit::ThreadPool(jobs);
+    if (sample_us != 0) {
+        sampler.start();
+    }
+    auto stats = async
+        ? jit::run_batch_async(batch, pool, slice, jit::stdout_sink()._direct)
+        : jit::run_batch(batch, pool, slice);
+    if (sample_us != 0) {
+        sampler.stop();
+        sampler.report(std::cerr);
+    }
+    std::cerr << "batch: " << stats._jobs << " jobs, " << stats._failed << " failed, "
+              << stats._seconds << "s, " << stats.jobs_per_sec() << " jobs/sec\n";
+    write_trace();
+    return stats._failed == 0 ? 0 : -1;
+}
+
 int main(int argc, char** argv) {
-    if (argc < 2) {
+    const char* path = nullptr;
+    std::string emit_ilb;
+    std::string batch;
+    // Fuel a single run gets, or a batch job gets per turn
+    int64_t fuel = 0;
+    int64_t slice = 0;
+    uint32_t unroll_factor = 4;
+    uint32_t profile_points = jit::PP_DEFAULT;
+    uint32_t jobs = std::max(1u, std::thread::hardware_concurrency());
+    bool verify = true;
+    bool use_jit = true;
+    bool async = false;
+    // Profile the run, the report goes to stderr and as JSON to `profile_json` if set
+    bool profile = false;
+    std::string profile_json;
+    // Sample where runs are every `sample_us`, the profile goes to stderr
+    uint32_t sample_us = 0;
+    // Print the runtime stats of every thread to stderr at the end
+    bool stats = false;
+    // Benchmark the programs of `bench` instead, results as JSON on stdout
+    std::string bench;
+    uint32_t bench_reps = 5;
+    // Time every phase on generated programs of up to `bench_scale` instructions instead
+    uint64_t bench_scale = 0;
+    auto pm = jit::PassManager();
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.starts_with("-O")) {
+            auto level = str_to_u32(arg.substr(2));
+            if (!level) {
+                std::cout << level.error() << "\n";
+                return -1;
+            }
+            auto res = pm.set_opt_level(*level);
+            if (!res) {
+                std::cout << res.error() << "\n";
+                return -1;
+            }
+        } else if (arg.starts_with("--passes=")) {
+            auto res = pm.add_passes(arg.substr(9));
+            if (!res) {
+                std::cout << res.error() << "\n";
+                return -1;
+            }
+        } else if (arg == "--time-passes") {
+            pm._time_passes = true;
+        } else if (arg.starts_with("--unroll=")) {
+            auto n = str_to_u32(arg.substr(9));
+            if (!n) {
+                std::cout << n.error() << "\n";
+                return -1;
+            }
+            unroll_factor = *n;
+        } else if (arg.starts_with("--jobs=")) {
+            auto n = str_to_u32(arg.substr(7));
+            if (!n) {
+                std::cout << n.error() << "\n";
+                return -1;
+            }
+            jobs = *n;
+        } else if (arg == "--no-verify") {
+            verify = false;
+        } else if (arg == "--no-jit") {
+            use_jit = false;
+        } else if (arg == "--profile" || arg.starts_with("--profile=")) {
+            profile = true;
+            profile_json = arg.size() > 10 ? arg.substr(10) : "";
+        } else if (arg == "--perf-map" || arg.starts_with("--perf-map=") ||
+                   arg == "--jitdump" || arg.starts_with("--jitdump=")) {
+            // Both go to /tmp unless given a directory, where `perf` looks by default
+            auto eq = arg.find('=');
+            auto dir = eq == std::string::npos ? "/tmp" : arg.substr(eq + 1);
+            auto res = jit::perf_map().open(dir, arg.starts_with("--jitdump"));
+            if (!res) {
+                std::cout << res.error() << "\n";
+                return -1;
+            }
+        } else if (arg == "--gdb-jit" || arg.starts_with("--gdb-jit=")) {
+            // The listing GDB shows lines of goes to the current directory by default
+            auto dir = arg.size() > 10 ? arg.substr(10) : ".";
+            auto res = jit::gdb_jit().open(dir);
+            if (!res) {
+                std::cout << res.error() << "\n";
+                return -1;
+            }
+        } else if (arg == "--sample" || arg.starts_with("--sample=")) {
+            auto n = arg.size() > 9 ? str_to_u32(arg.substr(9))
+                                    : tl::expected<uint32_t, jit::Error>(1000);
+            if (!n || *n == 0) {
+                std::cout << "--sample needs an interval in microseconds\n";
+                return -1;
+            }
+            sample_us = *n;
+        } else if (arg == "--stats") {
+            stats = true;
+        } else if (arg.starts_with("--trace=")) {
+            jit::tracer().open(arg.substr(8));
+        } else if (arg == "--async") {
+            async = true;
+        } else if (arg == "--direct-output") {
+            jit::stdout_sink()._direct = true;
+        } else if (arg.starts_with("--fuel=") || arg.starts_with("--slice=")) {
+            auto eq = arg.find('=');
+            auto n = str_to_u32(arg.substr(eq + 1));
+            if (!n) {
+                std::cout << n.error() << "\n";
+                return -1;
+            }
+            (arg.starts_with("--fuel=") ? fuel : slice) = *n;
+        } else if (arg.starts_with("--batch=")) {
+            batch = arg.substr(8);
+        } else if (arg.starts_with("--bench=")) {
+            bench = arg.substr(8);
+        } else if (arg.starts_with("--bench-reps=")) {
+            auto n = str_to_u32(arg.substr(13));
+            if (!n || *n == 0) {
+                std::cout << "--bench-reps needs a number of runs\n";
+                return -1;
+            }
+            bench_reps = *n;
+        } else if (arg == "--bench-scale" || arg.starts_with("--bench-scale=")) {
+            auto n = arg.size() > 14 ? str_to_u32(arg.substr(14))
+                                     : tl::expected<uint32_t, jit::Error>(10000000);
+            if (!n || *n < 1000) {
+                std::cout << "--bench-scale needs at least 1000 instructions\n";
+                return -1;
+            }
+            bench_scale = *n;
+        } else if (arg.starts_with("--generate=")) {
+            // The program goes to stdout, nothing else runs
+            auto shape = jit::parse_gen_shape(arg.substr(11));
+            if (!shape) {
+                std::cout << shape.error() << "\n";
+                return -1;
+            }
+            jit::generate_iloc(std::cout, *shape);
+            return 0;
+        } else if (arg.starts_with("--emit-ilb=")) {
+            emit_ilb = arg.substr(11);
+        } else if (arg.starts_with("--value-profile=")) {
+            auto points = jit::parse_profile_points(arg.substr(16));
+            if (!points) {
+                std::cout << points.error() << "\n";
+                return -1;
+            }
+            profile_points = *points;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (bench_scale != 0) {
+        auto runs = jit::run_scale_bench(bench_scale, std::cerr);
+        jit::report_scale(std::cerr, runs);
+        jit::report_scale_json(std::cout, runs);
+        write_trace();
+        auto failed = std::any_of(runs.begin(), runs.end(),
+            [](auto& run) { return !run._error.empty(); });
+        return failed ? -1 : 0;
+    }
+    if (!bench.empty()) {
+        auto programs = jit::bench_programs(bench);
+        if (programs.empty()) {
+            std::cout << "No programs to benchmark in " << bench << "\n";
+            return -1;
+        }
+        auto results = jit::run_bench(programs, bench_reps, std::cerr);
+        jit::report_bench(std::cerr, results);
+        jit::report_bench_json(std::cout, results);
+        write_trace();
+        auto failed = std::any_of(results.begin(), results.end(), [](auto& result) {
+            return !result._error.empty() || !result._output_matches;
+        });
+        return failed ? -1 : 0;
+    }
+    if (!batch.empty()) {
+        auto res = run_batch_file(batch, pm, jobs, unroll_factor, profile_points, verify,
+            use_jit, slice, async, sample_us);
+        if (stats) {
+            jit::collect_stats().print(std::cerr);
+        }
+        return res;
+    }
+    if (!path) {
         std::cout << "Need a file to read\n";
         return -1;
     }
 
-    std::ifstream file(argv[1]);
-
     auto parser = jit::Parser();
-    if (file.is_open()) {
-        std::string line;
-        while (std::getline(file, line)) {
-            auto strs = split<std::string>(line, " ");
-            auto& op = strs[0];
-            if (op.starts_with('.')) {
-                if (op.starts_with(".data")) {
-                    parser.start_data(new jit::DataInstr());
-                } else if (op.starts_with(".text")) {
-                    parser.start_text(new jit::TextInstr());
-                } else if (op.starts_with(".frame")) {
-                    try {
-                        std::vector<jit::Reg> params;
-                        for (size_t i = 3; i < strs.size(); i++) {
-                            auto p = strs[i].substr(0, strs[2].find_last_of(','));
-                            params.push_back(jit::Reg{ std::stoul(p, nullptr, 10) });
-                        }
-                        auto size = strs[2].substr(0, strs[2].find_last_of(','));
-                        auto name = strs[1].substr(0, strs[1].find_last_of(','));
-                        parser.push_frame(new jit::FrameInstr(name, std::stoul(size, nullptr, 10), params));
-                    } catch (const std::exception&) {
-                        std::cout << "Illegal argument to .frame instruction\n"
-                            << line << "\n";
-                        return -1;
-                    }
-                } else if (op.ends_with(':')) {
-                    parser.push_label(new jit::LabelInstr(op.substr(0, op.length() - 1)));
-                } else {
-                    std::cout << "INVALID INSTRUCTION WITH ." << line << "\n";
-                }
-            } else if (op.starts_with("loadI")) {
-                try {
-                    auto& s = strs[1];
-                    auto d = strs[3].substr(3);
-                    auto inst = new jit::LoadImmInstr(
-                        jit::Value{ (int64_t)std::stol(s, nullptr, 10) },
-                        std::stoul(d, nullptr, 10)
-                    );
-                    parser.push_instr(inst);
-                } catch (const std::exception&) {
-                    std::cout << "Illegal argument to loadI instruction\n"
-                        << line << "\n";
-                    return -1;
-                }
-            } else if (op.starts_with("i2i")) {
-                try {
-                    auto s = strs[1].substr(3);
-                    auto d = strs[3].substr(3);
-                    parser.push_instr(new jit::I2IInstr(std::stoul(s, nullptr, 10), std::stoul(d, nullptr, 10)));
-                } catch (const std::exception&) {
-                    std::cout << "Illegal argument to i2i instruction\n"
-                        << line << "\n";
-                    return -1;
-                }
-            } else if (op.starts_with("addI")) {
-                try {
-                    auto s1 = strs[1].substr(3, strs[1].find_last_of(','));
-                    auto s2 = strs[2].substr(0, strs[2].find_last_of(','));
-                    auto d = strs[4].substr(3);
-                    parser.push_instr(new jit::AddImmInstr(
-                        std::stoul(s1, nullptr, 10),
-                        jit::Value{ (int64_t)std::stol(s2, nullptr, 10) },
-                        std::stoul(d, nullptr, 10))
-                    );
-                } catch (const std::exception&) {
-                    std::cout << "Illegal argument to addI instruction\n"
-                        << line << "\n";
-                    return -1;
-                }
-            } else if (op.starts_with("add")) {
-                try {
-                    auto s1 = strs[1].substr(3, strs[1].find_last_of(','));
-                    auto s2 = strs[2].substr(3, strs[2].find_last_of(','));
-                    auto d = strs[4].substr(3);
-                    parser.push_instr(new jit::AddInstr(
-                        std::stoul(s1, nullptr, 10),
-                        std::stoul(s2, nullptr, 10),
-                        std::stoul(d, nullptr, 10))
-                    );
-                } catch (const std::exception&) {
-                    std::cout << "Illegal argument to add instruction\n"
-                        << line << "\n";
-                    return -1;
-                }
-            } else if (op.starts_with("multI")) {
-                try {
-                    auto s1 = strs[1].substr(3, strs[1].find_last_of(','));
-                    auto s2 = strs[2].substr(0, strs[2].find_last_of(','));
-                    auto d = strs[4].substr(3);
-                    parser.push_instr(new jit::MultImmInstr(
-                        std::stoul(s1, nullptr, 10),
-                        jit::Value{ (int64_t)std::stol(s2, nullptr, 10) },
-                        std::stoul(d, nullptr, 10))
-                    );
-                } catch (const std::exception&) {
-                    std::cout << "Illegal argument to multI instruction\n"
-                        << line << "\n";
-                    return -1;
-                }
-            } else if (op.starts_with("mult")) {
-                try {
-                    auto s1 = strs[1].substr(3, strs[1].find_last_of(','));
-                    auto s2 = strs[2].substr(3, strs[2].find_last_of(','));
-                    auto d = strs[4].substr(3);
-                    parser.push_instr(new jit::MultInstr(
-                        std::stoul(s1, nullptr, 10),
-                        std::stoul(s2, nullptr, 10),
-                        std::stoul(d, nullptr, 10))
-                    );
-                } catch (const std::exception&) {
-                    std::cout << "Illegal argument to mult instruction\n"
-                        << line << "\n";
-                    return -1;
-                }
-            } else if (op.starts_with("cmp_")) {
-                try {
-                    auto s1 = std::stoul(strs[1].substr(3, strs[1].find_last_of(',')), nullptr, 10);
-                    auto s2 = std::stoul(strs[2].substr(3, strs[2].find_last_of(',')), nullptr, 10);
-                    auto d = std::stoul(strs[4].substr(3), nullptr, 10);
-                    auto ctor = [=]() -> jit::Instruction* {
-                        if (op.ends_with("GE")) return new jit::CmpGEInstr(s1, s2, d);
-                        else if (op.ends_with("GT")) return new jit::CmpGTInstr(s1, s2, d);
-                        else if (op.ends_with("LT")) return new jit::CmpLTInstr(s1, s2, d);
-                        else if (op.ends_with("LE")) return new jit::CmpLEInstr(s1, s2, d);
-                        else return nullptr;
-                    };
-                    parser.push_instr(ctor());
-                } catch (const std::exception&) {
-                    std::cout << "Illegal argument to cmp instruction\n"
-                        << line << "\n";
-                    return -1;
-                }
-            } else if (op.starts_with("cbr")) {
-                try {
-                    auto s = strs[1].substr(3);
-                    auto d = strs[3];
-                    parser.push_instr(new jit::CbrInstr(
-                        std::stoul(s, nullptr, 10),
-                        jit::Value{ jit::ValKind::VK_LOCATION, d }
-                    ));
-                } catch (const std::exception&) {
-                    std::cout << "Illegal argument to cbr instruction\n"
-                        << line << "\n";
-                    return -1;
-                }
-            } else if (op.starts_with("iwrite")) {
-                try {
-                    auto s = strs[1].substr(3);
-                    parser.push_instr(new jit::IWriteInstr(std::stoul(s, nullptr, 10)));
-                } catch (const std::exception&) {
-                    std::cout << "Illegal argument to iwrite instruction\n"
-                        << line << "\n";
-                    return -1;
-                }
-            } else if (op.starts_with("ret")) {
-                parser.push_instr(new jit::RetInstr());
-            }
+    auto loaded = load_file(path, parser, jobs);
+    if (!loaded) {
+        std::cout << loaded.error() << "\n";
+        return -1;
+    }
+
+    pm.run(parser._funcs, parser._arena);
+
+    // Precompile only, the optimized program is written out instead of run
+    if (!emit_ilb.empty()) {
+        auto res = jit::write_ilb(emit_ilb.c_str(), parser._funcs, parser._globals);
+        if (!res) {
+            std::cout << res.error() << "\n";
+            return -1;
         }
-        parser.finalize_prog();
-        file.close();
+        write_trace();
+        return 0;
     }
 
-    auto interp = jit::Interpreter(std::move(parser._funcs), std::move(parser._globals));
-    auto res = interp.run();
+    jit::pack_instrs(parser._funcs, parser._arena);
+    auto prog = jit::Program(std::move(parser._funcs), std::move(parser._globals),
+        std::move(parser._arena), unroll_factor, profile_points);
+    prog._jit = use_jit;
+    // A program the verifier rejects still runs, with every check done as it goes
+    if (verify) {
+        auto verified = prog.verify();
+        if (!verified) {
+            std::cerr << "Running unverified: " << verified.error() << "\n";
+        }
+    }
+    prog.dump(std::cout);
+    jit::gdb_jit().add_program(prog);
+    auto profiler = jit::Profiler();
+    if (profile) {
+        profiler.attach(prog);
+    }
+    auto sampler = jit::Sampler(std::chrono::microseconds(sample_us));
+    if (sample_us != 0) {
+        sampler.attach(prog);
+        sampler.start();
+    }
+    auto ctx = jit::ExecutionContext(prog);
+    if (fuel != 0) {
+        ctx._fuel = fuel;
+    }
+    auto res = ctx.run();
+    write_trace();
+    if (sample_us != 0) {
+        sampler.stop();
+        sampler.report(std::cerr);
+    }
+    if (stats) {
+        jit::collect_stats().print(std::cerr);
+    }
+    if (profile) {
+        profiler.report(std::cerr);
+        if (!profile_json.empty()) {
+            std::ofstream json(profile_json);
+            profiler.report_json(json);
+            if (!json) {
+                std::cerr << "Failed to write " << profile_json << "\n";
+            }
+        }
+    }
     if (!res.has_value()) {
         std::cout << "Failed to return OK expected...\n" << res.error();
+    } else if (*res == jit::RS_OUT_OF_FUEL) {
+        std::cout << "Out of fuel in " << ctx._func_name << " " << ctx._block_name
+                  << "\n";
+        return -1;
     }
 }
@@ -0,0 +1,101 @@
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <Windows.h>
+
+#include "instrs.hpp"
+#include "output.hpp"
+#include "trace.hpp"
+
+namespace jit {
+
+void OutputSink::write_value(const Value& val) {
+	if (val._kind == ValKind::VK_INT) {
+		write_int(val.as_int());
+		return;
+	}
+	drain();
+	std::ostringstream os;
+	os << val << "\n";
+	auto text = os.str();
+	write_text(text.data(), text.size());
+}
+
+void OutputSink::drain() {
+	for (uint64_t i = 0; i < _num_pending; i++) {
+		if (_text_len + MAX_INT_TEXT > TEXT_SIZE) {
+			write_out();
+		}
+		auto res = std::to_chars(_text + _text_len, _text + TEXT_SIZE, _pending[i]);
+		*res.ptr = '\n';
+		_text_len = res.ptr + 1 - _text;
+	}
+	_num_pending = 0;
+}
+
+void OutputSink::write_text(const char* data, size_t len) {
+	if (_text_len + len > TEXT_SIZE) {
+		write_out();
+	}
+	// Too big to ever fit, this goes out on its own
+	if (len > TEXT_SIZE) {
+		if (_hold) {
+			_held.append(data, len);
+		} else {
+			write_stdout(data, len, _direct);
+		}
+		return;
+	}
+	memcpy(_text + _text_len, data, len);
+	_text_len += len;
+}
+
+void OutputSink::flush() {
+	drain();
+	write_out();
+}
+
+void OutputSink::write_out() {
+	if (_text_len == 0) {
+		return;
+	}
+	if (_hold) {
+		_held.append(_text, _text_len);
+	} else {
+		write_stdout(_text, _text_len, _direct);
+	}
+	_text_len = 0;
+}
+
+void write_stdout(const char* data, size_t len, bool direct) {
+	if (tracer().enabled()) {
+		tracer().instant("flush", "output", TraceArgs().add("bytes", (int64_t)len));
+	}
+	if (!direct) {
+		std::cout.write(data, len);
+		std::cout.flush();
+		return;
+	}
+	// Whatever `std::cout` still holds was written first
+	std::cout.flush();
+	auto out = GetStdHandle(STD_OUTPUT_HANDLE);
+	size_t done = 0;
+	while (done < len) {
+		DWORD wrote = 0;
+		auto left = (DWORD)(len - done);
+		if (!WriteFile(out, data + done, left, &wrote, nullptr) || wrote == 0) {
+			break;
+		}
+		done += wrote;
+	}
+}
+
+OutputSink& stdout_sink() {
+	static OutputSink sink;
+	return sink;
+}
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#include "instrs.hpp"
+
+namespace jit {
+
+// Where `iwrite` goes. Integers are queued as they are written and only formatted into
+// the text buffer in batches, the text goes out when it fills up and when the program
+// returns from `main`.
+//
+// Jitted code appends to `_pending` inline and only calls out to `drain` when it is full,
+// so `_num_pending` has to stay the first member.
+struct OutputSink {
+	static constexpr size_t PENDING_INTS = 4 * 1024;
+	static constexpr size_t TEXT_SIZE = 64 * 1024;
+	// Longest formatted integer plus its newline
+	static constexpr size_t MAX_INT_TEXT = 21;
+
+	uint64_t _num_pending = 0;
+	int64_t _pending[PENDING_INTS];
+
+	size_t _text_len = 0;
+	char _text[TEXT_SIZE];
+
+	// Write straight to the stdout handle instead of through `std::cout`
+	bool _direct = false;
+	// Keep the text that would go out in `_held` for the owner to write, so a run never
+	// blocks on the output
+	bool _hold = false;
+	std::string _held;
+
+	OutputSink() = default;
+	OutputSink(const OutputSink&) = delete;
+	OutputSink& operator=(const OutputSink&) = delete;
+
+	void write_int(int64_t x) {
+		if (_num_pending == PENDING_INTS) {
+			drain();
+		}
+		_pending[_num_pending] = x;
+		_num_pending += 1;
+	}
+
+	// Anything but an integer is rare enough to go through `operator<<`.
+	void write_value(const Value& val);
+
+	// Format the pending integers into the text buffer.
+	void drain();
+	// Drain and write out all the text.
+	void flush();
+
+	void write_text(const char* data, size_t len);
+	// Write out the text buffer without draining.
+	void write_out();
+	// Everything held so far, the sink holds nothing after.
+	std::string take_held() { return std::move(_held); }
+};
+
+// Write all of `data` to stdout, through `std::cout` unless `direct`.
+void write_stdout(const char* data, size_t len, bool direct);
+
+// The sink for the process stdout.
+OutputSink& stdout_sink();
+
+}
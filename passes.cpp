@@ -0,0 +1,604 @@
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+
+#include "passes.hpp"
+#include "expected.hpp"
+#include "trace.hpp"
+
+namespace jit {
+
+static bool ends_in_ret(const Block& blk) {
+	return !blk._instrs.empty() &&
+		   (op_info(blk._instrs.back()->_kind)._flags & OF_RETURN);
+}
+
+static void push_unique(std::vector<std::string>& v, const std::string& s) {
+	if (std::find(v.begin(), v.end(), s) == v.end()) {
+		v.push_back(s);
+	}
+}
+
+static void post_order(const CFG& cfg, const std::string& name,
+	std::set<std::string>& seen, std::vector<std::string>& out) {
+	seen.insert(name);
+	for (auto& succ : cfg._succs.at(name)) {
+		if (!seen.contains(succ)) {
+			post_order(cfg, succ, seen, out);
+		}
+	}
+	out.push_back(name);
+}
+
+CFG::CFG(const Function& func) {
+	for (auto& [name, blk] : func._blocks) {
+		auto& succs = _succs[name];
+		_preds[name];
+		for (auto* inst : blk._instrs) {
+			auto cbr = (CbrInstr*)inst;
+			if (cbr->_kind == InstrKind::IK_CBR &&
+				cbr->_dst._kind == ValKind::VK_LOCATION &&
+				func._blocks.contains(std::string(cbr->_dst.as_loc()))) {
+				push_unique(succs, std::string(cbr->_dst.as_loc()));
+			}
+		}
+		if (!ends_in_ret(blk) && func._blocks.contains(blk._fallthrough)) {
+			push_unique(succs, blk._fallthrough);
+		}
+	}
+	for (auto& [name, succs] : _succs) {
+		for (auto& succ : succs) {
+			_preds[succ].push_back(name);
+		}
+	}
+
+	if (func._blocks.contains("__start__")) {
+		std::set<std::string> seen;
+		post_order(*this, "__start__", seen, _rpo);
+		std::reverse(_rpo.begin(), _rpo.end());
+	}
+}
+
+// The iterative algorithm from "A Simple, Fast Dominance Algorithm" by Cooper, Harvey and
+// Kennedy.
+Dominators::Dominators(const CFG& cfg) {
+	if (cfg._rpo.empty()) {
+		return;
+	}
+	std::map<std::string, size_t> order;
+	for (size_t i = 0; i < cfg._rpo.size(); i++) {
+		order[cfg._rpo[i]] = i;
+	}
+
+	_idom[cfg._rpo[0]] = cfg._rpo[0];
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t i = 1; i < cfg._rpo.size(); i++) {
+			auto& name = cfg._rpo[i];
+			std::optional<std::string> new_idom;
+			for (auto& pred : cfg._preds.at(name)) {
+				if (!_idom.contains(pred)) {
+					continue;
+				}
+				if (!new_idom.has_value()) {
+					new_idom = pred;
+					continue;
+				}
+				auto f1 = pred;
+				auto f2 = *new_idom;
+				while (f1 != f2) {
+					while (order[f1] > order[f2]) {
+						f1 = _idom[f1];
+					}
+					while (order[f2] > order[f1]) {
+						f2 = _idom[f2];
+					}
+				}
+				new_idom = f1;
+			}
+			auto it = _idom.find(name);
+			if (new_idom.has_value() && (it == _idom.end() || it->second != *new_idom)) {
+				_idom[name] = *new_idom;
+				changed = true;
+			}
+		}
+	}
+}
+
+bool Dominators::dominates(const std::string& a, const std::string& b) const {
+	auto it = _idom.find(b);
+	if (it == _idom.end() || !_idom.contains(a)) {
+		return false;
+	}
+	auto curr = b;
+	while (curr != a) {
+		auto& idom = _idom.at(curr);
+		if (idom == curr) {
+			return false;
+		}
+		curr = idom;
+	}
+	return true;
+}
+
+// Step `live` backwards over `inst`, a `cbr` also keeps alive whatever its target reads.
+static void step_back(const Instruction* inst, std::set<Reg>& live,
+	const std::map<std::string, std::set<Reg>>& live_in, std::vector<Reg>& scratch) {
+	auto def = inst->def();
+	if (def.has_value()) {
+		live.erase(*def);
+	}
+	if (inst->_kind == InstrKind::IK_CBR) {
+		auto cbr = (CbrInstr*)inst;
+		if (cbr->_dst._kind == ValKind::VK_LOCATION) {
+			auto target = live_in.find(std::string(cbr->_dst.as_loc()));
+			if (target != live_in.end()) {
+				live.insert(target->second.begin(), target->second.end());
+			}
+		}
+	}
+	scratch.clear();
+	inst->uses(scratch);
+	live.insert(scratch.begin(), scratch.end());
+}
+
+Liveness::Liveness(const Function& func, const CFG& cfg) {
+	for (auto& [name, blk] : func._blocks) {
+		_live_in[name];
+		_live_out[name];
+	}
+
+	std::vector<Reg> scratch;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (auto it = cfg._rpo.rbegin(); it != cfg._rpo.rend(); it++) {
+			auto& blk = func._blocks.at(*it);
+			// `_live_out` is what is live when falling off the end of the block, the
+			// successors reached through a `cbr` are merged in at the branch itself
+			std::set<Reg> live;
+			if (!ends_in_ret(blk) && func._blocks.contains(blk._fallthrough)) {
+				live = _live_in[blk._fallthrough];
+			}
+			_live_out[*it] = live;
+			for (auto inst = blk._instrs.rbegin(); inst != blk._instrs.rend(); inst++) {
+				step_back(*inst, live, _live_in, scratch);
+			}
+			if (live != _live_in[*it]) {
+				_live_in[*it] = std::move(live);
+				changed = true;
+			}
+		}
+	}
+}
+
+// Fold the instructions of `blk` whose operands are known constants, `known` holds the
+// constants live into the block. Only constants that fit an immediate become addI/multI
+// operands, wider ones stay in a register.
+static bool fold_block(Block& blk, std::map<Reg, int64_t> known, InstrArena& arena) {
+	auto lookup = [&](const Reg& r) -> std::optional<int64_t> {
+		auto it = known.find(r);
+		if (it == known.end()) {
+			return std::nullopt;
+		}
+		return it->second;
+	};
+
+	bool changed = false;
+	std::vector<Reg> srcs;
+	for (auto& inst : blk._instrs) {
+		srcs.clear();
+		inst->uses(srcs);
+
+		std::optional<int64_t> val;
+		Instruction* repl = nullptr;
+		switch (inst->_kind) {
+			case InstrKind::IK_LOADIMM: {
+				auto load = (LoadImmInstr*)inst;
+				if (load->_src._kind == ValKind::VK_INT) {
+					val = load->_src.as_int();
+				}
+				break;
+			}
+			case InstrKind::IK_I2I: {
+				val = lookup(srcs[0]);
+				break;
+			}
+			case InstrKind::IK_ADDIMM: {
+				auto add = (AddImmInstr*)inst;
+				auto a = lookup(add->_src1);
+				if (a.has_value() && add->_src2._kind == ValKind::VK_INT) {
+					val = (int64_t)((uint64_t)*a + (uint64_t)add->_src2.as_int());
+				}
+				break;
+			}
+			case InstrKind::IK_MULTIMM: {
+				auto mult = (MultImmInstr*)inst;
+				auto a = lookup(mult->_src1);
+				if (a.has_value() && mult->_src2._kind == ValKind::VK_INT) {
+					val = (int64_t)((uint64_t)*a * (uint64_t)mult->_src2.as_int());
+				}
+				break;
+			}
+			case InstrKind::IK_ADD: {
+				auto a = lookup(srcs[0]);
+				auto b = lookup(srcs[1]);
+				if (a.has_value() && b.has_value()) {
+					val = (int64_t)((uint64_t)*a + (uint64_t)*b);
+				} else if (a.has_value() && fits_imm32(*a)) {
+					repl = arena.make<AddImmInstr>(srcs[1], Value{*a}, *inst->def());
+				} else if (b.has_value() && fits_imm32(*b)) {
+					repl = arena.make<AddImmInstr>(srcs[0], Value{*b}, *inst->def());
+				}
+				break;
+			}
+			case InstrKind::IK_MULT: {
+				auto a = lookup(srcs[0]);
+				auto b = lookup(srcs[1]);
+				if (a.has_value() && b.has_value()) {
+					val = (int64_t)((uint64_t)*a * (uint64_t)*b);
+				} else if (a.has_value() && fits_imm32(*a)) {
+					repl = arena.make<MultImmInstr>(srcs[1], Value{*a}, *inst->def());
+				} else if (b.has_value() && fits_imm32(*b)) {
+					repl = arena.make<MultImmInstr>(srcs[0], Value{*b}, *inst->def());
+				}
+				break;
+			}
+			case InstrKind::IK_CMP_GT:
+			case InstrKind::IK_CMP_GE:
+			case InstrKind::IK_CMP_LT:
+			case InstrKind::IK_CMP_LE: {
+				auto a = lookup(srcs[0]);
+				auto b = lookup(srcs[1]);
+				if (a.has_value() && b.has_value()) {
+					auto k = inst->_kind;
+					val = k == InstrKind::IK_CMP_GT	  ? *a > *b
+						  : k == InstrKind::IK_CMP_GE ? *a >= *b
+						  : k == InstrKind::IK_CMP_LT ? *a < *b
+													  : *a <= *b;
+				}
+				break;
+			}
+			default: {
+				break;
+			}
+		}
+
+		auto def = inst->def();
+		if (val.has_value() && inst->_kind != InstrKind::IK_LOADIMM) {
+			repl = arena.make<LoadImmInstr>(Value{*val}, *def);
+		}
+		if (repl) {
+			inst = repl;
+			changed = true;
+		}
+		if (def.has_value()) {
+			if (val.has_value()) {
+				known.insert_or_assign(*def, *val);
+			} else {
+				known.erase(*def);
+			}
+		}
+	}
+	return changed;
+}
+
+static bool const_fold(Function& func, PassManager& pm) {
+	bool changed = false;
+	for (auto& [name, blk] : func._blocks) {
+		changed |= fold_block(blk, {}, *pm._arena);
+	}
+	return changed;
+}
+
+// Constants defined once in a block that dominates the use are folded as well.
+static bool global_const(Function& func, PassManager& pm) {
+	auto& cfg = pm.cfg(func);
+	auto& doms = pm.dominators(func);
+
+	std::map<Reg, std::pair<std::string, std::optional<int64_t>>> defs;
+	std::set<Reg> rewritten;
+	for (auto& [name, blk] : func._blocks) {
+		for (auto* inst : blk._instrs) {
+			auto def = inst->def();
+			if (!def.has_value()) {
+				continue;
+			}
+			if (defs.contains(*def)) {
+				rewritten.insert(*def);
+			}
+			auto load = (LoadImmInstr*)inst;
+			std::optional<int64_t> val;
+			if (load->_kind == InstrKind::IK_LOADIMM &&
+				load->_src._kind == ValKind::VK_INT) {
+				val = load->_src.as_int();
+			}
+			defs.insert_or_assign(*def, std::pair{name, val});
+		}
+	}
+
+	bool changed = false;
+	for (auto& name : cfg._rpo) {
+		std::map<Reg, int64_t> known;
+		for (auto& [reg, def] : defs) {
+			auto& [def_blk, val] = def;
+			if (val.has_value() && !rewritten.contains(reg) && def_blk != name &&
+				doms.dominates(def_blk, name)) {
+				known[reg] = *val;
+			}
+		}
+		changed |= fold_block(func._blocks.at(name), std::move(known), *pm._arena);
+	}
+	return changed;
+}
+
+// Forward the source of `i2i` moves to later reads in the same block.
+static bool copy_prop(Function& func, PassManager&) {
+	bool changed = false;
+	std::vector<Reg*> slots;
+	for (auto& [name, blk] : func._blocks) {
+		// dst -> src of every move still valid at this point
+		std::map<Reg, Reg> copies;
+		for (auto* inst : blk._instrs) {
+			slots.clear();
+			inst->use_slots(slots);
+			for (auto* r : slots) {
+				auto it = copies.find(*r);
+				if (it != copies.end()) {
+					*r = it->second;
+					changed = true;
+				}
+			}
+
+			auto def = inst->def();
+			if (!def.has_value()) {
+				continue;
+			}
+			std::erase_if(copies, [&](const auto& p) {
+				return p.first == *def || p.second == *def;
+			});
+			if (inst->_kind == InstrKind::IK_I2I) {
+				auto mov = (I2IInstr*)inst;
+				if (!(mov->_src == mov->_dst)) {
+					copies.insert_or_assign(mov->_dst, mov->_src);
+				}
+			}
+		}
+	}
+	return changed;
+}
+
+// Remove instructions whose result is never read.
+static bool dead_code(Function& func, PassManager& pm) {
+	auto& cfg = pm.cfg(func);
+	auto& live = pm.liveness(func);
+
+	bool changed = false;
+	std::vector<Reg> scratch;
+	for (auto& name : cfg._rpo) {
+		auto& blk = func._blocks.at(name);
+		auto alive = live._live_out.at(name);
+		std::vector<Instruction*> kept;
+		for (auto it = blk._instrs.rbegin(); it != blk._instrs.rend(); it++) {
+			auto def = (*it)->def();
+			bool pure = op_info((*it)->_kind)._flags & OF_PURE;
+			if (pure && def.has_value() && !alive.contains(*def)) {
+				changed = true;
+				continue;
+			}
+			step_back(*it, alive, live._live_in, scratch);
+			kept.push_back(*it);
+		}
+		std::reverse(kept.begin(), kept.end());
+		blk._instrs = std::move(kept);
+	}
+	return changed;
+}
+
+// Blocks entered less than 1/COLD_RATIO as often as the hottest block of their function
+// are moved to the cold section.
+static constexpr uint64_t COLD_RATIO = 100;
+
+// Chain blocks along the hottest edges first, in the style of Pettis and Hansen, so the
+// likely successor of a block is placed right after it.
+void layout_blocks(Function& func) {
+	struct Edge {
+		uint64_t _count;
+		std::string _src;
+		std::string _dst;
+	};
+	std::vector<Edge> edges;
+	uint64_t hottest = 0;
+	for (auto& [name, blk] : func._blocks) {
+		hottest = std::max<uint64_t>(hottest, blk._exec_count);
+		// Every successor has a slot, only the edges taken so far count
+		for (auto& [succ, count] : blk._edge_counts) {
+			if (count != 0 && succ != name && succ != "__start__" &&
+				func._blocks.contains(succ)) {
+				edges.push_back(Edge{count, name, succ});
+			}
+		}
+	}
+	std::stable_sort(edges.begin(), edges.end(),
+		[](const Edge& a, const Edge& b) { return a._count > b._count; });
+
+	std::vector<std::vector<std::string>> chains;
+	std::map<std::string, size_t> chain_of;
+	for (auto& [name, blk] : func._blocks) {
+		chain_of[name] = chains.size();
+		chains.push_back({name});
+	}
+	for (auto& edge : edges) {
+		auto a = chain_of[edge._src];
+		auto b = chain_of[edge._dst];
+		if (a == b || chains[a].back() != edge._src || chains[b].front() != edge._dst) {
+			continue;
+		}
+		for (auto& name : chains[b]) {
+			chain_of[name] = a;
+			chains[a].push_back(name);
+		}
+		chains[b].clear();
+	}
+
+	// The entry chain goes first then the rest by their hottest block
+	auto heat = [&](size_t chain) {
+		uint64_t max = 0;
+		for (auto& name : chains[chain]) {
+			max = std::max<uint64_t>(max, func._blocks.at(name)._exec_count);
+		}
+		return max;
+	};
+	auto entry = chain_of.contains("__start__") ? chain_of["__start__"] : chains.size();
+	std::vector<size_t> order;
+	for (size_t i = 0; i < chains.size(); i++) {
+		if (!chains[i].empty()) {
+			order.push_back(i);
+		}
+	}
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		if (a == entry || b == entry) {
+			return a == entry && b != entry;
+		}
+		return heat(a) > heat(b);
+	});
+
+	std::vector<std::string> cold;
+	func._layout.clear();
+	for (auto chain : order) {
+		for (auto& name : chains[chain]) {
+			auto& blk = func._blocks.at(name);
+			blk._cold = (uint64_t)blk._exec_count * COLD_RATIO < hottest;
+			(blk._cold ? cold : func._layout).push_back(name);
+		}
+	}
+	func._layout.insert(func._layout.end(), cold.begin(), cold.end());
+}
+
+static const Pass PASSES[] = {
+	{"constfold", const_fold, AK_CFG | AK_DOMINATORS},
+	{"gconst", global_const, AK_CFG | AK_DOMINATORS},
+	{"copyprop", copy_prop, AK_CFG | AK_DOMINATORS},
+	{"dce", dead_code, AK_CFG | AK_DOMINATORS},
+};
+
+static constexpr const char* OPT_LEVELS[] = {
+	"",
+	"constfold,copyprop,dce",
+	"constfold,copyprop,gconst,copyprop,dce",
+};
+
+size_t count_instrs(const std::map<std::string, Function>& funcs) {
+	size_t count = 0;
+	for (auto& [fname, func] : funcs) {
+		for (auto& [bname, blk] : func._blocks) {
+			count += blk._instrs.size();
+		}
+	}
+	return count;
+}
+
+const CFG& PassManager::cfg(Function& func) {
+	auto& cache = _cache[func._name];
+	if (!cache._cfg.has_value()) {
+		cache._cfg.emplace(func);
+	}
+	return *cache._cfg;
+}
+
+const Dominators& PassManager::dominators(Function& func) {
+	auto& cache = _cache[func._name];
+	if (!cache._doms.has_value()) {
+		cache._doms.emplace(cfg(func));
+	}
+	return *cache._doms;
+}
+
+const Liveness& PassManager::liveness(Function& func) {
+	auto& cache = _cache[func._name];
+	if (!cache._live.has_value()) {
+		cache._live.emplace(func, cfg(func));
+	}
+	return *cache._live;
+}
+
+void PassManager::invalidate(Function& func, uint32_t preserved) {
+	auto& cache = _cache[func._name];
+	// Everything else is built on top of the CFG
+	if (!(preserved & AK_CFG)) {
+		preserved = 0;
+	}
+	if (!(preserved & AK_DOMINATORS)) {
+		cache._doms.reset();
+	}
+	if (!(preserved & AK_LIVENESS)) {
+		cache._live.reset();
+	}
+	if (!(preserved & AK_CFG)) {
+		cache._cfg.reset();
+	}
+}
+
+tl::expected<void, Error> PassManager::add_passes(std::string_view names) {
+	while (!names.empty()) {
+		auto end = names.find(',');
+		auto name = names.substr(0, end);
+		names = end == std::string_view::npos ? "" : names.substr(end + 1);
+		if (name.empty()) {
+			continue;
+		}
+
+		auto pass = std::find_if(std::begin(PASSES), std::end(PASSES),
+			[&](const Pass& p) { return name == p._name; });
+		if (pass == std::end(PASSES)) {
+			return tl::make_unexpected(
+				Error(ErrorKind::EK_INVALID_ARG, "unknown pass " + std::string(name)));
+		}
+		_pipeline.push_back(pass);
+	}
+	return tl::expected<void, Error>();
+}
+
+tl::expected<void, Error> PassManager::set_opt_level(uint32_t level) {
+	if (level >= std::size(OPT_LEVELS)) {
+		return tl::make_unexpected(Error(ErrorKind::EK_INVALID_ARG,
+			"no optimization level " + std::to_string(level)));
+	}
+	_pipeline.clear();
+	return add_passes(OPT_LEVELS[level]);
+}
+
+void PassManager::run(std::map<std::string, Function>& funcs, InstrArena& arena) {
+	_arena = &arena;
+	auto passes_scope = TraceScope("passes", "load");
+	for (auto* pass : _pipeline) {
+		auto before = count_instrs(funcs);
+		auto start = std::chrono::steady_clock::now();
+		auto scope = TraceScope("pass", "load");
+		for (auto& [name, func] : funcs) {
+			if (pass->_run(func, *this)) {
+				invalidate(func, pass->_preserves);
+			}
+		}
+		if (scope._on) {
+			scope._args.add("name", pass->_name)
+				.add("instrs_before", before)
+				.add("instrs_after", count_instrs(funcs));
+		}
+		std::chrono::duration<double, std::milli> elapsed =
+			std::chrono::steady_clock::now() - start;
+
+		if (_time_passes) {
+			auto after = count_instrs(funcs);
+			std::cerr << "pass " << pass->_name << ": " << elapsed.count() << "ms, "
+					  << before << " -> " << after << " instrs ("
+					  << (int64_t)after - (int64_t)before << ")\n";
+		}
+	}
+	// The cache is by function name, the next program run through here has its own
+	_cache.clear();
+	_arena = nullptr;
+}
+
+}
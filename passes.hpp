@@ -0,0 +1,94 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+
+#include "expected.hpp"
+#include "instrs.hpp"
+#include "interp.hpp"
+
+namespace jit {
+
+enum AnalysisKind {
+	AK_CFG = 1 << 0,
+	AK_DOMINATORS = 1 << 1,
+	AK_LIVENESS = 1 << 2,
+
+	AK_ALL = AK_CFG | AK_DOMINATORS | AK_LIVENESS
+};
+
+struct CFG {
+	std::map<std::string, std::vector<std::string>> _succs;
+	std::map<std::string, std::vector<std::string>> _preds;
+	// Reachable blocks in reverse post order starting at `__start__`
+	std::vector<std::string> _rpo;
+
+	CFG(const Function& func);
+};
+
+struct Dominators {
+	// Immediate dominator of every reachable block, `__start__` maps to itself
+	std::map<std::string, std::string> _idom;
+
+	Dominators(const CFG& cfg);
+
+	bool dominates(const std::string& a, const std::string& b) const;
+};
+
+struct Liveness {
+	std::map<std::string, std::set<Reg>> _live_in;
+	std::map<std::string, std::set<Reg>> _live_out;
+
+	Liveness(const Function& func, const CFG& cfg);
+};
+
+// Analyses computed for one function, each is filled in lazily.
+struct AnalysisCache {
+	std::optional<CFG> _cfg;
+	std::optional<Dominators> _doms;
+	std::optional<Liveness> _live;
+};
+
+struct PassManager;
+
+struct Pass {
+	const char* _name;
+	// Returns true if the function changed
+	bool (*_run)(Function& func, PassManager& pm);
+	// The `AnalysisKind`s still valid after this pass changed a function
+	uint32_t _preserves;
+};
+
+struct PassManager {
+	std::vector<const Pass*> _pipeline;
+	std::map<std::string, AnalysisCache> _cache;
+	// Print wall time and instruction count change of every pass
+	bool _time_passes = false;
+	// Where passes allocate replacement instructions, set for the duration of `run`
+	InstrArena* _arena = nullptr;
+
+	const CFG& cfg(Function& func);
+	const Dominators& dominators(Function& func);
+	const Liveness& liveness(Function& func);
+	void invalidate(Function& func, uint32_t preserved);
+
+	// Add the comma separated passes in `names` to the pipeline.
+	tl::expected<void, Error> add_passes(std::string_view names);
+	// Set the pipeline to the one for `-O<level>`.
+	tl::expected<void, Error> set_opt_level(uint32_t level);
+
+	void run(std::map<std::string, Function>& funcs, InstrArena& arena);
+};
+
+// Order the blocks of `func` for native code placement using the edge profile, this fills
+// in `Function::_layout` and `Block::_cold`. Only the JIT calls this, when a function
+// tiers up and its profile means something, so it is not one of the load time passes.
+void layout_blocks(Function& func);
+
+size_t count_instrs(const std::map<std::string, Function>& funcs);
+
+}
@@ -0,0 +1,106 @@
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include <Windows.h>
+
+#include "perfmap.hpp"
+
+namespace jit {
+
+// The jitdump layout, see tools/perf/Documentation/jitdump-specification.txt in Linux
+static constexpr uint32_t JITDUMP_MAGIC = 0x4A695444;
+static constexpr uint32_t JITDUMP_VERSION = 1;
+static constexpr uint32_t ELF_MACHINE_X86_64 = 62;
+static constexpr uint32_t JIT_CODE_LOAD = 0;
+
+struct JitdumpHeader {
+	uint32_t _magic;
+	uint32_t _version;
+	uint32_t _total_size;
+	uint32_t _elf_mach;
+	uint32_t _pad1;
+	uint32_t _pid;
+	uint64_t _timestamp;
+	uint64_t _flags;
+};
+
+struct JitdumpRecord {
+	uint32_t _id;
+	uint32_t _total_size;
+	uint64_t _timestamp;
+};
+
+// Followed by the name with its terminator and then the code
+struct JitdumpCodeLoad {
+	JitdumpRecord _record;
+	uint32_t _pid;
+	uint32_t _tid;
+	uint64_t _vma;
+	uint64_t _code_addr;
+	uint64_t _code_size;
+	uint64_t _code_index;
+};
+
+// `perf inject` matches these against the sample times, record with `-k mono`
+static uint64_t timestamp() {
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+tl::expected<void, Error> PerfMap::open(const std::string& dir, bool jitdump) {
+	std::lock_guard lock(_lock);
+	auto pid = std::to_string(GetCurrentProcessId());
+	auto map_path = dir + "/perf-" + pid + ".map";
+	_map.open(map_path, std::ios::trunc);
+	if (!_map.is_open()) {
+		return tl::make_unexpected(
+			Error(ErrorKind::EK_IO, "failed to create " + map_path));
+	}
+	if (!jitdump) {
+		return tl::expected<void, Error>();
+	}
+
+	auto dump_path = dir + "/jit-" + pid + ".dump";
+	_dump.open(dump_path, std::ios::binary | std::ios::trunc);
+	if (!_dump.is_open()) {
+		return tl::make_unexpected(
+			Error(ErrorKind::EK_IO, "failed to create " + dump_path));
+	}
+	auto header = JitdumpHeader{JITDUMP_MAGIC, JITDUMP_VERSION, sizeof(JitdumpHeader),
+		ELF_MACHINE_X86_64, 0, (uint32_t)GetCurrentProcessId(), timestamp(), 0};
+	_dump.write((const char*)&header, sizeof(header));
+	_dump.flush();
+	return tl::expected<void, Error>();
+}
+
+void PerfMap::add_code(const uint8_t* code, size_t size, std::string_view name) {
+	if (!enabled() || size == 0) {
+		return;
+	}
+	std::lock_guard lock(_lock);
+	// Written out right away, a crash should not lose the names of the code it was in
+	_map << std::hex << (uintptr_t)code << " " << size << std::dec << " " << name << "\n";
+	_map.flush();
+	if (!_dump.is_open()) {
+		return;
+	}
+
+	auto total = sizeof(JitdumpCodeLoad) + name.size() + 1 + size;
+	auto load = JitdumpCodeLoad{{JIT_CODE_LOAD, (uint32_t)total, timestamp()},
+		(uint32_t)GetCurrentProcessId(), (uint32_t)GetCurrentThreadId(), (uint64_t)code,
+		(uint64_t)code, size, _code_index};
+	_code_index += 1;
+	_dump.write((const char*)&load, sizeof(load));
+	_dump.write(name.data(), (std::streamsize)name.size());
+	_dump.put('\0');
+	_dump.write((const char*)code, (std::streamsize)size);
+	_dump.flush();
+}
+
+PerfMap& perf_map() {
+	static PerfMap map;
+	return map;
+}
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "expected.hpp"
+#include "interp.hpp"
+
+namespace jit {
+
+// Names jitted code for `perf`, which otherwise only sees anonymous addresses. The perf
+// map is a line of start, size and name per code region in `<dir>/perf-<pid>.map`. The
+// jitdump in `<dir>/jit-<pid>.dump` has the code bytes as well, so after
+// `perf inject --jit` samples can be annotated down to the instruction.
+//
+// Every program compiling code writes here, so this is shared by the process.
+struct PerfMap {
+	std::mutex _lock;
+	std::ofstream _map;
+	std::ofstream _dump;
+	// Counts the code regions written to the jitdump
+	uint64_t _code_index = 0;
+
+	// Start writing the perf map and, with `jitdump`, the jitdump to `dir`.
+	tl::expected<void, Error> open(const std::string& dir, bool jitdump);
+	bool enabled() const { return _map.is_open(); }
+
+	// Name the `size` bytes of jitted code at `code`.
+	void add_code(const uint8_t* code, size_t size, std::string_view name);
+};
+
+// The one for this process, nothing is written until it is opened.
+PerfMap& perf_map();
+
+}
@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <string_view>
+#include <tuple>
+
+#include "profiler.hpp"
+#include "interp.hpp"
+#include "trace.hpp"
+
+namespace jit {
+
+uint64_t BlockProfile::instrs_run() const {
+	uint64_t total = _native_runs * _blk->_instrs.size();
+	for (auto& count : _instr_counts) {
+		total += count;
+	}
+	return total;
+}
+
+void Profiler::attach(Program& prog) {
+	for (auto& [fname, func] : prog._funcs) {
+		for (auto& [bname, blk] : func._blocks) {
+			auto& profile = _blocks.emplace_back();
+			profile._func = fname;
+			profile._blk = &blk;
+			profile._instr_counts.resize(blk._instrs.size());
+			blk._profile = &profile;
+		}
+	}
+	prog._profiler = this;
+}
+
+static double to_ms(uint64_t ns) {
+	return ns / 1e6;
+}
+
+// Instructions of the program by interpreted runs, hottest first
+static std::vector<std::tuple<uint64_t, const BlockProfile*, size_t>> hot_instrs(
+	const std::deque<BlockProfile>& blocks) {
+	std::vector<std::tuple<uint64_t, const BlockProfile*, size_t>> instrs;
+	for (auto& blk : blocks) {
+		for (size_t i = 0; i < blk._instr_counts.size(); i++) {
+			if (blk._instr_counts[i] != 0) {
+				instrs.emplace_back(blk._instr_counts[i], &blk, i);
+			}
+		}
+	}
+	std::stable_sort(instrs.begin(), instrs.end(),
+		[](const auto& a, const auto& b) { return std::get<0>(a) > std::get<0>(b); });
+	return instrs;
+}
+
+// Blocks that ran at all, by instructions run
+static std::vector<std::pair<uint64_t, const BlockProfile*>> hot_blocks(
+	const std::deque<BlockProfile>& blocks) {
+	std::vector<std::pair<uint64_t, const BlockProfile*>> hot;
+	for (auto& blk : blocks) {
+		auto run = blk.instrs_run();
+		if (run != 0 || blk._jit_exits != 0) {
+			hot.emplace_back(run, &blk);
+		}
+	}
+	std::stable_sort(hot.begin(), hot.end(),
+		[](const auto& a, const auto& b) { return a.first > b.first; });
+	return hot;
+}
+
+void Profiler::report(std::ostream& os, size_t top) const {
+	auto blocks = hot_blocks(_blocks);
+	uint64_t total = 0;
+	for (auto& [run, blk] : blocks) {
+		total += run;
+	}
+	auto native = std::min(_native_ns.load(), _run_ns.load());
+	auto compile = std::min(_compile_ns.load(), _run_ns - native);
+	os << "profile: " << total << " instrs, " << to_ms(_run_ns) << "ms run, "
+	   << to_ms(_run_ns - native - compile) << "ms interpreted, " << to_ms(native)
+	   << "ms native, " << to_ms(compile) << "ms compiling\n";
+
+	os << "hot blocks:\n";
+	os << "  " << std::setw(6) << "%" << std::setw(14) << "instrs" << std::setw(12)
+	   << "interp" << std::setw(12) << "native" << std::setw(10) << "entries"
+	   << std::setw(10) << "exits" << std::setw(8) << "deopts"
+	   << "  block\n";
+	for (size_t i = 0; i < blocks.size() && i < top; i++) {
+		auto& [run, blk] = blocks[i];
+		os << "  " << std::setw(6) << std::fixed << std::setprecision(2)
+		   << (total ? run * 100.0 / total : 0) << std::setw(14) << run << std::setw(12)
+		   << blk->_interp_runs << std::setw(12) << blk->_native_runs << std::setw(10)
+		   << blk->_jit_entries << std::setw(10) << blk->_jit_exits << std::setw(8)
+		   << blk->_deopts << "  " << blk->_func << ":" << blk->_blk->_name << "\n";
+	}
+
+	auto instrs = hot_instrs(_blocks);
+	os << "hot interpreted instructions:\n";
+	for (size_t i = 0; i < instrs.size() && i < top; i++) {
+		auto& [count, blk, idx] = instrs[i];
+		os << "  " << std::setw(14) << count << "  " << blk->_func << ":"
+		   << blk->_blk->_name << "#" << idx << "  " << *blk->_blk->_instrs[idx] << "\n";
+	}
+	os << std::defaultfloat;
+}
+
+void Profiler::report_json(std::ostream& os) const {
+	os << "{\n";
+	os << "  \"run_ms\": " << to_ms(_run_ns) << ",\n";
+	os << "  \"native_ms\": " << to_ms(_native_ns) << ",\n";
+	os << "  \"compile_ms\": " << to_ms(_compile_ns) << ",\n";
+	os << "  \"blocks\": [";
+	auto blocks = hot_blocks(_blocks);
+	for (size_t i = 0; i < blocks.size(); i++) {
+		auto& [run, blk] = blocks[i];
+		os << (i ? ",\n" : "\n") << "    {\"func\": " << json_string(blk->_func)
+		   << ", \"block\": " << json_string(blk->_blk->_name) << ", \"instrs\": " << run
+		   << ", \"interp_runs\": " << blk->_interp_runs
+		   << ", \"native_runs\": " << blk->_native_runs
+		   << ", \"jit_entries\": " << blk->_jit_entries
+		   << ", \"jit_exits\": " << blk->_jit_exits << ", \"deopts\": " << blk->_deopts
+		   << ", \"instr_counts\": [";
+		for (size_t j = 0; j < blk->_instr_counts.size(); j++) {
+			os << (j ? ", " : "") << blk->_instr_counts[j];
+		}
+		os << "]}";
+	}
+	os << "\n  ],\n";
+
+	os << "  \"instrs\": [";
+	auto instrs = hot_instrs(_blocks);
+	for (size_t i = 0; i < instrs.size(); i++) {
+		auto& [count, blk, idx] = instrs[i];
+		std::ostringstream text;
+		text << *blk->_blk->_instrs[idx];
+		os << (i ? ",\n" : "\n") << "    {\"func\": " << json_string(blk->_func)
+		   << ", \"block\": " << json_string(blk->_blk->_name) << ", \"index\": " << idx
+		   << ", \"count\": " << count << ", \"text\": " << json_string(text.str())
+		   << "}";
+	}
+	os << "\n  ]\n}\n";
+}
+
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "instrs.hpp"
+#include "interp.hpp"
+
+namespace jit {
+
+// What one block did over every run of the program.
+struct BlockProfile {
+	std::string _func;
+	const Block* _blk;
+	// Times the interpreter ran it and times native code did, native code counts itself
+	Relaxed<uint64_t> _interp_runs;
+	Relaxed<uint64_t> _native_runs;
+	// Times native code was entered here, left for here and thrown away after a guard
+	// failed here
+	Relaxed<uint64_t> _jit_entries;
+	Relaxed<uint64_t> _jit_exits;
+	Relaxed<uint64_t> _deopts;
+	// Runs of each instruction by the interpreter
+	std::vector<Relaxed<uint64_t>> _instr_counts;
+
+	// Instructions run in this block by either tier, native runs count every one.
+	uint64_t instrs_run() const;
+};
+
+// Opt-in profile of where a program spends its time. Only programs with a profiler take
+// the profiling interpreter loop and emit counting code, others never touch any of it.
+struct Profiler {
+	std::deque<BlockProfile> _blocks;
+	// Nanoseconds spent running, in native code and compiling, summed over all threads
+	std::atomic<uint64_t> _run_ns = 0;
+	std::atomic<uint64_t> _native_ns = 0;
+	std::atomic<uint64_t> _compile_ns = 0;
+
+	// Give every block of `prog` a profile, before anything of it runs.
+	void attach(Program& prog);
+
+	// Blocks and instructions hottest first, by instructions run.
+	void report(std::ostream& os, size_t top = 20) const;
+	void report_json(std::ostream& os) const;
+};
+
+}
@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <iomanip>
+
+#include "sampler.hpp"
+
+namespace jit {
+
+static_assert(alignof(Block) >= ST_COUNT, "tiers go in the low bits of a Block*");
+
+static const char* TIER_NAMES[ST_COUNT] = {"other", "interp", "native", "compile"};
+
+uint64_t BlockSamples::total() const {
+	uint64_t total = 0;
+	for (auto count : _tiers) {
+		total += count;
+	}
+	return total;
+}
+
+Sampler::~Sampler() {
+	stop();
+	for (auto& [id, thread] : _threads) {
+		CloseHandle(thread);
+	}
+}
+
+void Sampler::attach(Program& prog) {
+	std::lock_guard lock(_lock);
+	for (auto& [fname, func] : prog._funcs) {
+		for (auto& [bname, blk] : func._blocks) {
+			_blocks[&blk]._name = fname + ":" + bname;
+		}
+	}
+	prog._sampler = this;
+}
+
+void Sampler::start() {
+	_thread = std::thread([this] { sample_loop(); });
+}
+
+void Sampler::stop() {
+	{
+		std::lock_guard lock(_lock);
+		_stop = true;
+	}
+	_wake.notify_one();
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+}
+
+void Sampler::add(const ExecutionContext* ctx) {
+	auto id = GetCurrentThreadId();
+	std::lock_guard lock(_lock);
+	auto& thread = _threads[id];
+	if (!thread) {
+		thread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT, FALSE, id);
+	}
+	_running.push_back(Running{ctx, thread});
+}
+
+void Sampler::remove(const ExecutionContext* ctx) {
+	std::lock_guard lock(_lock);
+	std::erase_if(_running, [&](const Running& run) { return run._ctx == ctx; });
+}
+
+void Sampler::add_code(const Function& func, const Block& blk, const uint8_t* hot,
+	size_t hot_size, const uint8_t* cold, size_t cold_size,
+	const std::map<std::string, uint32_t>& trace) {
+	// The entry block also has the code before the first block of the trace
+	std::map<uint32_t, const Block*> starts = {{0, &blk}};
+	for (auto& [name, offset] : trace) {
+		auto it = func._blocks.find(name);
+		if (it != func._blocks.end() && &it->second != &blk) {
+			starts[offset] = &it->second;
+		}
+	}
+
+	std::lock_guard lock(_lock);
+	for (auto it = starts.begin(); it != starts.end(); it++) {
+		auto next = std::next(it);
+		auto end = next == starts.end() ? hot_size : next->first;
+		_code[(uintptr_t)hot + it->first] = CodeRange{(uintptr_t)hot + end, it->second};
+	}
+	if (cold_size != 0) {
+		_code[(uintptr_t)cold] = CodeRange{(uintptr_t)cold + cold_size, &blk};
+	}
+}
+
+void Sampler::sample_loop() {
+	std::unique_lock lock(_lock);
+	// Ticks are counted from the start so a slow tick does not push back every later one
+	auto next = std::chrono::steady_clock::now();
+	while (true) {
+		next += _interval;
+		if (_wake.wait_until(lock, next, [this] { return _stop; })) {
+			return;
+		}
+		if (_running.empty()) {
+			_idle += 1;
+			continue;
+		}
+		for (auto& run : _running) {
+			sample(run);
+		}
+		// Behind by more than a tick, the machine is too busy to keep up and the ticks
+		// missed are dropped
+		auto now = std::chrono::steady_clock::now();
+		if (now > next + _interval) {
+			next = now;
+		}
+	}
+}
+
+void Sampler::sample(const Running& run) {
+	_samples += 1;
+	// Not in the program yet or any more, it is only waiting on `_lock`
+	if (run._ctx->_sample_at.load() == ST_IDLE) {
+		_other += 1;
+		return;
+	}
+	// Nothing here may allocate while the thread is stopped, it could hold the heap lock
+	if (SuspendThread(run._thread) == (DWORD)-1) {
+		_other += 1;
+		return;
+	}
+	CONTEXT regs = {};
+	regs.ContextFlags = CONTEXT_CONTROL;
+	auto stopped = GetThreadContext(run._thread, &regs);
+	auto at = run._ctx->_sample_at.load();
+	ResumeThread(run._thread);
+
+	auto tier = at & (ST_COUNT - 1);
+	auto blk = (const Block*)(at - tier);
+	auto code = _code.upper_bound((uintptr_t)regs.Rip);
+	if (stopped && code != _code.begin()) {
+		code--;
+		if (regs.Rip < code->second._end) {
+			blk = code->second._blk;
+			tier = ST_NATIVE;
+		}
+	}
+	auto samples = _blocks.find(blk);
+	if (tier == ST_IDLE || samples == _blocks.end()) {
+		_other += 1;
+		return;
+	}
+	samples->second._tiers[tier] += 1;
+}
+
+static double percent(uint64_t count, uint64_t total) {
+	return total ? count * 100.0 / total : 0;
+}
+
+void Sampler::report(std::ostream& os, size_t top) {
+	std::lock_guard lock(_lock);
+	uint64_t tiers[ST_COUNT] = {};
+	std::vector<const BlockSamples*> blocks;
+	for (auto& [blk, samples] : _blocks) {
+		for (size_t i = 0; i < ST_COUNT; i++) {
+			tiers[i] += samples._tiers[i];
+		}
+		if (samples.total() != 0) {
+			blocks.push_back(&samples);
+		}
+	}
+	tiers[ST_IDLE] = _other;
+	std::stable_sort(blocks.begin(), blocks.end(),
+		[](auto* a, auto* b) { return a->total() > b->total(); });
+
+	os << std::fixed << std::setprecision(2);
+	os << "samples: " << _samples << " every " << _interval.count() << "us, " << _idle
+	   << " ticks idle";
+	for (size_t i = ST_INTERP; i < ST_COUNT; i++) {
+		os << ", " << percent(tiers[i], _samples) << "% " << TIER_NAMES[i];
+	}
+	os << ", " << percent(tiers[ST_IDLE], _samples) << "% " << TIER_NAMES[ST_IDLE]
+	   << "\n";
+
+	os << "sampled blocks:\n";
+	os << "  " << std::setw(6) << "%" << std::setw(10) << "samples";
+	for (size_t i = ST_INTERP; i < ST_COUNT; i++) {
+		os << std::setw(10) << TIER_NAMES[i];
+	}
+	os << "  block\n";
+	for (size_t i = 0; i < blocks.size() && i < top; i++) {
+		auto* blk = blocks[i];
+		os << "  " << std::setw(6) << percent(blk->total(), _samples) << std::setw(10)
+		   << blk->total();
+		for (size_t j = ST_INTERP; j < ST_COUNT; j++) {
+			os << std::setw(10) << blk->_tiers[j];
+		}
+		os << "  " << blk->_name << "\n";
+	}
+	os << std::defaultfloat;
+}
+
+}
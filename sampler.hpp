@@ -0,0 +1,93 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Windows.h>
+
+#include "interp.hpp"
+
+namespace jit {
+
+// Samples of one block, by what the run was doing there
+struct BlockSamples {
+	std::string _name;
+	uint64_t _tiers[ST_COUNT] = {};
+
+	uint64_t total() const;
+};
+
+// Statistical profile of where runs spend their time, for runs too long or loops too
+// tight for the `Profiler`. Every `_interval` a thread of its own stops each thread that
+// is running a context, the way a SIGPROF handler would interrupt it, and counts the
+// block and tier it is in:
+// - in jitted code, the block the stopped address is in, from the code of every block
+//   compiled since `attach`
+// - anywhere else, the block the context said it entered last, runs of a sampled program
+//   keep that up to date
+struct Sampler {
+	// Where a compiled block of a trace ends and which block it is
+	struct CodeRange {
+		uintptr_t _end;
+		const Block* _blk;
+	};
+	struct Running {
+		const ExecutionContext* _ctx;
+		HANDLE _thread;
+	};
+
+	std::chrono::microseconds _interval;
+
+	std::mutex _lock;
+	std::condition_variable _wake;
+	bool _stop = false;
+	std::thread _thread;
+	// Contexts in `ExecutionContext::run`, added and removed by it
+	std::vector<Running> _running;
+	// Handles of every thread that ran a context, by thread id
+	std::map<DWORD, HANDLE> _threads;
+	// Jitted code by start address
+	std::map<uintptr_t, CodeRange> _code;
+	// Every block of the attached programs, samples elsewhere are `_other`
+	std::map<const Block*, BlockSamples> _blocks;
+	uint64_t _samples = 0;
+	uint64_t _other = 0;
+	// Ticks with nothing running
+	uint64_t _idle = 0;
+
+	Sampler(std::chrono::microseconds interval) : _interval(interval) {}
+	~Sampler();
+	Sampler(const Sampler&) = delete;
+	Sampler& operator=(const Sampler&) = delete;
+
+	// Sample the runs of `prog`, before anything of it runs.
+	void attach(Program& prog);
+	void start();
+	void stop();
+
+	// Called by a context on the thread running it.
+	void add(const ExecutionContext* ctx);
+	void remove(const ExecutionContext* ctx);
+
+	// Name the native code of `blk`. `trace` has the offset of every block that follows
+	// it into its hot code, the cold code is all `blk`.
+	void add_code(const Function& func, const Block& blk, const uint8_t* hot,
+		size_t hot_size, const uint8_t* cold, size_t cold_size,
+		const std::map<std::string, uint32_t>& trace);
+
+	// Blocks by samples, most sampled first.
+	void report(std::ostream& os, size_t top = 20);
+
+	// The sampling thread
+	void sample_loop();
+	void sample(const Running& run);
+};
+
+}
@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <bit>
+#include <iomanip>
+#include <mutex>
+#include <set>
+
+#include <Windows.h>
+#include <psapi.h>
+
+#include "stats.hpp"
+
+namespace jit {
+
+static const char* STAT_NAMES[STAT_COUNT] = {
+	"interp_instrs",
+	"native_instrs",
+	"blocks_entered",
+	"code_cache_hits",
+	"code_cache_misses",
+	"compiles",
+	"compile_failures",
+	"compile_ns",
+	"code_bytes",
+	"deopts",
+	"value_stack_growths",
+	"runs",
+	"resumes",
+};
+
+static const char* HISTOGRAM_NAMES[HIST_COUNT] = {
+	"compile_ns",
+	"code_bytes",
+};
+
+const char* stat_name(Stat stat) {
+	return STAT_NAMES[stat];
+}
+
+const char* histogram_name(StatHistogram hist) {
+	return HISTOGRAM_NAMES[hist];
+}
+
+void Histogram::add(uint64_t val) {
+	_buckets[std::bit_width(val)] += 1;
+	_count += 1;
+	_sum += val;
+	if (val > _max) {
+		_max = val;
+	}
+}
+
+void Histogram::merge(const Histogram& other) {
+	for (size_t i = 0; i < BUCKETS; i++) {
+		_buckets[i] += other._buckets[i];
+	}
+	_count += other._count;
+	_sum += other._sum;
+	_max = std::max(_max.load(), other._max.load());
+}
+
+void Stats::merge(const Stats& other) {
+	for (size_t i = 0; i < STAT_COUNT; i++) {
+		_counters[i] += other._counters[i];
+	}
+	for (size_t i = 0; i < HIST_COUNT; i++) {
+		_histograms[i].merge(other._histograms[i]);
+	}
+}
+
+void Stats::print(std::ostream& os) const {
+	os << "stats:\n";
+	for (size_t i = 0; i < STAT_COUNT; i++) {
+		os << "  " << std::left << std::setw(22) << STAT_NAMES[i] << std::right
+		   << std::setw(16) << _counters[i] << "\n";
+	}
+	os << "  " << std::left << std::setw(22) << "peak_rss" << std::right << std::setw(16)
+	   << peak_rss() << "\n";
+	for (size_t i = 0; i < HIST_COUNT; i++) {
+		auto& hist = _histograms[i];
+		auto mean = hist._count ? hist._sum / hist._count : 0;
+		os << HISTOGRAM_NAMES[i] << ": " << hist._count << " values, mean " << mean
+		   << ", max " << hist._max << "\n";
+		for (size_t b = 0; b < Histogram::BUCKETS; b++) {
+			if (hist._buckets[b] == 0) {
+				continue;
+			}
+			os << "  < " << std::left << std::setw(20)
+			   << (b < 64 ? std::to_string(1ull << b) : "2^64") << std::right
+			   << std::setw(16) << hist._buckets[b] << "\n";
+		}
+	}
+}
+
+// Stats of the threads still running and of those that exited, merged
+struct StatsRegistry {
+	std::mutex _lock;
+	std::set<const Stats*> _live;
+	Stats _exited;
+};
+
+static StatsRegistry& registry() {
+	static StatsRegistry registry;
+	return registry;
+}
+
+struct ThreadStats {
+	Stats _stats;
+
+	ThreadStats() {
+		std::lock_guard lock(registry()._lock);
+		registry()._live.insert(&_stats);
+	}
+	~ThreadStats() {
+		std::lock_guard lock(registry()._lock);
+		registry()._exited.merge(_stats);
+		registry()._live.erase(&_stats);
+	}
+};
+
+Stats& thread_stats() {
+	thread_local ThreadStats stats;
+	return stats._stats;
+}
+
+Stats collect_stats() {
+	std::lock_guard lock(registry()._lock);
+	auto stats = registry()._exited;
+	for (auto* live : registry()._live) {
+		stats.merge(*live);
+	}
+	return stats;
+}
+
+uint64_t peak_rss() {
+	PROCESS_MEMORY_COUNTERS counters = {};
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+		return 0;
+	}
+	return counters.PeakWorkingSetSize;
+}
+
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+
+#include "instrs.hpp"
+
+namespace jit {
+
+enum Stat {
+	// Instructions run by the interpreter and by native code
+	STAT_INTERP_INSTRS,
+	STAT_NATIVE_INSTRS,
+	// Blocks the interpreter entered, running them itself or through native code
+	STAT_BLOCKS_ENTERED,
+	// Blocks entered with native code and blocks that went to compile theirs
+	STAT_CODE_CACHE_HITS,
+	STAT_CODE_CACHE_MISSES,
+	STAT_COMPILES,
+	STAT_COMPILE_FAILURES,
+	STAT_COMPILE_NS,
+	// Hot and cold code of every block compiled
+	STAT_CODE_BYTES,
+	STAT_DEOPTS,
+	// Times a run grew its value stack, moving every register
+	STAT_VALUE_STACK_GROWTHS,
+	// Runs of `main` that finished, returning or failing, and times a run that stopped
+	// early was picked up again
+	STAT_RUNS,
+	STAT_RESUMES,
+	STAT_COUNT,
+};
+
+enum StatHistogram {
+	HIST_COMPILE_NS,
+	HIST_CODE_BYTES,
+	HIST_COUNT,
+};
+
+const char* stat_name(Stat stat);
+const char* histogram_name(StatHistogram hist);
+
+// Values by power of two, bucket `i` counts those in [2^(i-1), 2^i)
+struct Histogram {
+	static constexpr size_t BUCKETS = 65;
+
+	Relaxed<uint64_t> _buckets[BUCKETS];
+	Relaxed<uint64_t> _count;
+	Relaxed<uint64_t> _sum;
+	Relaxed<uint64_t> _max;
+
+	void add(uint64_t val);
+	void merge(const Histogram& other);
+};
+
+// Counters of one thread, or of all of them merged. The thread that owns them is the only
+// one to add to them, so adding is a plain load and store, but others may read them.
+struct Stats {
+	Relaxed<uint64_t> _counters[STAT_COUNT];
+	Histogram _histograms[HIST_COUNT];
+
+	void add(Stat stat, uint64_t by = 1) { _counters[stat] += by; }
+	void add(StatHistogram hist, uint64_t val) { _histograms[hist].add(val); }
+	uint64_t get(Stat stat) const { return _counters[stat]; }
+
+	void merge(const Stats& other);
+	void print(std::ostream& os) const;
+};
+
+// The stats of the calling thread. They are merged into those of exited threads when it
+// exits.
+Stats& thread_stats();
+// The stats of every thread so far, running or exited.
+Stats collect_stats();
+// Peak working set of the process in bytes.
+uint64_t peak_rss();
+
+}
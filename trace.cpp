@@ -0,0 +1,122 @@
+#include <cstdio>
+#include <fstream>
+
+#include <Windows.h>
+
+#include "trace.hpp"
+
+namespace jit {
+
+std::string json_string(std::string_view str) {
+	std::string out = "\"";
+	for (char c : str) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if ((unsigned char)c < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		} else {
+			out += c;
+		}
+	}
+	return out + "\"";
+}
+
+TraceArgs& TraceArgs::add(std::string_view key, std::string_view val) {
+	_json += (_json.empty() ? "" : ", ") + json_string(key) + ": " + json_string(val);
+	return *this;
+}
+
+TraceArgs& TraceArgs::add(std::string_view key, int64_t val) {
+	_json += (_json.empty() ? "" : ", ") + json_string(key) + ": " + std::to_string(val);
+	return *this;
+}
+
+void Tracer::open(const std::string& path) {
+	std::lock_guard lock(_lock);
+	_path = path;
+	_start = std::chrono::steady_clock::now();
+	_enabled = true;
+}
+
+uint64_t Tracer::now() const {
+	std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - _start;
+	return elapsed.count();
+}
+
+void Tracer::span(std::string_view name, const char* cat, uint64_t start,
+	const TraceArgs& args) {
+	auto end = now();
+	auto tid = (uint32_t)GetCurrentThreadId();
+	std::lock_guard lock(_lock);
+	if (_events.size() >= MAX_EVENTS) {
+		_dropped += 1;
+		return;
+	}
+	_events.push_back(
+		TraceEvent{std::string(name), cat, 'X', tid, start, end - start, args._json});
+}
+
+void Tracer::instant(std::string_view name, const char* cat, const TraceArgs& args) {
+	auto ts = now();
+	auto tid = (uint32_t)GetCurrentThreadId();
+	std::lock_guard lock(_lock);
+	if (_events.size() >= MAX_EVENTS) {
+		_dropped += 1;
+		return;
+	}
+	_events.push_back(TraceEvent{std::string(name), cat, 'i', tid, ts, 0, args._json});
+}
+
+// Trace timestamps are in microseconds, fractions keep the nanoseconds
+static void write_us(std::ostream& os, uint64_t ns) {
+	os << ns / 1000 << "." << (char)('0' + ns / 100 % 10) << (char)('0' + ns / 10 % 10)
+	   << (char)('0' + ns % 10);
+}
+
+tl::expected<void, Error> Tracer::write() {
+	std::lock_guard lock(_lock);
+	if (!_enabled) {
+		return tl::expected<void, Error>();
+	}
+	std::ofstream os(_path, std::ios::trunc);
+	if (!os.is_open()) {
+		return tl::make_unexpected(Error(ErrorKind::EK_IO, "failed to create " + _path));
+	}
+	auto pid = GetCurrentProcessId();
+	os << "{\"traceEvents\": [\n";
+	os << "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << pid
+	   << ", \"tid\": 0, \"args\": {\"name\": \"jitjit\"}}";
+	for (auto& ev : _events) {
+		os << ",\n  {\"name\": " << json_string(ev._name) << ", \"cat\": \"" << ev._cat
+		   << "\", \"ph\": \"" << ev._phase << "\", \"ts\": ";
+		write_us(os, ev._ts_ns);
+		if (ev._phase == 'X') {
+			os << ", \"dur\": ";
+			write_us(os, ev._dur_ns);
+		} else {
+			// Instants only mark their own thread
+			os << ", \"s\": \"t\"";
+		}
+		os << ", \"pid\": " << pid << ", \"tid\": " << ev._tid;
+		if (!ev._args.empty()) {
+			os << ", \"args\": {" << ev._args << "}";
+		}
+		os << "}";
+	}
+	os << "\n],\n\"displayTimeUnit\": \"ns\",\n\"otherData\": {\"dropped_events\": "
+	   << _dropped << "}}\n";
+	if (!os) {
+		return tl::make_unexpected(Error(ErrorKind::EK_IO, "failed to write " + _path));
+	}
+	return tl::expected<void, Error>();
+}
+
+Tracer& tracer() {
+	static Tracer tracer;
+	return tracer;
+}
+
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "expected.hpp"
+#include "interp.hpp"
+
+namespace jit {
+
+// `str` quoted for JSON
+std::string json_string(std::string_view str);
+
+// The `args` of an event, an object of JSON members
+struct TraceArgs {
+	std::string _json;
+
+	TraceArgs& add(std::string_view key, std::string_view val);
+	TraceArgs& add(std::string_view key, const char* val) {
+		return add(key, std::string_view(val));
+	}
+	TraceArgs& add(std::string_view key, int64_t val);
+};
+
+struct TraceEvent {
+	std::string _name;
+	const char* _cat;
+	// 'X' for a span, 'i' for an instant
+	char _phase;
+	uint32_t _tid;
+	uint64_t _ts_ns;
+	uint64_t _dur_ns;
+	std::string _args;
+};
+
+// A timeline of where the time of the process goes, from loading and compiling to running
+// and writing out. It is written in the Chrome trace event format, which Perfetto and
+// chrome://tracing open, with every event on the thread it happened on.
+//
+// Events are kept in memory until `write`. A hot program can enter native code millions
+// of times, so past `MAX_EVENTS` they are only counted.
+struct Tracer {
+	static constexpr size_t MAX_EVENTS = 1 << 20;
+
+	std::mutex _lock;
+	std::string _path;
+	std::atomic<bool> _enabled = false;
+	std::chrono::steady_clock::time_point _start;
+	std::vector<TraceEvent> _events;
+	uint64_t _dropped = 0;
+
+	// Start recording, the trace goes to `path`.
+	void open(const std::string& path);
+	bool enabled() const { return _enabled.load(std::memory_order_relaxed); }
+
+	// Nanoseconds since `open`
+	uint64_t now() const;
+
+	// A span of this thread from `start` until now.
+	void span(std::string_view name, const char* cat, uint64_t start,
+		const TraceArgs& args = {});
+	void instant(std::string_view name, const char* cat, const TraceArgs& args = {});
+
+	tl::expected<void, Error> write();
+};
+
+// The one for this process, nothing is recorded until it is opened.
+Tracer& tracer();
+
+// Records a span of the scope when tracing, `_args` can be added to until it ends.
+struct TraceScope {
+	const char* _name;
+	const char* _cat;
+	bool _on;
+	uint64_t _start;
+	TraceArgs _args;
+
+	TraceScope(const char* name, const char* cat)
+		: _name(name), _cat(cat), _on(tracer().enabled()),
+		  _start(_on ? tracer().now() : 0) {}
+	~TraceScope() {
+		if (_on) {
+			tracer().span(_name, _cat, _start, _args);
+		}
+	}
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+};
+
+}
@@ -0,0 +1,180 @@
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "expected.hpp"
+#include "instrs.hpp"
+#include "interp.hpp"
+#include "passes.hpp"
+#include "verify.hpp"
+
+namespace jit {
+
+static Error invalid(const Function& func, const Block& blk, const std::string& what) {
+	return Error(ErrorKind::EK_INVALID_INST, func._name + " " + blk._name + ": " + what);
+}
+
+static bool falls_through(const Block& blk) {
+	return blk._instrs.empty() ||
+		   !(op_info(blk._instrs.back()->_kind)._flags & OF_RETURN);
+}
+
+// Whether some path through `func` returns without a value.
+static bool returns_void(const Function& func) {
+	return std::ranges::any_of(func._blocks, [](const auto& p) {
+		return std::ranges::any_of(p.second._instrs,
+			[](const Instruction* inst) { return inst->_kind == InstrKind::IK_RET; });
+	});
+}
+
+// Operand kinds, branch targets and callees, these only need the instruction itself.
+static tl::expected<void, Error> check_instrs(const Function& func, const Block& blk,
+	const std::map<std::string, Function>& funcs) {
+	for (auto* inst : blk._instrs) {
+		auto& op = op_info(inst->_kind);
+		auto ops = operands_of(inst);
+		switch (op._shape) {
+			case OS_DIRECTIVE: {
+				return tl::make_unexpected(
+					invalid(func, blk, "directive inside a block"));
+			}
+			case OS_I_R:
+			case OS_RI_R: {
+				if (ops._imm._kind != ValKind::VK_INT) {
+					return tl::make_unexpected(
+						invalid(func, blk, "non integer immediate"));
+				}
+				break;
+			}
+			case OS_R_L: {
+				if (ops._label.empty()) {
+					return tl::make_unexpected(
+						invalid(func, blk, "cbr with non location jump"));
+				}
+				if (!func._blocks.contains(std::string(ops._label))) {
+					return tl::make_unexpected(invalid(
+						func, blk, "cbr to unknown block " + std::string(ops._label)));
+				}
+				break;
+			}
+			case OS_CALL:
+			case OS_CALL_R: {
+				auto callee = funcs.find(std::string(ops._label));
+				if (callee == funcs.end()) {
+					auto name = std::string(ops._label);
+					return tl::make_unexpected(
+						invalid(func, blk, "call to unknown function " + name));
+				}
+				if (ops._args.size() != callee->second._args.size()) {
+					return tl::make_unexpected(invalid(func, blk,
+						"wrong number of arguments to " + std::string(ops._label)));
+				}
+				if (op._shape == OS_CALL_R && returns_void(callee->second)) {
+					return tl::make_unexpected(invalid(func, blk,
+						std::string(ops._label) + " may return without a value"));
+				}
+				break;
+			}
+			default: {
+				break;
+			}
+		}
+	}
+	return tl::expected<void, Error>();
+}
+
+// Registers written on every path from the entry to the start of each reachable block.
+// Blocks start out with whatever their first visited predecessor defines and only lose
+// registers after that, so this settles.
+static std::map<std::string, std::set<Reg>> defined_on_entry(
+	const Function& func, const CFG& cfg) {
+	std::map<std::string, std::set<Reg>> defined;
+	// Nothing passes arguments to `main`
+	auto& entry = defined["__start__"];
+	if (func._name != "main") {
+		entry.insert(func._args.begin(), func._args.end());
+	}
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (auto& name : cfg._rpo) {
+			auto out = defined.at(name);
+			for (auto* inst : func._blocks.at(name)._instrs) {
+				if (auto def = inst->def()) {
+					out.insert(*def);
+				}
+			}
+			for (auto& succ : cfg._succs.at(name)) {
+				auto in = defined.find(succ);
+				if (in == defined.end()) {
+					defined.emplace(succ, out);
+					changed = true;
+					continue;
+				}
+				auto before = in->second.size();
+				std::erase_if(in->second, [&](const Reg& r) { return !out.contains(r); });
+				changed |= in->second.size() != before;
+			}
+		}
+	}
+	return defined;
+}
+
+static tl::expected<void, Error> check_defined(const Function& func, const CFG& cfg) {
+	auto defined = defined_on_entry(func, cfg);
+	std::vector<Reg> uses;
+	for (auto& name : cfg._rpo) {
+		auto& blk = func._blocks.at(name);
+		if (falls_through(blk) && !func._blocks.contains(blk._fallthrough)) {
+			return tl::make_unexpected(
+				invalid(func, blk, "falls off the end of the function"));
+		}
+
+		auto& live = defined.at(name);
+		for (auto* inst : blk._instrs) {
+			uses.clear();
+			inst->uses(uses);
+			for (auto& r : uses) {
+				if (!live.contains(r)) {
+					auto name = "Reg(" + std::to_string(r._reg) + ")";
+					return tl::make_unexpected(
+						invalid(func, blk, name + " may be read before written"));
+				}
+			}
+			if (auto def = inst->def()) {
+				live.insert(*def);
+			}
+		}
+	}
+	return tl::expected<void, Error>();
+}
+
+tl::expected<void, Error> verify_program(const std::map<std::string, Function>& funcs) {
+	if (!funcs.contains("main")) {
+		return tl::make_unexpected(Error(ErrorKind::EK_INVALID_INST, "no main function"));
+	}
+
+	for (auto& [fname, func] : funcs) {
+		if (!func._blocks.contains("__start__")) {
+			return tl::make_unexpected(
+				Error(ErrorKind::EK_INVALID_INST, fname + " has no entry block"));
+		}
+		for (auto& [bname, blk] : func._blocks) {
+			auto res = check_instrs(func, blk, funcs);
+			if (!res) {
+				return tl::make_unexpected(res.error());
+			}
+		}
+
+		auto res = check_defined(func, CFG(func));
+		if (!res) {
+			return tl::make_unexpected(res.error());
+		}
+	}
+	return tl::expected<void, Error>();
+}
+
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <map>
+#include <string>
+
+#include "expected.hpp"
+#include "interp.hpp"
+
+namespace jit {
+
+// Prove before running that `funcs` can not hit a run time error in the interpreter:
+//
+//   - every block holds only executable instructions
+//   - every immediate is an integer, so every register only ever holds one
+//   - every `cbr` target exists and no reachable block falls off its function
+//   - every call passes as many arguments as its function takes, and a function whose
+//     value an `icall` reads always returns one
+//   - every register read is written first on all paths from the function entry
+tl::expected<void, Error> verify_program(const std::map<std::string, Function>& funcs);
+
+}